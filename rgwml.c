@@ -0,0 +1,2161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <linux/futex.h>
+#include <mysql/mysql.h>
+#include <mysql/errmsg.h>
+#include <mysql/mysqld_error.h>
+#include <cjson/cJSON.h>
+#include "rgwml_internal.h"
+
+// An empty result with the headers and types of `fields`
+QueryResult* query_result_new(const MYSQL_FIELD *fields, int cols_count) {
+    QueryResult *result = (QueryResult *)calloc(1, sizeof(QueryResult));
+    if (!result) {
+        fprintf(stderr, "Memory allocation for result failed\n");
+        return NULL;
+    }
+    result->cols_count = cols_count;
+    result->headers = (char **)calloc(cols_count, sizeof(char *));
+    result->mysql_types = (char **)calloc(cols_count, sizeof(char *));
+    result->c_types = (char **)calloc(cols_count, sizeof(char *));
+    result->decimal_precision = (unsigned char *)calloc(cols_count, 1);
+    result->decimal_scale = (unsigned char *)calloc(cols_count, 1);
+    result->binary = (unsigned char *)calloc(cols_count, 1);
+
+    if (!result->headers || !result->mysql_types || !result->c_types || !result->decimal_precision ||
+        !result->decimal_scale || !result->binary) {
+        fprintf(stderr, "Memory allocation for headers or types failed\n");
+        free_query_result(result);
+        return NULL;
+    }
+
+    for (int i = 0; i < cols_count; i++) {
+        result->headers[i] = strdup(fields[i].name);
+        TypeMapping mapping = mysql_type_to_c_type(fields[i].type);
+        result->mysql_types[i] = strdup(mapping.mysql_type);
+        result->c_types[i] = strdup(mapping.c_type);
+        if (!result->headers[i] || !result->mysql_types[i] || !result->c_types[i]) {
+            fprintf(stderr, "strdup failed for header[%d], mysql_type[%d], or c_type[%d]\n", i, i, i);
+            free_query_result(result);
+            return NULL;
+        }
+        if (fields[i].type == MYSQL_TYPE_DECIMAL || fields[i].type == MYSQL_TYPE_NEWDECIMAL) {
+            // The display length counts the point and, when signed, the minus
+            unsigned long precision = fields[i].length - (fields[i].decimals > 0) - !(fields[i].flags & UNSIGNED_FLAG);
+            result->decimal_precision[i] = (unsigned char)(precision < 255 ? precision : 255);
+            result->decimal_scale[i] = (unsigned char)fields[i].decimals;
+        }
+        result->binary[i] = fields[i].charsetnr == 63 &&
+            (fields[i].type == MYSQL_TYPE_STRING || fields[i].type == MYSQL_TYPE_VAR_STRING ||
+             fields[i].type == MYSQL_TYPE_TINY_BLOB || fields[i].type == MYSQL_TYPE_BLOB ||
+             fields[i].type == MYSQL_TYPE_MEDIUM_BLOB || fields[i].type == MYSQL_TYPE_LONG_BLOB);
+    }
+    return result;
+}
+
+// The cells of row `row`, which must be below rows_count
+char** query_result_row(const QueryResult *result, unsigned long long row) {
+    return result->chunks[row / result->rows_per_chunk] + (size_t)(row % result->rows_per_chunk) * result->cols_count;
+}
+
+// The byte lengths of row `row`'s cells, which keep binary cells whole
+unsigned long* query_result_lengths(const QueryResult *result, unsigned long long row) {
+    return result->chunk_lengths[row / result->rows_per_chunk] +
+           (size_t)(row % result->rows_per_chunk) * result->cols_count;
+}
+
+// Space for the cells of row rows_count, adding a chunk when the last one is
+// full. The caller fills the cells and their lengths (query_result_lengths)
+// and then increments rows_count.
+char** query_result_append_row(QueryResult *result) {
+    if (result->rows_per_chunk == 0) {
+        size_t rows = result->cols_count < RESULT_CHUNK_CELLS ? RESULT_CHUNK_CELLS / result->cols_count : 1;
+        result->rows_per_chunk = rows < RESULT_CHUNK_ROWS ? rows : RESULT_CHUNK_ROWS;
+    }
+    size_t chunk = (size_t)(result->rows_count / result->rows_per_chunk);
+    if (chunk == result->chunks_count) {
+        if (result->chunks_count == result->chunks_cap) {
+            size_t cap = result->chunks_cap ? result->chunks_cap * 2 : 16;
+            char ***chunks = (char ***)realloc(result->chunks, cap * sizeof(char **));
+            if (!chunks) {
+                return NULL;
+            }
+            result->chunks = chunks;
+            unsigned long **lengths = (unsigned long **)realloc(result->chunk_lengths, cap * sizeof(unsigned long *));
+            if (!lengths) {
+                return NULL;
+            }
+            result->chunk_lengths = lengths;
+            result->chunks_cap = cap;
+        }
+        size_t cells = result->rows_per_chunk * result->cols_count;
+        RGWML_PROBE2(alloc__grow, "result chunk", cells * (sizeof(char *) + sizeof(unsigned long)));
+        result->chunks[chunk] = (char **)malloc(cells * sizeof(char *));
+        result->chunk_lengths[chunk] = (unsigned long *)malloc(cells * sizeof(unsigned long));
+        if (!result->chunks[chunk] || !result->chunk_lengths[chunk]) {
+            free(result->chunks[chunk]);
+            free(result->chunk_lengths[chunk]);
+            return NULL;
+        }
+        result->chunks_count++;
+    }
+    return result->chunks[chunk] + (size_t)(result->rows_count % result->rows_per_chunk) * result->cols_count;
+}
+
+void free_query_result(QueryResult *result) {
+    if (!result) return;
+    for (unsigned long long row = 0; row < result->rows_count; row++) {
+        char **cells = query_result_row(result, row);
+        for (int i = 0; i < result->cols_count; i++) {
+            free(cells[i]);
+        }
+    }
+    for (int i = 0; result->headers && result->mysql_types && result->c_types && i < result->cols_count; i++) {
+        free(result->headers[i]);
+        free(result->mysql_types[i]);
+        free(result->c_types[i]);
+    }
+    for (size_t i = 0; i < result->chunks_count; i++) {
+        free(result->chunks[i]);
+        free(result->chunk_lengths[i]);
+    }
+    free(result->chunks);
+    free(result->chunk_lengths);
+    free(result->headers);
+    free(result->mysql_types);
+    free(result->c_types);
+    free(result->server_stats);
+    free(result->decimal_precision);
+    free(result->decimal_scale);
+    free(result->binary);
+    free(result->max_lengths);
+    free(result);
+}
+
+char* read_file(const char* filename) {
+    FILE* file = fopen(filename, "rb");
+    if (!file) {
+        fprintf(stderr, "Could not open file %s\n", filename);
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* content = (char*)malloc(length + 1);
+    if (!content) {
+        fprintf(stderr, "Memory allocation failed\n");
+        fclose(file);
+        return NULL;
+    }
+    fread(content, 1, length, file);
+    fclose(file);
+    content[length] = '\0';
+    return content;
+}
+
+cJSON* get_db_preset(cJSON *json, const char* preset_name) {
+    cJSON *db_presets = cJSON_GetObjectItemCaseSensitive(json, "db_presets");
+    cJSON *preset = NULL;
+    cJSON_ArrayForEach(preset, db_presets) {
+        cJSON *name = cJSON_GetObjectItemCaseSensitive(preset, "name");
+        if (cJSON_IsString(name) && (strcmp(name->valuestring, preset_name) == 0)) {
+            return preset;
+        }
+    }
+    return NULL;
+}
+
+const char* preset_string(cJSON *preset, const char *key) {
+    cJSON *item = cJSON_GetObjectItemCaseSensitive(preset, key);
+    return cJSON_IsString(item) ? item->valuestring : NULL;
+}
+
+int is_preset_group(cJSON *preset) {
+    const char *type = preset_string(preset, "type");
+    return type && strcmp(type, "group") == 0;
+}
+
+// Load a preset; a preset group resolves to its primary
+int load_db_preset(cJSON *config, const char *preset_name, DbPreset *out) {
+    cJSON *preset = get_db_preset(config, preset_name);
+    if (!preset) {
+        fprintf(stderr, "Preset not found: %s\n", preset_name);
+        return -1;
+    }
+    if (is_preset_group(preset)) {
+        const char *primary = preset_string(preset, "primary");
+        cJSON *primary_preset = primary ? get_db_preset(config, primary) : NULL;
+        if (!primary_preset || is_preset_group(primary_preset)) {
+            fprintf(stderr, "Preset group %s must name a plain preset as its primary\n", preset_name);
+            return -1;
+        }
+        return load_db_preset(config, primary, out);
+    }
+    out->name = preset_name;
+    out->host = preset_string(preset, "host");
+    out->user = preset_string(preset, "username");
+    out->password = preset_string(preset, "password");
+    out->database = preset_string(preset, "database");
+    if (!out->host || !out->user || !out->password || !out->database) {
+        fprintf(stderr, "Preset %s must define host, username, password and database\n", preset_name);
+        return -1;
+    }
+    return 0;
+}
+
+cJSON* load_config(const char *config_path) {
+    char *config_content = read_file(config_path);
+    if (!config_content) {
+        fprintf(stderr, "Failed to read config file\n");
+        return NULL;
+    }
+    cJSON *config_json = cJSON_Parse(config_content);
+    free(config_content);
+    if (!config_json) {
+        fprintf(stderr, "Could not parse JSON\n");
+    }
+    return config_json;
+}
+
+MYSQL* connect_db(const DbPreset *db, int flags) {
+    MYSQL *conn = mysql_init(NULL);
+    if (!conn) {
+        fprintf(stderr, "mysql_init() failed\n");
+        return NULL;
+    }
+    mysql_options(conn, MYSQL_SET_CHARSET_NAME, "utf8mb4");
+    if (flags & CONNECT_LOCAL_INFILE) {
+        unsigned int enable = 1;
+        mysql_options(conn, MYSQL_OPT_LOCAL_INFILE, &enable);
+    }
+    if (!mysql_real_connect(conn, db->host, db->user, db->password, db->database, 0, NULL, 0)) {
+        fprintf(stderr, "Connection to %s failed: %s\n", db->name, mysql_error(conn));
+        mysql_close(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// printf into a freshly allocated string
+char* format_string(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (len < 0) {
+        return NULL;
+    }
+    char *out = (char *)malloc((size_t)len + 1);
+    if (!out) {
+        fprintf(stderr, "Memory allocation for string failed\n");
+        return NULL;
+    }
+    va_start(args, format);
+    vsnprintf(out, (size_t)len + 1, format, args);
+    va_end(args);
+    return out;
+}
+
+// `name` with embedded backticks doubled
+char* quote_identifier(const char *name) {
+    char *out = (char *)malloc(strlen(name) * 2 + 3);
+    if (!out) {
+        return NULL;
+    }
+    char *p = out;
+    *p++ = '`';
+    for (; *name; name++) {
+        if (*name == '`') {
+            *p++ = '`';
+        }
+        *p++ = *name;
+    }
+    *p++ = '`';
+    *p = '\0';
+    return out;
+}
+
+// A table name as given on the command line, optionally schema-qualified
+// ("db.table"), quoted part by part
+char* quote_table_name(const char *name) {
+    const char *dot = strchr(name, '.');
+    if (!dot) {
+        return quote_identifier(name);
+    }
+    char *schema = strndup(name, (size_t)(dot - name));
+    char *quoted_schema = schema ? quote_identifier(schema) : NULL;
+    char *quoted_table = quote_identifier(dot + 1);
+    char *out = quoted_schema && quoted_table ? format_string("%s.%s", quoted_schema, quoted_table) : NULL;
+    free(schema);
+    free(quoted_schema);
+    free(quoted_table);
+    return out;
+}
+
+void sleep_ms(unsigned long ms) {
+    struct timespec ts = { ms / 1000, (long)(ms % 1000) * 1000000L };
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+    }
+}
+
+// Errors after which simply running the statement again may succeed
+int is_retryable_error(unsigned int error) {
+    return error == CR_SERVER_GONE_ERROR || error == CR_SERVER_LOST ||
+           error == ER_LOCK_DEADLOCK || error == ER_LOCK_WAIT_TIMEOUT;
+}
+
+// ---- SQL scanning helpers ----
+
+const char* skip_space(const char *p) {
+    while (isspace((unsigned char)*p)) {
+        p++;
+    }
+    return p;
+}
+
+// Case-insensitive keyword match that respects word boundaries
+int match_keyword(const char *p, const char *keyword) {
+    size_t len = strlen(keyword);
+    if (strncasecmp(p, keyword, len) != 0) {
+        return 0;
+    }
+    return !(isalnum((unsigned char)p[len]) || p[len] == '_' || p[len] == '$');
+}
+
+// Skip a possibly quoted, possibly qualified (db.table) identifier
+const char* skip_identifier(const char *p) {
+    const char *start = p;
+    for (;;) {
+        if (*p == '`') {
+            for (p++; *p; p++) {
+                if (*p == '`' && p[1] == '`') {
+                    p++;
+                } else if (*p == '`') {
+                    break;
+                }
+            }
+            if (!*p) {
+                return NULL;
+            }
+            p++;
+        } else {
+            while (isalnum((unsigned char)*p) || *p == '_' || *p == '$') {
+                p++;
+            }
+        }
+        if (*p != '.') {
+            break;
+        }
+        p++;
+    }
+    return p > start ? p : NULL;
+}
+
+// Find `keyword` outside of string literals, quoted identifiers and parentheses
+const char* find_top_level_keyword(const char *p, const char *keyword) {
+    int depth = 0;
+    for (const char *prev = NULL; *p; prev = p, p++) {
+        if (*p == '\'' || *p == '"' || *p == '`') {
+            char quote = *p;
+            for (p++; *p && *p != quote; p++) {
+                if (*p == '\\' && quote != '`' && p[1]) {
+                    p++;
+                }
+            }
+            if (!*p) {
+                return NULL;
+            }
+        } else if (*p == '(') {
+            depth++;
+        } else if (*p == ')') {
+            depth--;
+        } else if (depth == 0 && (!prev || !(isalnum((unsigned char)*prev) || *prev == '_')) &&
+                   match_keyword(p, keyword)) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// ---- Throttling ----
+// Paces long-running loops against a rows/s and/or bytes/s budget. When a
+// server-load limit is set, a side connection polls Threads_running and the
+// replica lag (at most once per THROTTLE_POLL_INTERVAL) and the loop pauses
+// with growing backoff while either is over its limit.
+
+#define THROTTLE_POLL_INTERVAL 1.0
+#define THROTTLE_MAX_BACKOFF_MS 5000
+
+int throttle_enabled(const ThrottleOptions *options) {
+    return options->max_rows_per_sec > 0 || options->max_bytes_per_sec > 0 ||
+           options->max_threads_running > 0 || options->max_replica_lag > 0;
+}
+
+int throttle_init(Throttle *throttle, const ThrottleOptions *options, cJSON *config, const DbPreset *db) {
+    memset(throttle, 0, sizeof(*throttle));
+    throttle->options = *options;
+    throttle->monitor_db = *db;
+    if (options->monitor_preset && load_db_preset(config, options->monitor_preset, &throttle->monitor_db) != 0) {
+        return -1;
+    }
+    throttle->window_start = now_seconds();
+    return 0;
+}
+
+// Single numeric column `column` of the first row returned by `sql`;
+// -1 when there is no row, -2 on error, -3 when the value is NULL
+long long monitor_value(MYSQL *conn, const char *sql, const char *column) {
+    if (mysql_query(conn, sql)) {
+        return -2;
+    }
+    MYSQL_RES *res = mysql_store_result(conn);
+    if (!res) {
+        return -2;
+    }
+    long long value = -1;
+    MYSQL_ROW row = mysql_fetch_row(res);
+    MYSQL_FIELD *fields = mysql_fetch_fields(res);
+    for (unsigned int i = 0; row && i < mysql_num_fields(res); i++) {
+        if (strcmp(fields[i].name, column) == 0) {
+            value = row[i] ? strtoll(row[i], NULL, 10) : -3;
+        }
+    }
+    mysql_free_result(res);
+    return value;
+}
+
+// Describe why the monitored server is too busy, or return 0 when it is not
+int throttle_server_busy(Throttle *throttle, char *reason, size_t reason_size) {
+    const ThrottleOptions *options = &throttle->options;
+    if (options->max_threads_running == 0 && options->max_replica_lag == 0) {
+        return 0;
+    }
+    if (!throttle->monitor && !throttle->monitor_failed) {
+        throttle->monitor = connect_db(&throttle->monitor_db, 0);
+        if (!throttle->monitor) {
+            fprintf(stderr, "Load monitoring disabled: no connection to %s\n", throttle->monitor_db.name);
+            throttle->monitor_failed = 1;
+        }
+    }
+    if (!throttle->monitor) {
+        return 0;
+    }
+
+    if (options->max_threads_running > 0) {
+        long long running = monitor_value(throttle->monitor, "SHOW GLOBAL STATUS LIKE 'Threads_running'", "Value");
+        if (running > (long long)options->max_threads_running) {
+            snprintf(reason, reason_size, "Threads_running %lld > %llu", running, options->max_threads_running);
+            return 1;
+        }
+    }
+    if (options->max_replica_lag > 0 && !throttle->not_a_replica) {
+        long long lag = monitor_value(throttle->monitor, "SHOW REPLICA STATUS", "Seconds_Behind_Source");
+        if (lag == -2) {
+            // Servers older than MySQL 8.0.22 only know the old wording
+            lag = monitor_value(throttle->monitor, "SHOW SLAVE STATUS", "Seconds_Behind_Master");
+        }
+        if (lag == -1 || lag == -2) {
+            fprintf(stderr, "%s does not report replica lag; ignoring --max-replica-lag\n", throttle->monitor_db.name);
+            throttle->not_a_replica = 1;
+        } else if (lag == -3) {
+            snprintf(reason, reason_size, "replication is not running");
+            return 1;
+        } else if (lag > (long long)options->max_replica_lag) {
+            snprintf(reason, reason_size, "replica lag %llds > %llus", lag, options->max_replica_lag);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Account for `rows`/`bytes` of progress and sleep as long as the limits ask
+void throttle_wait(Throttle *throttle, unsigned long long rows, unsigned long long bytes) {
+    if (!throttle) return;
+    const ThrottleOptions *options = &throttle->options;
+    throttle->window_rows += rows;
+    throttle->window_bytes += bytes;
+
+    double now = now_seconds();
+    double due = 0.0;
+    if (options->max_rows_per_sec > 0) {
+        due = throttle->window_rows / options->max_rows_per_sec;
+    }
+    if (options->max_bytes_per_sec > 0 && throttle->window_bytes / options->max_bytes_per_sec > due) {
+        due = throttle->window_bytes / options->max_bytes_per_sec;
+    }
+    double ahead = throttle->window_start + due - now;
+    if (ahead > 0) {
+        sleep_ms((unsigned long)(ahead * 1000.0));
+        throttle->rate_wait += ahead;
+        now = now_seconds();
+    }
+
+    if (now < throttle->next_poll) {
+        return;
+    }
+    char reason[128];
+    unsigned long backoff = 250;
+    double paused_at = now;
+    int announced = 0;
+    while (throttle_server_busy(throttle, reason, sizeof(reason))) {
+        if (!announced) {
+            fprintf(stderr, "Pausing: %s\n", reason);
+            announced = 1;
+        }
+        sleep_ms(backoff);
+        backoff = backoff * 2 > THROTTLE_MAX_BACKOFF_MS ? THROTTLE_MAX_BACKOFF_MS : backoff * 2;
+    }
+    now = now_seconds();
+    if (announced) {
+        fprintf(stderr, "Resuming after %.1fs\n", now - paused_at);
+        throttle->load_wait += now - paused_at;
+        // Start a new rate window so the pause is not made up with a burst
+        throttle->window_start = now;
+        throttle->window_rows = 0;
+        throttle->window_bytes = 0;
+    }
+    throttle->next_poll = now + THROTTLE_POLL_INTERVAL;
+}
+
+// throttle_wait() sleeps with a mysql_use_result() stream open, and the server
+// drops a stream it cannot write to for net_write_timeout seconds. Load
+// pauses can outlast copy's 600 s, so allow an hour. Call on the streaming
+// connection before its query.
+void throttle_prepare_stream(const Throttle *throttle, MYSQL *conn) {
+    if (throttle && mysql_query(conn, "SET SESSION net_write_timeout = 3600") != 0) {
+        fprintf(stderr, "Could not raise net_write_timeout: %s\n", mysql_error(conn));
+    }
+}
+
+// Set up *throttle when any limit is configured; *active is then the
+// throttle to pass around, or NULL when there is nothing to enforce
+int throttle_setup(Throttle *throttle, const ThrottleOptions *options, cJSON *config, const DbPreset *db, Throttle **active) {
+    *active = NULL;
+    if (!throttle_enabled(options)) {
+        return 0;
+    }
+    if (throttle_init(throttle, options, config, db) != 0) {
+        return -1;
+    }
+    *active = throttle;
+    return 0;
+}
+
+void throttle_close(Throttle *throttle) {
+    if (!throttle) return;
+    if (throttle->monitor) {
+        mysql_close(throttle->monitor);
+        throttle->monitor = NULL;
+    }
+    if (throttle->rate_wait > 0.05 || throttle->load_wait > 0.05) {
+        fprintf(stderr, "Throttled: %.1fs for rate limits, %.1fs for server load\n", throttle->rate_wait, throttle->load_wait);
+    }
+}
+
+// ---- Query cancellation ----
+// A watchdog thread waits for the --timeout deadline or for Ctrl-C and then
+// sends KILL QUERY for the running statement over a separate connection, so
+// the server stops working on it too. The fetch loop sees the interrupted
+// statement as an error and keeps the rows it already has. The first SIGINT
+// only cancels; the handler resets itself, so a second one ends the process.
+// Only the CLI installs the handler, so library queries leave the slot for
+// the guard Ctrl-C wakes alone, and one guard holds it at a time.
+// With neither a timeout nor the handler there is nothing to wait for, and
+// no watchdog thread is started.
+
+volatile sig_atomic_t interrupted = 0;
+int sigint_installed = 0;
+sem_t *interrupt_sem = NULL;
+
+void handle_sigint(int sig) {
+    (void)sig;
+    interrupted = 1;
+    sem_t *sem = __atomic_load_n(&interrupt_sem, __ATOMIC_SEQ_CST);
+    if (sem) {
+        sem_post(sem);
+    }
+}
+
+void install_sigint_handler(void) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_sigint;
+    action.sa_flags = SA_RESETHAND;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigint_installed = 1;
+}
+
+void* query_guard_main(void *arg) {
+    QueryGuard *guard = (QueryGuard *)arg;
+    if (guard->timeout_ms > 0) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += guard->timeout_ms / 1000;
+        deadline.tv_nsec += (long)(guard->timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (sem_timedwait(&guard->wake, &deadline) == -1 && errno == EINTR) {
+        }
+    } else {
+        while (sem_wait(&guard->wake) == -1 && errno == EINTR) {
+        }
+    }
+    if (guard->finished) {
+        return NULL;
+    }
+
+    guard->reason = interrupted ? "interrupted" : "timeout";
+    mysql_thread_init();
+    MYSQL *side = connect_db(guard->db, 0);
+    if (side) {
+        char sql[64];
+        snprintf(sql, sizeof(sql), "KILL QUERY %lu", guard->thread_id);
+        if (mysql_query(side, sql)) {
+            fprintf(stderr, "KILL QUERY failed: %s\n", mysql_error(side));
+        } else {
+            guard->cancelled = 1;
+        }
+        mysql_close(side);
+    }
+    mysql_thread_end();
+    return NULL;
+}
+
+int query_guard_start(QueryGuard *guard, const DbPreset *db, MYSQL *conn, unsigned long long timeout_ms) {
+    memset(guard, 0, sizeof(*guard));
+    guard->db = db;
+    guard->thread_id = mysql_thread_id(conn);
+    guard->timeout_ms = timeout_ms;
+    guard->watching = timeout_ms > 0 || sigint_installed;
+    if (!guard->watching) {
+        return 0;
+    }
+    if (sem_init(&guard->wake, 0, 0) != 0) {
+        return -1;
+    }
+    if (pthread_create(&guard->thread, NULL, query_guard_main, guard) != 0) {
+        sem_destroy(&guard->wake);
+        return -1;
+    }
+    sem_t *none = NULL;
+    guard->owns_interrupt = sigint_installed &&
+        __atomic_compare_exchange_n(&interrupt_sem, &none, &guard->wake, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    if (sigint_installed && interrupted) {
+        sem_post(&guard->wake);
+    }
+    return 0;
+}
+
+void query_guard_stop(QueryGuard *guard) {
+    if (!guard->watching) {
+        return;
+    }
+    if (guard->owns_interrupt) {
+        __atomic_store_n(&interrupt_sem, NULL, __ATOMIC_SEQ_CST);
+    }
+    guard->finished = !interrupted && !guard->reason;
+    sem_post(&guard->wake);
+    pthread_join(guard->thread, NULL);
+    sem_destroy(&guard->wake);
+}
+
+// The server-side limit below cut the statement short
+int query_timed_out(unsigned int error) {
+    return error == ER_QUERY_TIMEOUT || error == ER_STATEMENT_TIMEOUT;
+}
+
+// Let the server enforce the timeout as well: a MAX_EXECUTION_TIME hint on
+// MySQL 5.7.8+, SET STATEMENT max_statement_time on MariaDB. Only SELECTs
+// honour these. Returns NULL when the query is to be sent unchanged.
+char* apply_execution_time_limit(MYSQL *conn, const char *query, unsigned long long timeout_ms) {
+    const char *p = skip_space(query);
+    if (timeout_ms == 0 || !match_keyword(p, "SELECT") || strstr(query, "MAX_EXECUTION_TIME")) {
+        return NULL;
+    }
+    const char *server = mysql_get_server_info(conn);
+    if (server && strstr(server, "MariaDB")) {
+        return format_string("SET STATEMENT max_statement_time=%.3f FOR %s", timeout_ms / 1000.0, query);
+    }
+    if (mysql_get_server_version(conn) < 50708) {
+        return NULL;
+    }
+    p += 6;
+    return format_string("%.*s /*+ MAX_EXECUTION_TIME(%llu) */%s", (int)(p - query), query, timeout_ms, p);
+}
+
+// ---- Tracing ----
+// --trace writes Chrome Trace Event Format JSON that Perfetto and
+// chrome://tracing can open. Every span is a complete ("X") event stamped
+// with the kernel thread id, so the reader and worker threads of copy and
+// import show up as separate tracks. With no trace file open, trace_begin()
+// and trace_span() return at once.
+
+Tracer tracer = {NULL, PTHREAD_MUTEX_INITIALIZER, 0, 0};
+
+long trace_thread_id(void) {
+    static __thread long tid;
+    if (!tid) {
+        tid = (long)syscall(SYS_gettid);
+    }
+    return tid;
+}
+
+int trace_open(const char *path) {
+    if (tracer.file) {
+        fprintf(stderr, "--trace given more than once\n");
+        return -1;
+    }
+    tracer.file = fopen(path, "w");
+    if (!tracer.file) {
+        fprintf(stderr, "Could not open trace file %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    tracer.origin = now_seconds();
+    tracer.events = 0;
+    fputs("{\"traceEvents\":[\n", tracer.file);
+    return 0;
+}
+
+void trace_close(void) {
+    if (!tracer.file) return;
+    fputs("\n],\"displayTimeUnit\":\"ms\"}\n", tracer.file);
+    fclose(tracer.file);
+    tracer.file = NULL;
+}
+
+double trace_begin(void) {
+    return tracer.file ? now_seconds() : 0;
+}
+
+// Event names and arg names are string literals, so they need no escaping.
+// `arg_name` may be NULL.
+void trace_event(const char *phase, const char *name, double started, double ended, const char *arg_name,
+                 long long arg_value, const char *text_name, const char *text) {
+    pthread_mutex_lock(&tracer.lock);
+    FILE *f = tracer.file;
+    fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"%s\",\"pid\":%ld,\"tid\":%ld,\"ts\":%.3f", tracer.events++ ? ",\n" : "",
+            name, phase, (long)getpid(), trace_thread_id(), (started - tracer.origin) * 1e6);
+    if (phase[0] == 'X') {
+        fprintf(f, ",\"dur\":%.3f", (ended - started) * 1e6);
+    }
+    fputs(",\"args\":{", f);
+    if (arg_name) {
+        fprintf(f, "\"%s\":%lld", arg_name, arg_value);
+    }
+    if (text_name) {
+        fprintf(f, "%s\"%s\":\"", arg_name ? "," : "", text_name);
+        for (const unsigned char *p = (const unsigned char *)text; *p; p++) {
+            if (*p == '"' || *p == '\\') fprintf(f, "\\%c", *p);
+            else if (*p < 0x20) fprintf(f, "\\u%04x", *p);
+            else fputc(*p, f);
+        }
+        fputc('"', f);
+    }
+    fputs("}}", f);
+    pthread_mutex_unlock(&tracer.lock);
+}
+
+// Records [started, now) as a complete event
+void trace_span(const char *name, double started, const char *arg_name, long long arg_value) {
+    if (!tracer.file) return;
+    trace_event("X", name, started, now_seconds(), arg_name, arg_value, NULL, NULL);
+}
+
+// Names the calling thread's track in the viewer
+void trace_thread_name(const char *name) {
+    if (!tracer.file) return;
+    trace_event("M", "thread_name", tracer.origin, tracer.origin, NULL, 0, "name", name);
+}
+
+// ---- Hardware performance counters ----
+// --perf-counters opens cycles, instructions, cache-misses and
+// branch-misses for the calling thread with perf_event_open, as one group so
+// they are scheduled on the PMU together. perf_begin()/perf_end() bracket a
+// phase and add the delta to that phase's totals. If the kernel multiplexed
+// the group, the deltas are scaled by time enabled / time running. Counting
+// is user space only, which perf_event_paranoid <= 2 allows without root.
+
+PerfCounters perf = {0};
+
+int perf_open(void) {
+    static const unsigned long long configs[PERF_COUNTER_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+    };
+    perf.group_fd = -1;
+    perf.opened = 0;
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.disabled = perf.group_fd == -1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        perf.fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, perf.group_fd, 0);
+        if (perf.fds[i] < 0) {
+            if (i == 0) {
+                fprintf(stderr, "perf_event_open failed: %s (see /proc/sys/kernel/perf_event_paranoid)\n", strerror(errno));
+                return -1;
+            }
+            continue;
+        }
+        if (perf.group_fd == -1) {
+            perf.group_fd = perf.fds[i];
+        }
+        perf.opened++;
+    }
+    ioctl(perf.group_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(perf.group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    perf.enabled = 1;
+    return 0;
+}
+
+void perf_close(void) {
+    if (!perf.enabled) return;
+    for (int i = PERF_COUNTER_COUNT - 1; i >= 0; i--) {
+        if (perf.fds[i] >= 0) close(perf.fds[i]);
+    }
+    perf.enabled = 0;
+}
+
+// Reads { nr, time_enabled, time_running, values[nr] } into out
+int perf_read(unsigned long long *out) {
+    unsigned long long buffer[PERF_COUNTER_COUNT + 3];
+    ssize_t want = (ssize_t)((perf.opened + 3) * sizeof(unsigned long long));
+    if (read(perf.group_fd, buffer, sizeof(buffer)) < want) {
+        return -1;
+    }
+    memcpy(out, buffer + 1, (size_t)(perf.opened + 2) * sizeof(unsigned long long));
+    return 0;
+}
+
+void perf_begin(void) {
+    if (perf.enabled && perf_read(perf.start) != 0) {
+        perf.enabled = 0;
+    }
+}
+
+// Adds the counts since perf_begin() to the phase called `name`, a literal
+void perf_end(const char *name, unsigned long long rows) {
+    unsigned long long now[PERF_COUNTER_COUNT + 2];
+    if (!perf.enabled || perf_read(now) != 0) return;
+
+    PerfPhase *phase = NULL;
+    for (int i = 0; i < perf.phase_count; i++) {
+        if (strcmp(perf.phases[i].name, name) == 0) phase = &perf.phases[i];
+    }
+    if (!phase) {
+        if (perf.phase_count == PERF_MAX_PHASES) return;
+        phase = &perf.phases[perf.phase_count++];
+        phase->name = name;
+    }
+    double enabled = (double)(now[0] - perf.start[0]);
+    double running = (double)(now[1] - perf.start[1]);
+    double scale = running > 0 ? enabled / running : 1.0;
+    for (int i = 0, slot = 2; i < PERF_COUNTER_COUNT; i++) {
+        if (perf.fds[i] < 0) {
+            phase->values[i] = -1;
+            continue;
+        }
+        phase->values[i] += (double)(now[slot] - perf.start[slot]) * scale;
+        slot++;
+    }
+    phase->rows += rows;
+}
+
+// ---- Morsel-driven result processing ----
+// Each completed row group of a QueryResult is a morsel. The fetch thread
+// publishes groups as they fill, and a small pool of workers processes them
+// while the fetch keeps going, so post-processing overlaps the network
+// instead of walking every cell again after the last row arrives.
+
+// Up to one worker per spare core, at most MORSEL_MAX_WORKERS. A worker
+// only starts when a published group is still waiting as the next one
+// arrives, so a result of one group (and its partial tail) never starts a
+// thread. Each group is one pass of strlen over its cells, far cheaper than
+// fetching it, so a few workers keep up with the fetch even when many
+// queries run at once.
+int morsel_default_workers(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus <= 1) return 0;
+    return cpus - 1 < MORSEL_MAX_WORKERS ? (int)(cpus - 1) : MORSEL_MAX_WORKERS;
+}
+
+void morsel_pool_init(MorselPool *pool, int workers, int cols_count, MorselFn process, void *context) {
+    memset(pool, 0, sizeof(*pool));
+    pool->process = process;
+    pool->context = context;
+    pool->cols_count = cols_count;
+    pool->workers_wanted = workers < MORSEL_MAX_WORKERS ? workers : MORSEL_MAX_WORKERS;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->ready, NULL);
+}
+
+// Takes the oldest published group; the caller holds the lock
+Morsel morsel_pool_take(MorselPool *pool) {
+    Morsel morsel = pool->queue[pool->head];
+    pool->head = (pool->head + 1) % pool->cap;
+    pool->count--;
+    return morsel;
+}
+
+void* morsel_worker_main(void *arg) {
+    MorselPool *pool = (MorselPool *)arg;
+    trace_thread_name("morsel worker");
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->count == 0 && !pool->closed) {
+            pthread_cond_wait(&pool->ready, &pool->lock);
+        }
+        if (pool->count == 0) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        Morsel morsel = morsel_pool_take(pool);
+        pthread_mutex_unlock(&pool->lock);
+
+        double started = trace_begin();
+        pool->process(pool->context, morsel.cells, morsel.rows, pool->cols_count);
+        trace_span("morsel", started, "rows", morsel.rows);
+    }
+}
+
+// Hands a filled row group to the workers. The cells must stay untouched
+// until morsel_pool_finish() returns.
+// Once the pool is closed the group runs on the calling thread.
+void morsel_pool_publish(MorselPool *pool, char **cells, size_t rows) {
+    pthread_mutex_lock(&pool->lock);
+    if (pool->closed) {
+        pthread_mutex_unlock(&pool->lock);
+        pool->process(pool->context, cells, rows, pool->cols_count);
+        return;
+    }
+    if (pool->count == pool->cap) {
+        size_t cap = pool->cap ? pool->cap * 2 : 16;
+        Morsel *queue = (Morsel *)malloc(cap * sizeof(Morsel));
+        if (!queue) {
+            pthread_mutex_unlock(&pool->lock);
+            pool->process(pool->context, cells, rows, pool->cols_count); // No room to queue it
+            return;
+        }
+        for (size_t i = 0; i < pool->count; i++) {
+            queue[i] = pool->queue[(pool->head + i) % pool->cap];
+        }
+        free(pool->queue);
+        pool->queue = queue;
+        pool->head = 0;
+        pool->cap = cap;
+    }
+    pool->queue[(pool->head + pool->count) % pool->cap] = (Morsel){cells, rows};
+    pool->count++;
+    if (pool->count > 1 && pool->workers_count < pool->workers_wanted &&
+        pthread_create(&pool->threads[pool->workers_count], NULL, morsel_worker_main, pool) == 0) {
+        pool->workers_count++;
+    } else if (pool->count > 1) {
+        pool->workers_wanted = pool->workers_count; // Carry on with what we have
+    }
+    pthread_cond_signal(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// No more groups are coming: the workers drain the queue and exit
+void morsel_pool_close(MorselPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->closed = 1;
+    pthread_cond_broadcast(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Waits for every published group to be processed. Groups no worker took
+// (or all of them, when none was started) run on the calling thread.
+void morsel_pool_finish(MorselPool *pool) {
+    morsel_pool_close(pool);
+    for (int i = 0; i < pool->workers_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    while (pool->count > 0) {
+        Morsel morsel = morsel_pool_take(pool);
+        pool->process(pool->context, morsel.cells, morsel.rows, pool->cols_count);
+    }
+    free(pool->queue);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->ready);
+}
+
+void result_stats_morsel(void *context, char **cells, size_t rows, int cols_count) {
+    ResultStats *stats = (ResultStats *)context;
+    unsigned long *max_lengths = (unsigned long *)calloc(cols_count, sizeof(unsigned long));
+    unsigned long long cell_bytes = 0;
+    if (!max_lengths) {
+        return;
+    }
+    for (size_t row = 0; row < rows; row++) {
+        char **row_cells = cells + row * cols_count;
+        for (int i = 0; i < cols_count; i++) {
+            size_t length = strlen(row_cells[i]);
+            cell_bytes += length + 1;
+            if (length > max_lengths[i]) {
+                max_lengths[i] = length;
+            }
+        }
+    }
+    pthread_mutex_lock(&stats->lock);
+    stats->cell_bytes += cell_bytes;
+    for (int i = 0; i < cols_count; i++) {
+        if (max_lengths[i] > stats->max_lengths[i]) {
+            stats->max_lengths[i] = max_lengths[i];
+        }
+    }
+    pthread_mutex_unlock(&stats->lock);
+    free(max_lengths);
+}
+
+int result_stats_start(MorselPool *pool, ResultStats *stats, int cols_count) {
+    stats->cell_bytes = 0;
+    stats->max_lengths = (unsigned long *)calloc(cols_count, sizeof(unsigned long));
+    if (!stats->max_lengths) {
+        fprintf(stderr, "Memory allocation for column statistics failed\n");
+        return -1;
+    }
+    pthread_mutex_init(&stats->lock, NULL);
+    morsel_pool_init(pool, morsel_default_workers(), cols_count, result_stats_morsel, stats);
+    return 0;
+}
+
+// Waits for the workers and moves the merged statistics into `result`. Must
+// run before the result is freed, even on error paths.
+void result_stats_finish(MorselPool *pool, ResultStats *stats, QueryResult *result) {
+    morsel_pool_finish(pool);
+    pthread_mutex_destroy(&stats->lock);
+    result->max_lengths = stats->max_lengths;
+    result->cell_bytes = stats->cell_bytes;
+}
+
+// ---- Server-side cost capture ----
+// --server-stats brackets the query with SHOW SESSION STATUS on the same
+// connection. SHOW STATUS moves some of these counters itself, so a second
+// snapshot taken straight after the first measures that overhead and it is
+// subtracted from the delta. The statement's performance_schema event is read
+// from events_statements_history afterwards: once finished it is no longer in
+// events_statements_current, and the newest entry is the closing SHOW STATUS.
+#define SESSION_STATUS_SQL \
+    "SHOW SESSION STATUS WHERE Variable_name LIKE 'Handler_read%' OR Variable_name IN " \
+    "('Bytes_received', 'Bytes_sent', 'Created_tmp_disk_tables', 'Created_tmp_tables', " \
+    "'Select_full_join', 'Select_scan', 'Sort_merge_passes', 'Sort_rows', 'Sort_scan')"
+
+#define STATEMENT_EVENT_SQL \
+    "SELECT TIMER_WAIT, LOCK_TIME, ROWS_SENT, ROWS_EXAMINED, ROWS_AFFECTED, CREATED_TMP_TABLES, " \
+    "CREATED_TMP_DISK_TABLES, SELECT_FULL_JOIN, SELECT_SCAN, SORT_MERGE_PASSES, SORT_ROWS, " \
+    "NO_INDEX_USED, NO_GOOD_INDEX_USED FROM performance_schema.events_statements_history " \
+    "WHERE THREAD_ID = (SELECT THREAD_ID FROM performance_schema.threads " \
+    "WHERE PROCESSLIST_ID = CONNECTION_ID()) ORDER BY EVENT_ID DESC LIMIT 1 OFFSET 1"
+
+int stat_list_add(StatList *list, const char *name, long long value) {
+    if (list->count == STAT_LIST_MAX) {
+        return -1;
+    }
+    snprintf(list->names[list->count], sizeof(list->names[0]), "%s", name);
+    list->values[list->count++] = value;
+    return 0;
+}
+
+int stat_list_find(const StatList *list, const char *name) {
+    for (int i = 0; i < list->count; i++) {
+        if (strcmp(list->names[i], name) == 0) return i;
+    }
+    return -1;
+}
+
+int capture_session_status(MYSQL *conn, StatList *out) {
+    memset(out, 0, sizeof(*out));
+    if (mysql_query(conn, SESSION_STATUS_SQL)) {
+        fprintf(stderr, "SHOW SESSION STATUS failed: %s\n", mysql_error(conn));
+        return -1;
+    }
+    MYSQL_RES *res = mysql_store_result(conn);
+    if (!res) {
+        fprintf(stderr, "SHOW SESSION STATUS returned no rows: %s\n", mysql_error(conn));
+        return -1;
+    }
+    MYSQL_ROW row;
+    while ((row = mysql_fetch_row(res))) {
+        if (row[0] && row[1]) {
+            stat_list_add(out, row[0], strtoll(row[1], NULL, 10));
+        }
+    }
+    mysql_free_result(res);
+    return 0;
+}
+
+// Leaves `out` empty when performance_schema is off or not readable
+void capture_statement_event(MYSQL *conn, StatList *out) {
+    memset(out, 0, sizeof(*out));
+    if (mysql_query(conn, STATEMENT_EVENT_SQL)) {
+        return;
+    }
+    MYSQL_RES *res = mysql_store_result(conn);
+    if (!res) {
+        return;
+    }
+    MYSQL_ROW row = mysql_fetch_row(res);
+    if (row) {
+        MYSQL_FIELD *fields = mysql_fetch_fields(res);
+        unsigned int cols = mysql_num_fields(res);
+        for (unsigned int i = 0; i < cols; i++) {
+            if (row[i]) {
+                stat_list_add(out, fields[i].name, strtoll(row[i], NULL, 10));
+            }
+        }
+    }
+    mysql_free_result(res);
+}
+
+// Called once the statement has finished; `before` and `calibration` are the
+// two snapshots taken ahead of it. Returns NULL if the closing snapshot fails.
+ServerStats* finish_server_stats(MYSQL *conn, const StatList *before, const StatList *calibration) {
+    StatList after;
+    if (capture_session_status(conn, &after) != 0) {
+        return NULL;
+    }
+    ServerStats *stats = (ServerStats *)calloc(1, sizeof(ServerStats));
+    if (!stats) {
+        fprintf(stderr, "Memory allocation for server stats failed\n");
+        return NULL;
+    }
+    for (int i = 0; i < after.count; i++) {
+        int b = stat_list_find(before, after.names[i]);
+        int c = stat_list_find(calibration, after.names[i]);
+        if (b < 0 || c < 0) continue;
+        long long overhead = calibration->values[c] - before->values[b];
+        long long delta = after.values[i] - calibration->values[c] - overhead;
+        stat_list_add(&stats->status, after.names[i], delta > 0 ? delta : 0);
+    }
+    capture_statement_event(conn, &stats->statement);
+    return stats;
+}
+
+TypeMapping mysql_type_to_c_type(enum enum_field_types type) {
+    switch (type) {
+        case MYSQL_TYPE_DECIMAL:
+        case MYSQL_TYPE_NEWDECIMAL:
+            return (TypeMapping){"DECIMAL", "double"};
+        case MYSQL_TYPE_TINY:
+            return (TypeMapping){"TINYINT", "int8_t"};
+        case MYSQL_TYPE_SHORT:
+            return (TypeMapping){"SMALLINT", "int16_t"};
+        case MYSQL_TYPE_LONG:
+            return (TypeMapping){"INT", "int32_t"};
+        case MYSQL_TYPE_FLOAT:
+            return (TypeMapping){"FLOAT", "float"};
+        case MYSQL_TYPE_DOUBLE:
+            return (TypeMapping){"DOUBLE", "double"};
+        case MYSQL_TYPE_NULL:
+            return (TypeMapping){"NULL", "void"};
+        case MYSQL_TYPE_TIMESTAMP:
+            return (TypeMapping){"TIMESTAMP", "char*"};
+        case MYSQL_TYPE_LONGLONG:
+            return (TypeMapping){"BIGINT", "int64_t"};
+        case MYSQL_TYPE_INT24:
+            return (TypeMapping){"MEDIUMINT", "int32_t"};
+        case MYSQL_TYPE_DATE:
+            return (TypeMapping){"DATE", "char*"};
+        case MYSQL_TYPE_TIME:
+            return (TypeMapping){"TIME", "char*"};
+        case MYSQL_TYPE_DATETIME:
+            return (TypeMapping){"DATETIME", "char*"};
+        case MYSQL_TYPE_YEAR:
+            return (TypeMapping){"YEAR", "int"};
+        case MYSQL_TYPE_NEWDATE:
+            return (TypeMapping){"NEWDATE", "char*"};
+        case MYSQL_TYPE_VARCHAR:
+            return (TypeMapping){"VARCHAR", "char*"};
+        case MYSQL_TYPE_BIT:
+            return (TypeMapping){"BIT", "uint8_t"};
+        case MYSQL_TYPE_JSON:
+            return (TypeMapping){"JSON", "char*"};
+        case MYSQL_TYPE_ENUM:
+            return (TypeMapping){"ENUM", "char*"};
+        case MYSQL_TYPE_SET:
+            return (TypeMapping){"SET", "char*"};
+        case MYSQL_TYPE_TINY_BLOB:
+            return (TypeMapping){"TINYBLOB", "char*"};
+        case MYSQL_TYPE_MEDIUM_BLOB:
+            return (TypeMapping){"MEDIUMBLOB", "char*"};
+        case MYSQL_TYPE_LONG_BLOB:
+            return (TypeMapping){"LONGBLOB", "char*"};
+        case MYSQL_TYPE_BLOB:
+            return (TypeMapping){"BLOB", "char*"};
+        case MYSQL_TYPE_VAR_STRING:
+        case MYSQL_TYPE_STRING:
+            return (TypeMapping){"STRING", "char*"};
+        case MYSQL_TYPE_GEOMETRY:
+            return (TypeMapping){"GEOMETRY", "char*"};
+        default:
+            return (TypeMapping){"UNKNOWN", "void"};
+    }
+}
+
+// Copies one fetched row into `cells`, spelling SQL NULL as "NULL". `lengths`
+// are the row's mysql_fetch_lengths(), or NULL for text cells, and the
+// copies are NUL-terminated either way. `cell_lengths`, when given, gets each
+// cell's length, or RESULT_NULL_LENGTH for SQL NULL. On failure the cells
+// copied so far are freed again.
+int copy_row_cells(char **cells, unsigned long *cell_lengths, MYSQL_ROW row, const unsigned long *lengths,
+                   int cols_count) {
+    for (int i = 0; i < cols_count; i++) {
+        const char *value = row[i] ? row[i] : "NULL";
+        size_t length = row[i] && lengths ? lengths[i] : strlen(value);
+        cells[i] = (char *)malloc(length + 1);
+        if (!cells[i]) {
+            for (int j = 0; j < i; j++) {
+                free(cells[j]);
+            }
+            return -1;
+        }
+        memcpy(cells[i], value, length);
+        cells[i][length] = '\0';
+        if (cell_lengths) {
+            cell_lengths[i] = row[i] ? length : RESULT_NULL_LENGTH;
+        }
+    }
+    return 0;
+}
+
+QueryResult* execute_mysql_query(const DbPreset *db, const char *query, const QueryOptions *options) {
+    MYSQL *conn;
+    MYSQL_RES *res;
+    MYSQL_ROW row;
+    MYSQL_FIELD *fields;
+    QueryResult *result;
+    QueryGuard guard;
+    QueryProfile profile;
+    StatList status_before, status_calibration;
+    int server_stats = 0;
+    Throttle *throttle = options->throttle;
+
+    memset(&profile, 0, sizeof(profile));
+    double started = now_seconds();
+    perf_begin();
+    conn = connect_db(db, 0);
+    if (!conn) {
+        return NULL;
+    }
+    perf_end("connect", 0);
+    profile.connect_seconds = now_seconds() - started;
+    trace_span("connect", started, NULL, 0);
+    throttle_prepare_stream(throttle, conn);
+    if (options->server_stats) {
+        double stats_started = trace_begin();
+        server_stats = capture_session_status(conn, &status_before) == 0 &&
+                       capture_session_status(conn, &status_calibration) == 0;
+        trace_span("session status", stats_started, NULL, 0);
+    }
+    if (query_guard_start(&guard, db, conn, options->timeout_ms) != 0) {
+        fprintf(stderr, "Could not start the query watchdog\n");
+        mysql_close(conn);
+        return NULL;
+    }
+
+    started = now_seconds();
+    perf_begin();
+    RGWML_PROBE1(query__start, query);
+    char *limited_query = apply_execution_time_limit(conn, query, options->timeout_ms);
+    int failed = mysql_query(conn, limited_query ? limited_query : query);
+    free(limited_query);
+    if (failed) {
+        RGWML_PROBE2(query__done, 0, 1);
+        query_guard_stop(&guard);
+        if (guard.reason) {
+            fprintf(stderr, "Query cancelled (%s) before returning rows\n", guard.reason);
+        } else {
+            fprintf(stderr, "Query failed: %s\n", mysql_error(conn));
+        }
+        mysql_close(conn);
+        return NULL;
+    }
+
+    // Rows are pulled as they arrive rather than buffered by the client
+    // library first, so the fetch loop can be paced and only one copy of
+    // the result is held in memory.
+    res = mysql_use_result(conn);
+    perf_end("execute", 0);
+    profile.execute_seconds = now_seconds() - started;
+    trace_span("execute", started, NULL, 0);
+    if (!res && mysql_field_count(conn) == 0) {
+        // INSERT, UPDATE, DELETE, DDL... succeeded without a result set
+        RGWML_PROBE2(query__done, (long long)mysql_affected_rows(conn), 0);
+        result = (QueryResult *)calloc(1, sizeof(QueryResult));
+        query_guard_stop(&guard);
+        if (!result) {
+            fprintf(stderr, "Memory allocation for result failed\n");
+        } else {
+            result->affected_rows = mysql_affected_rows(conn);
+            result->profile = profile;
+            if (server_stats) {
+                result->server_stats = finish_server_stats(conn, &status_before, &status_calibration);
+            }
+        }
+        mysql_close(conn);
+        return result;
+    }
+    if (!res) {
+        fprintf(stderr, "mysql_use_result() failed: %s\n", mysql_error(conn));
+        query_guard_stop(&guard);
+        mysql_close(conn);
+        return NULL;
+    }
+
+    int cols_count = mysql_num_fields(res);
+    fields = mysql_fetch_fields(res);
+
+    result = query_result_new(fields, cols_count);
+    if (!result) {
+        mysql_free_result(res);
+        query_guard_stop(&guard);
+        mysql_close(conn);
+        return NULL;
+    }
+
+    // Column statistics are gathered from each row group as soon as it
+    // fills, by workers running alongside the fetch
+    MorselPool morsels;
+    ResultStats stats;
+    if (result_stats_start(&morsels, &stats, cols_count) != 0) {
+        free_query_result(result);
+        mysql_free_result(res);
+        query_guard_stop(&guard);
+        mysql_close(conn);
+        return NULL;
+    }
+
+    unsigned long long row_index = 0;
+    unsigned long long pending_bytes = 0;
+    started = now_seconds();
+    double batch_started = trace_begin();
+    perf_begin();
+    while ((row = mysql_fetch_row(res))) {
+        char **cells = query_result_append_row(result);
+        if (!cells) {
+            fprintf(stderr, "Memory allocation for rows failed\n");
+            result_stats_finish(&morsels, &stats, result);
+            free_query_result(result);
+            mysql_free_result(res);
+            query_guard_stop(&guard);
+            mysql_close(conn);
+            return NULL;
+        }
+        if (copy_row_cells(cells, query_result_lengths(result, row_index), row, mysql_fetch_lengths(res),
+                           cols_count) != 0) {
+            fprintf(stderr, "strdup failed for row[%llu]\n", row_index);
+            result_stats_finish(&morsels, &stats, result);
+            free_query_result(result);
+            mysql_free_result(res);
+            query_guard_stop(&guard);
+            mysql_close(conn);
+            return NULL;
+        }
+        result->rows_count = ++row_index;
+        if (row_index % result->rows_per_chunk == 0) {
+            morsel_pool_publish(&morsels, result->chunks[result->chunks_count - 1], result->rows_per_chunk);
+        }
+
+        unsigned long *lengths = mysql_fetch_lengths(res);
+        for (int i = 0; i < cols_count; i++) {
+            pending_bytes += lengths[i];
+        }
+        if (row_index % THROTTLE_CHECK_ROWS == 0) {
+            RGWML_PROBE2(fetch__batch, row_index, pending_bytes);
+            trace_span("fetch batch", batch_started, "rows", THROTTLE_CHECK_ROWS);
+            throttle_wait(throttle, THROTTLE_CHECK_ROWS, pending_bytes);
+            profile.bytes += pending_bytes;
+            pending_bytes = 0;
+            batch_started = trace_begin();
+        }
+    }
+    if (row_index % THROTTLE_CHECK_ROWS) {
+        trace_span("fetch batch", batch_started, "rows", row_index % THROTTLE_CHECK_ROWS);
+    }
+    perf_end("fetch", (unsigned long long)row_index);
+    profile.bytes += pending_bytes;
+    profile.fetch_seconds = now_seconds() - started;
+    trace_span("fetch", started, "rows", row_index);
+    morsel_pool_close(&morsels); // The partial last group runs right here
+    if (row_index > 0 && row_index % result->rows_per_chunk) {
+        morsel_pool_publish(&morsels, result->chunks[result->chunks_count - 1], row_index % result->rows_per_chunk);
+    }
+    double stats_started = trace_begin();
+    result_stats_finish(&morsels, &stats, result);
+    trace_span("column stats", stats_started, NULL, 0);
+    unsigned int fetch_error = mysql_errno(conn);
+    RGWML_PROBE2(query__done, row_index, fetch_error != 0);
+    mysql_free_result(res);
+    query_guard_stop(&guard);
+    if (fetch_error && (guard.reason || query_timed_out(fetch_error))) {
+        // Cancelled on purpose: keep what arrived before the cut
+        result->partial_reason = guard.reason ? guard.reason : "timeout";
+    } else if (fetch_error) {
+        fprintf(stderr, "Fetch failed after %llu rows: %s\n", row_index, mysql_error(conn));
+        free_query_result(result);
+        mysql_close(conn);
+        return NULL;
+    }
+    result->profile = profile;
+    if (server_stats) {
+        stats_started = trace_begin();
+        result->server_stats = finish_server_stats(conn, &status_before, &status_calibration);
+        trace_span("session status", stats_started, NULL, 0);
+    }
+    mysql_close(conn);
+
+    return result;
+}
+
+
+// ---- Public API ----
+// The reentrant surface declared in rgwml.h, over the same internals the CLI
+// uses. RgwmlResult is QueryResult itself; RgwmlDb keeps the parsed config
+// alive because the preset's strings point into it.
+
+struct RgwmlDb {
+    cJSON *config;
+    char *name; // The caller's preset name may not outlive the handle
+    DbPreset preset;
+};
+
+struct RgwmlRowIter {
+    const QueryResult *result;
+    unsigned long long row;
+};
+
+struct RgwmlColumnIter {
+    const QueryResult *result;
+    int column;
+    unsigned long long row;
+};
+
+pthread_once_t rgwml_once = PTHREAD_ONCE_INIT;
+pthread_key_t rgwml_thread_key;
+int rgwml_init_failed = 0;
+
+// Runs at exit of every thread that went through rgwml_thread_init()
+void rgwml_thread_cleanup(void *value) {
+    (void)value;
+    mysql_thread_end();
+}
+
+void rgwml_init_once(void) {
+    if (mysql_library_init(0, NULL, NULL) != 0 ||
+        pthread_key_create(&rgwml_thread_key, rgwml_thread_cleanup) != 0) {
+        fprintf(stderr, "Could not initialize MySQL client library\n");
+        rgwml_init_failed = 1;
+    }
+}
+
+int rgwml_init(void) {
+    pthread_once(&rgwml_once, rgwml_init_once);
+    return rgwml_init_failed ? -1 : 0;
+}
+
+void rgwml_end(void) {
+    mysql_library_end();
+}
+
+void rgwml_thread_init(void) {
+    if (rgwml_init() != 0 || pthread_getspecific(rgwml_thread_key)) {
+        return;
+    }
+    mysql_thread_init();
+    pthread_setspecific(rgwml_thread_key, &rgwml_thread_key);
+}
+
+void rgwml_thread_end(void) {
+    if (rgwml_init() != 0 || !pthread_getspecific(rgwml_thread_key)) {
+        return;
+    }
+    pthread_setspecific(rgwml_thread_key, NULL);
+    mysql_thread_end();
+}
+
+RgwmlDb* rgwml_open(const char *config_path, const char *preset) {
+    RgwmlDb *db = (RgwmlDb *)calloc(1, sizeof(RgwmlDb));
+    if (!db) {
+        fprintf(stderr, "Memory allocation for database handle failed\n");
+        return NULL;
+    }
+    db->config = load_config(config_path);
+    db->name = strdup(preset);
+    if (!db->config || !db->name) {
+        rgwml_close(db);
+        return NULL;
+    }
+    if (load_db_preset(db->config, db->name, &db->preset) != 0) {
+        rgwml_close(db);
+        return NULL;
+    }
+    return db;
+}
+
+void rgwml_close(RgwmlDb *db) {
+    if (!db) return;
+    cJSON_Delete(db->config);
+    free(db->name);
+    free(db);
+}
+
+RgwmlResult* rgwml_query(const RgwmlDb *db, const char *sql, unsigned long long timeout_ms) {
+    QueryOptions options = {NULL, timeout_ms, 0};
+    rgwml_thread_init();
+    return execute_mysql_query(&db->preset, sql, &options);
+}
+
+void rgwml_result_free(RgwmlResult *result) {
+    free_query_result(result);
+}
+
+unsigned long long rgwml_result_rows(const RgwmlResult *result) {
+    return result->rows_count;
+}
+
+int rgwml_result_columns(const RgwmlResult *result) {
+    return result->cols_count;
+}
+
+unsigned long long rgwml_result_affected_rows(const RgwmlResult *result) {
+    return result->affected_rows;
+}
+
+const char* rgwml_result_partial(const RgwmlResult *result) {
+    return result->partial_reason;
+}
+
+const char* rgwml_column_name(const RgwmlResult *result, int column) {
+    return column >= 0 && column < result->cols_count ? result->headers[column] : NULL;
+}
+
+const char* rgwml_column_type(const RgwmlResult *result, int column) {
+    return column >= 0 && column < result->cols_count ? result->mysql_types[column] : NULL;
+}
+
+const char* rgwml_cell(const RgwmlResult *result, unsigned long long row, int column) {
+    if (row >= result->rows_count || column < 0 || column >= result->cols_count) {
+        return NULL;
+    }
+    return query_result_row(result, row)[column];
+}
+
+RgwmlRowIter* rgwml_rows(const RgwmlResult *result) {
+    RgwmlRowIter *iter = (RgwmlRowIter *)calloc(1, sizeof(RgwmlRowIter));
+    if (!iter) {
+        fprintf(stderr, "Memory allocation for row iterator failed\n");
+        return NULL;
+    }
+    iter->result = result;
+    return iter;
+}
+
+const char* const* rgwml_row_next(RgwmlRowIter *iter) {
+    if (iter->row >= iter->result->rows_count) {
+        return NULL;
+    }
+    return (const char* const*)query_result_row(iter->result, iter->row++);
+}
+
+void rgwml_row_iter_free(RgwmlRowIter *iter) {
+    free(iter);
+}
+
+RgwmlColumnIter* rgwml_column(const RgwmlResult *result, int column) {
+    if (column < 0 || column >= result->cols_count) {
+        fprintf(stderr, "No column %d in a result of %d columns\n", column, result->cols_count);
+        return NULL;
+    }
+    RgwmlColumnIter *iter = (RgwmlColumnIter *)calloc(1, sizeof(RgwmlColumnIter));
+    if (!iter) {
+        fprintf(stderr, "Memory allocation for column iterator failed\n");
+        return NULL;
+    }
+    iter->result = result;
+    iter->column = column;
+    return iter;
+}
+
+const char* rgwml_column_next(RgwmlColumnIter *iter) {
+    if (iter->row >= iter->result->rows_count) {
+        return NULL;
+    }
+    return query_result_row(iter->result, iter->row++)[iter->column];
+}
+
+void rgwml_column_iter_free(RgwmlColumnIter *iter) {
+    free(iter);
+}
+
+// ---- Arrow C Data Interface export ----
+// Cells are individual strings, so each column is laid out once into Arrow
+// buffers (validity bitmap, values or offsets plus data). After that a
+// consumer such as pyarrow adopts the buffers as they are. Ownership passes
+// with the release callbacks, which free a struct and its children.
+
+typedef enum {
+    ARROW_INT64,
+    ARROW_FLOAT64,
+    ARROW_DECIMAL128,
+    ARROW_UTF8,
+    ARROW_BINARY
+} ArrowColumnKind;
+
+#define ARROW_DECIMAL128_DIGITS 38
+
+// MySQL's exact decimal text, e.g. "-12.50", as an integer count of
+// 10^-scale units. Rejects anything else, or more digits than decimal128 has.
+int arrow_parse_decimal(const char *cell, int scale, __int128 *out) {
+    const char *p = cell;
+    int negative = *p == '-';
+    if (negative || *p == '+') p++;
+    __int128 value = 0;
+    int digits = 0;
+    int fraction = -1; // Fraction digits seen, -1 before the point
+    for (; *p; p++) {
+        if (*p == '.' && fraction < 0) {
+            fraction = 0;
+            continue;
+        }
+        if (*p < '0' || *p > '9' || ++digits > ARROW_DECIMAL128_DIGITS || (fraction >= 0 && ++fraction > scale)) {
+            return -1;
+        }
+        value = value * 10 + (*p - '0');
+    }
+    if (digits == 0) {
+        return -1;
+    }
+    for (int i = fraction < 0 ? 0 : fraction; i < scale; i++) {
+        if (++digits > ARROW_DECIMAL128_DIGITS) return -1;
+        value *= 10;
+    }
+    *out = negative ? -value : value;
+    return 0;
+}
+
+// Numeric columns go out as numbers only when every non-NULL cell parses, so
+// e.g. BIGINT UNSIGNED values past INT64_MAX fall back to strings. DECIMAL
+// stays exact as decimal128, or strings past 38 digits. Columns of the
+// binary charset are binary.
+ArrowColumnKind arrow_column_kind(const QueryResult *result, int column) {
+    const char *type = result->c_types[column];
+    ArrowColumnKind kind;
+    if (result->binary && result->binary[column]) {
+        return ARROW_BINARY;
+    }
+    if (result->decimal_precision && result->decimal_precision[column]) {
+        if (result->decimal_precision[column] > ARROW_DECIMAL128_DIGITS) {
+            return ARROW_UTF8;
+        }
+        kind = ARROW_DECIMAL128;
+    } else if (strcmp(type, "double") == 0 || strcmp(type, "float") == 0) {
+        kind = ARROW_FLOAT64;
+    } else if (strncmp(type, "int", 3) == 0) {
+        kind = ARROW_INT64;
+    } else {
+        return ARROW_UTF8;
+    }
+    for (unsigned long long row = 0; row < result->rows_count; row++) {
+        const char *cell = query_result_row(result, row)[column];
+        char *end = NULL;
+        if (query_result_lengths(result, row)[column] == RESULT_NULL_LENGTH) {
+            continue;
+        }
+        if (kind == ARROW_DECIMAL128) {
+            __int128 value;
+            if (arrow_parse_decimal(cell, result->decimal_scale[column], &value) != 0) {
+                return ARROW_UTF8;
+            }
+            continue;
+        }
+        errno = 0;
+        if (kind == ARROW_INT64) {
+            strtoll(cell, &end, 10);
+        } else {
+            strtod(cell, &end);
+        }
+        if (end == cell || *end != '\0' || errno == ERANGE) {
+            return ARROW_UTF8;
+        }
+    }
+    return kind;
+}
+
+void arrow_release_schema(struct ArrowSchema *schema) {
+    for (int64_t i = 0; i < schema->n_children; i++) {
+        struct ArrowSchema *child = schema->children[i];
+        if (child && child->release) {
+            child->release(child);
+        }
+        free(child);
+    }
+    free(schema->children);
+    free((char *)schema->name);
+    free(schema->private_data); // A format string built for the column, e.g. "d:12,2"
+    schema->release = NULL;
+}
+
+void arrow_release_array(struct ArrowArray *array) {
+    for (int64_t i = 0; i < array->n_children; i++) {
+        struct ArrowArray *child = array->children[i];
+        if (child && child->release) {
+            child->release(child);
+        }
+        free(child);
+    }
+    free(array->children);
+    for (int64_t i = 0; array->buffers && i < array->n_buffers; i++) {
+        free((void *)array->buffers[i]);
+    }
+    free(array->buffers);
+    array->release = NULL;
+}
+
+// Fills one child pair. On failure the caller releases the parents, which
+// releases whatever was built here.
+int arrow_export_column(const QueryResult *result, int column, struct ArrowSchema *schema, struct ArrowArray *array) {
+    unsigned long long rows = result->rows_count;
+    ArrowColumnKind kind = arrow_column_kind(result, column);
+
+    schema->release = arrow_release_schema;
+    schema->flags = ARROW_FLAG_NULLABLE;
+    schema->name = strdup(result->headers[column]);
+    array->release = arrow_release_array;
+    array->length = (int64_t)rows;
+    array->n_buffers = kind == ARROW_UTF8 || kind == ARROW_BINARY ? 3 : 2;
+    array->buffers = (const void **)calloc((size_t)array->n_buffers, sizeof(void *));
+    if (!schema->name || !array->buffers) {
+        return -1;
+    }
+
+    // The validity bitmap is only allocated once a NULL turns up
+    uint8_t *validity = NULL;
+    size_t data_bytes = 0;
+    for (unsigned long long row = 0; row < rows; row++) {
+        unsigned long length = query_result_lengths(result, row)[column];
+        if (length != RESULT_NULL_LENGTH) {
+            data_bytes += length;
+            continue;
+        }
+        if (!validity) {
+            validity = (uint8_t *)malloc((size_t)(rows + 7) / 8);
+            if (!validity) {
+                return -1;
+            }
+            memset(validity, 0xff, (size_t)(rows + 7) / 8);
+            array->buffers[0] = validity;
+        }
+        validity[row / 8] &= (uint8_t)~(1u << (row % 8));
+        array->null_count++;
+    }
+
+    if (kind == ARROW_DECIMAL128) {
+        char *format = format_string("d:%u,%u", result->decimal_precision[column], result->decimal_scale[column]);
+        __int128 *values = (__int128 *)malloc(rows ? (size_t)rows * sizeof(__int128) : sizeof(__int128));
+        schema->private_data = format;
+        schema->format = format;
+        array->buffers[1] = values;
+        if (!format || !values) {
+            return -1;
+        }
+        for (unsigned long long row = 0; row < rows; row++) {
+            const char *cell = query_result_row(result, row)[column];
+            values[row] = 0;
+            if (!validity || (validity[row / 8] & (1u << (row % 8)))) {
+                arrow_parse_decimal(cell, result->decimal_scale[column], &values[row]);
+            }
+        }
+        return 0;
+    }
+    if (kind == ARROW_INT64 || kind == ARROW_FLOAT64) {
+        void *values = malloc(rows ? (size_t)rows * 8 : 8);
+        if (!values) {
+            return -1;
+        }
+        array->buffers[1] = values;
+        schema->format = kind == ARROW_INT64 ? "l" : "g";
+        for (unsigned long long row = 0; row < rows; row++) {
+            const char *cell = query_result_row(result, row)[column];
+            int is_null = validity && !(validity[row / 8] & (1u << (row % 8)));
+            if (kind == ARROW_INT64) {
+                ((int64_t *)values)[row] = is_null ? 0 : strtoll(cell, NULL, 10);
+            } else {
+                ((double *)values)[row] = is_null ? 0.0 : strtod(cell, NULL);
+            }
+        }
+        return 0;
+    }
+
+    // utf8 and binary have 32-bit offsets; past that they are the large kinds
+    int large = data_bytes > INT32_MAX;
+    size_t offset_size = large ? sizeof(int64_t) : sizeof(int32_t);
+    void *offsets = malloc((size_t)(rows + 1) * offset_size);
+    char *data = (char *)malloc(data_bytes ? data_bytes : 1);
+    array->buffers[1] = offsets;
+    array->buffers[2] = data;
+    if (!offsets || !data) {
+        return -1;
+    }
+    if (kind == ARROW_BINARY) {
+        schema->format = large ? "Z" : "z";
+    } else {
+        schema->format = large ? "U" : "u";
+    }
+    size_t position = 0;
+    for (unsigned long long row = 0; row <= rows; row++) {
+        if (large) {
+            ((int64_t *)offsets)[row] = (int64_t)position;
+        } else {
+            ((int32_t *)offsets)[row] = (int32_t)position;
+        }
+        if (row == rows) {
+            break;
+        }
+        if (validity && !(validity[row / 8] & (1u << (row % 8)))) {
+            continue;
+        }
+        const char *cell = query_result_row(result, row)[column];
+        size_t length = query_result_lengths(result, row)[column];
+        memcpy(data + position, cell, length);
+        position += length;
+    }
+    return 0;
+}
+
+int rgwml_result_to_arrow(const RgwmlResult *result, struct ArrowSchema *schema, struct ArrowArray *array) {
+    int cols = result->cols_count;
+    memset(schema, 0, sizeof(*schema));
+    memset(array, 0, sizeof(*array));
+    schema->format = "+s";
+    schema->release = arrow_release_schema;
+    schema->n_children = cols;
+    schema->children = (struct ArrowSchema **)calloc(cols ? cols : 1, sizeof(struct ArrowSchema *));
+    array->release = arrow_release_array;
+    array->length = (int64_t)result->rows_count;
+    array->n_buffers = 1; // A struct array has only the (absent) validity bitmap
+    array->buffers = (const void **)calloc(1, sizeof(void *));
+    array->n_children = cols;
+    array->children = (struct ArrowArray **)calloc(cols ? cols : 1, sizeof(struct ArrowArray *));
+    int failed = !schema->children || !array->buffers || !array->children;
+    for (int i = 0; i < cols && !failed; i++) {
+        schema->children[i] = (struct ArrowSchema *)calloc(1, sizeof(struct ArrowSchema));
+        array->children[i] = (struct ArrowArray *)calloc(1, sizeof(struct ArrowArray));
+        failed = !schema->children[i] || !array->children[i] ||
+                 arrow_export_column(result, i, schema->children[i], array->children[i]) != 0;
+    }
+    if (failed) {
+        fprintf(stderr, "Memory allocation for Arrow export failed\n");
+        if (!schema->children) schema->n_children = 0;
+        if (!array->children) array->n_children = 0;
+        schema->release(schema);
+        array->release(array);
+        return -1;
+    }
+    return 0;
+}
+
+// ---- Shared-memory ring ----
+// See rgwml.h for the layout. Each side publishes its counter with a
+// sequentially consistent store and then bumps the matching futex word. It
+// only makes the wake syscall when the peer has said it is about to sleep.
+// A sleeper re-reads the counter after raising its flag and passes the
+// futex value it read earlier to FUTEX_WAIT, so a wake-up cannot fall in
+// between. Sleeps time out after a second to check the peer is still alive.
+
+#define RING_MAGIC "RGWMLRNG"
+#define RING_VERSION 1
+#define RING_HEADER_BYTES 4096
+#define RING_MIN_CAPACITY (64 * 1024)
+#define RING_MAX_CAPACITY ((size_t)1 << 34) // 16 GiB, well short of where doubling could overflow
+#define RING_OPEN 0
+#define RING_FINISHED 1
+#define RING_FAILED 2
+#define RING_ATTACH_SECONDS 60 // How long a full ring waits for its first consumer
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t producer_pid;
+    uint64_t capacity;
+    uint32_t state;
+    uint32_t consumer_pid; // 0 until a consumer attaches
+    uint32_t consumer_closed;
+    uint64_t head __attribute__((aligned(64))); // Written by the producer only
+    uint32_t head_seq;
+    uint32_t producer_waiting;
+    uint64_t tail __attribute__((aligned(64))); // Written by the consumer only
+    uint32_t tail_seq;
+    uint32_t consumer_waiting;
+} RingHeader;
+
+struct RgwmlRing {
+    RingHeader *header;
+    unsigned char *data;
+    size_t map_size;
+    int producer;
+    char *path;
+    double created; // now_seconds() at create, for the attach deadline
+};
+
+void ring_futex_wait(uint32_t *word, uint32_t value) {
+    struct timespec timeout = {1, 0};
+    syscall(SYS_futex, word, FUTEX_WAIT, value, &timeout, NULL, 0);
+}
+
+void ring_futex_wake(uint32_t *word) {
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+int ring_peer_alive(uint32_t pid) {
+    return kill((pid_t)pid, 0) == 0 || errno != ESRCH;
+}
+
+char* ring_path(const char *name) {
+    if (!*name || strchr(name, '/')) {
+        fprintf(stderr, "Invalid ring name: %s\n", name);
+        return NULL;
+    }
+    return format_string("/dev/shm/%s", name);
+}
+
+RgwmlRing* ring_map(char *path, int fd, size_t map_size, int producer) {
+    RgwmlRing *ring = (RgwmlRing *)calloc(1, sizeof(RgwmlRing));
+    void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (!ring || map == MAP_FAILED) {
+        fprintf(stderr, "Could not map ring %s: %s\n", path, ring ? strerror(errno) : "out of memory");
+        if (map != MAP_FAILED) munmap(map, map_size);
+        free(ring);
+        free(path);
+        return NULL;
+    }
+    ring->header = (RingHeader *)map;
+    ring->data = (unsigned char *)map + RING_HEADER_BYTES;
+    ring->map_size = map_size;
+    ring->producer = producer;
+    ring->path = path;
+    return ring;
+}
+
+RgwmlRing* rgwml_ring_create(const char *name, size_t capacity) {
+    if (capacity > RING_MAX_CAPACITY) {
+        fprintf(stderr, "Ring capacity %zu exceeds the limit of %zu bytes\n", capacity, RING_MAX_CAPACITY);
+        return NULL;
+    }
+    size_t size = RING_MIN_CAPACITY;
+    while (size < capacity) {
+        size *= 2;
+    }
+    char *path = ring_path(name);
+    if (!path) {
+        return NULL;
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 || ftruncate(fd, (off_t)(RING_HEADER_BYTES + size)) != 0) {
+        fprintf(stderr, "Could not create ring %s: %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            unlink(path);
+        }
+        free(path);
+        return NULL;
+    }
+    RgwmlRing *ring = ring_map(path, fd, RING_HEADER_BYTES + size, 1);
+    if (!ring) {
+        unlink(path);
+        return NULL;
+    }
+    // The file starts out zeroed, so only the fixed fields need setting
+    RingHeader *header = ring->header;
+    header->version = RING_VERSION;
+    header->producer_pid = (uint32_t)getpid();
+    header->capacity = size;
+    ring->created = now_seconds();
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    memcpy(header->magic, RING_MAGIC, 8); // Last, so a consumer never sees half a header
+    return ring;
+}
+
+RgwmlRing* rgwml_ring_attach(const char *name) {
+    char *path = ring_path(name);
+    if (!path) {
+        return NULL;
+    }
+    struct stat st;
+    int fd = open(path, O_RDWR);
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < RING_HEADER_BYTES + RING_MIN_CAPACITY) {
+        fprintf(stderr, "Could not open ring %s: %s\n", path, fd < 0 ? strerror(errno) : "not a ring");
+        if (fd >= 0) close(fd);
+        free(path);
+        return NULL;
+    }
+    RgwmlRing *ring = ring_map(path, fd, (size_t)st.st_size, 0);
+    if (!ring) {
+        return NULL;
+    }
+    RingHeader *header = ring->header;
+    uint32_t none = 0;
+    // Claiming the consumer slot is one compare-and-swap, so of two
+    // consumers attaching at once only one gets the ring
+    if (memcmp(header->magic, RING_MAGIC, 8) != 0 || header->version != RING_VERSION ||
+        RING_HEADER_BYTES + header->capacity != ring->map_size ||
+        !__atomic_compare_exchange_n(&header->consumer_pid, &none, (uint32_t)getpid(), 0, __ATOMIC_SEQ_CST,
+                                     __ATOMIC_SEQ_CST)) {
+        fprintf(stderr, "%s is not a ring that is waiting for a consumer\n", path);
+        munmap(ring->header, ring->map_size);
+        free(ring->path);
+        free(ring);
+        return NULL;
+    }
+    unlink(path);
+    return ring;
+}
+
+int rgwml_ring_write(RgwmlRing *ring, const void *data, size_t len) {
+    RingHeader *header = ring->header;
+    uint64_t capacity = header->capacity;
+    const unsigned char *bytes = (const unsigned char *)data;
+    while (len > 0) {
+        uint64_t head = header->head;
+        uint32_t seq = __atomic_load_n(&header->tail_seq, __ATOMIC_SEQ_CST);
+        uint64_t tail = __atomic_load_n(&header->tail, __ATOMIC_SEQ_CST);
+        if (head - tail == capacity) {
+            uint32_t consumer = __atomic_load_n(&header->consumer_pid, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&header->consumer_closed, __ATOMIC_SEQ_CST) ||
+                (consumer != 0 && !ring_peer_alive(consumer))) {
+                fprintf(stderr, "Ring consumer went away\n");
+                return -1;
+            }
+            if (consumer == 0 && now_seconds() - ring->created > RING_ATTACH_SECONDS) {
+                fprintf(stderr, "No consumer attached to %s within %d seconds\n", ring->path, RING_ATTACH_SECONDS);
+                return -1;
+            }
+            if (interrupted) {
+                fprintf(stderr, "Interrupted while waiting for the ring consumer\n");
+                return -1;
+            }
+            __atomic_store_n(&header->producer_waiting, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&header->tail, __ATOMIC_SEQ_CST) == tail) {
+                ring_futex_wait(&header->tail_seq, seq);
+            }
+            __atomic_store_n(&header->producer_waiting, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        size_t at = (size_t)(head & (capacity - 1));
+        size_t n = (size_t)(capacity - (head - tail));
+        if (n > capacity - at) n = capacity - at;
+        if (n > len) n = len;
+        memcpy(ring->data + at, bytes, n);
+        __atomic_store_n(&header->head, head + n, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&header->head_seq, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&header->consumer_waiting, __ATOMIC_SEQ_CST)) {
+            ring_futex_wake(&header->head_seq);
+        }
+        bytes += n;
+        len -= n;
+    }
+    return 0;
+}
+
+long rgwml_ring_peek(RgwmlRing *ring, const void **data) {
+    RingHeader *header = ring->header;
+    uint64_t capacity = header->capacity;
+    uint64_t tail = header->tail;
+    for (;;) {
+        uint32_t seq = __atomic_load_n(&header->head_seq, __ATOMIC_SEQ_CST);
+        uint32_t state = __atomic_load_n(&header->state, __ATOMIC_SEQ_CST);
+        uint64_t head = __atomic_load_n(&header->head, __ATOMIC_SEQ_CST);
+        if (head != tail) {
+            size_t at = (size_t)(tail & (capacity - 1));
+            size_t n = (size_t)(head - tail);
+            *data = ring->data + at;
+            return (long)(n < capacity - at ? n : capacity - at);
+        }
+        if (state == RING_FINISHED) {
+            return 0;
+        }
+        if (state == RING_FAILED || !ring_peer_alive(header->producer_pid)) {
+            fprintf(stderr, "Ring producer %s\n", state == RING_FAILED ? "failed" : "went away");
+            return -1;
+        }
+        __atomic_store_n(&header->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&header->head, __ATOMIC_SEQ_CST) == tail &&
+            __atomic_load_n(&header->state, __ATOMIC_SEQ_CST) == RING_OPEN) {
+            ring_futex_wait(&header->head_seq, seq);
+        }
+        __atomic_store_n(&header->consumer_waiting, 0, __ATOMIC_SEQ_CST);
+    }
+}
+
+void rgwml_ring_consume(RgwmlRing *ring, size_t len) {
+    RingHeader *header = ring->header;
+    __atomic_store_n(&header->tail, header->tail + len, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&header->tail_seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&header->producer_waiting, __ATOMIC_SEQ_CST)) {
+        ring_futex_wake(&header->tail_seq);
+    }
+}
+
+long rgwml_ring_read(RgwmlRing *ring, void *buffer, size_t len) {
+    const void *data = NULL;
+    long available = rgwml_ring_peek(ring, &data);
+    if (available <= 0) {
+        return available;
+    }
+    size_t n = (size_t)available < len ? (size_t)available : len;
+    memcpy(buffer, data, n);
+    rgwml_ring_consume(ring, n);
+    return (long)n;
+}
+
+void rgwml_ring_close(RgwmlRing *ring, int failed) {
+    if (!ring) return;
+    RingHeader *header = ring->header;
+    if (ring->producer) {
+        __atomic_store_n(&header->state, failed ? RING_FAILED : RING_FINISHED, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&header->head_seq, 1, __ATOMIC_SEQ_CST);
+        ring_futex_wake(&header->head_seq);
+        // A consumer unlinks the name when it attaches, after which the
+        // name may already belong to a newer ring
+        if (failed && __atomic_load_n(&header->consumer_pid, __ATOMIC_SEQ_CST) == 0) {
+            unlink(ring->path);
+        }
+    } else {
+        __atomic_store_n(&header->consumer_closed, 1, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&header->tail_seq, 1, __ATOMIC_SEQ_CST);
+        ring_futex_wake(&header->tail_seq);
+    }
+    munmap(ring->header, ring->map_size);
+    free(ring->path);
+    free(ring);
+}
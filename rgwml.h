@@ -0,0 +1,167 @@
+#ifndef RGWML_H
+#define RGWML_H
+
+// librgwml: run queries against the presets in an rgwml config file and read
+// the results in-process.
+//
+// Handles are opaque. An RgwmlDb may be shared by any number of threads,
+// since every query runs on a connection of its own. A result belongs to the
+// thread that works with it, and iterators are per caller. Call rgwml_init()
+// once before anything else. Every thread that runs queries is set up for
+// the MySQL client library on its first query, and torn down again when it
+// exits.
+//
+// Cells are strings as MySQL sends them, with SQL NULL spelled "NULL".
+// Errors are reported on stderr, and the call returns NULL or -1.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RGWML_API_VERSION 1
+
+// Build the library with -fvisibility=hidden so only these functions are
+// exported from librgwml.so
+#if defined(__GNUC__)
+#define RGWML_API __attribute__((visibility("default")))
+#else
+#define RGWML_API
+#endif
+
+// Arrow C Data Interface, verbatim from the Arrow specification
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema {
+    // Array type description
+    const char *format;
+    const char *name;
+    const char *metadata;
+    int64_t flags;
+    int64_t n_children;
+    struct ArrowSchema **children;
+    struct ArrowSchema *dictionary;
+
+    // Release callback
+    void (*release)(struct ArrowSchema *);
+    // Opaque producer-specific data
+    void *private_data;
+};
+
+struct ArrowArray {
+    // Array data description
+    int64_t length;
+    int64_t null_count;
+    int64_t offset;
+    int64_t n_buffers;
+    int64_t n_children;
+    const void **buffers;
+    struct ArrowArray **children;
+    struct ArrowArray *dictionary;
+
+    // Release callback
+    void (*release)(struct ArrowArray *);
+    // Opaque producer-specific data
+    void *private_data;
+};
+
+#endif // ARROW_C_DATA_INTERFACE
+
+typedef struct RgwmlDb RgwmlDb;
+typedef struct RgwmlResult RgwmlResult;
+typedef struct RgwmlRowIter RgwmlRowIter;
+typedef struct RgwmlColumnIter RgwmlColumnIter;
+
+// Process-wide setup; safe to call more than once and from several threads
+RGWML_API int rgwml_init(void);
+RGWML_API void rgwml_end(void);
+
+// Optional: rgwml_query() does this on a thread's first query, and the
+// thread is torn down on exit either way
+RGWML_API void rgwml_thread_init(void);
+RGWML_API void rgwml_thread_end(void);
+
+// Loads `preset` from the config file. A preset group resolves to its primary.
+RGWML_API RgwmlDb* rgwml_open(const char *config_path, const char *preset);
+RGWML_API void rgwml_close(RgwmlDb *db);
+
+// Runs `sql` and fetches the whole result. timeout_ms of 0 means no
+// timeout. When the timeout hits, the rows that had already arrived are
+// kept and rgwml_result_partial() says why.
+RGWML_API RgwmlResult* rgwml_query(const RgwmlDb *db, const char *sql, unsigned long long timeout_ms);
+RGWML_API void rgwml_result_free(RgwmlResult *result);
+
+RGWML_API unsigned long long rgwml_result_rows(const RgwmlResult *result);
+RGWML_API int rgwml_result_columns(const RgwmlResult *result); // 0 for statements without a result set
+RGWML_API unsigned long long rgwml_result_affected_rows(const RgwmlResult *result);
+RGWML_API const char* rgwml_result_partial(const RgwmlResult *result); // NULL when complete
+RGWML_API const char* rgwml_column_name(const RgwmlResult *result, int column);
+RGWML_API const char* rgwml_column_type(const RgwmlResult *result, int column); // MySQL type, e.g. "VARCHAR"
+RGWML_API const char* rgwml_cell(const RgwmlResult *result, unsigned long long row, int column);
+
+// Walks the rows in order. Each row is rgwml_result_columns() cells and
+// stays valid until the result is freed.
+RGWML_API RgwmlRowIter* rgwml_rows(const RgwmlResult *result);
+RGWML_API const char* const* rgwml_row_next(RgwmlRowIter *iter); // NULL after the last row
+RGWML_API void rgwml_row_iter_free(RgwmlRowIter *iter);
+
+// Walks one column top to bottom
+RGWML_API RgwmlColumnIter* rgwml_column(const RgwmlResult *result, int column);
+RGWML_API const char* rgwml_column_next(RgwmlColumnIter *iter); // NULL after the last row
+RGWML_API void rgwml_column_iter_free(RgwmlColumnIter *iter);
+
+// Exports the result as an Arrow struct array with one child per column,
+// e.g. for pyarrow.RecordBatch._import_from_c(array_address, schema_address).
+// Integer columns become int64 and FLOAT and DOUBLE become float64 when
+// every cell parses. DECIMAL(p,s) becomes decimal128(p,s), exact, up to 38
+// digits. BINARY, VARBINARY and BLOB columns become binary. Everything else
+// is utf8. utf8 and binary columns switch to their large variants past 2 GiB.
+// SQL NULLs are nulls, while a text cell that reads "NULL" stays text. Binary
+// cells keep every byte, including zero bytes. The Arrow buffers are independent of the result,
+// which may be freed straight away. The consumer calls the release
+// callbacks.
+RGWML_API int rgwml_result_to_arrow(const RgwmlResult *result, struct ArrowSchema *schema, struct ArrowArray *array);
+
+// Shared-memory ring: a single-producer, single-consumer byte stream in
+// /dev/shm/<name>, e.g. the RGWC stream of `rgwml_cli --output shm:<name>`.
+// The producer creates it. A consumer on the same host attaches by name,
+// which also unlinks the name. Writes block while the ring is full, and
+// reads block while it is empty. The two sides wake each other through
+// futexes in the shared header and never spin. Either side notices when
+// the other one exits or closes early. A producer whose ring fills before
+// any consumer attaches gives up after 60 seconds.
+//
+// Layout: a 4096-byte header, then `capacity` data bytes (a power of two).
+// The header holds the magic "RGWMLRNG", u32 version, u32 producer pid,
+// u64 capacity, u32 state, u32 consumer pid and u32 consumer_closed. head
+// (u64 bytes written, u32 head_seq futex) and tail (u64 bytes read, u32
+// tail_seq futex) sit on their own cache lines at offsets 64 and 128. Byte n
+// of the stream is at data[n % capacity].
+typedef struct RgwmlRing RgwmlRing;
+
+RGWML_API RgwmlRing* rgwml_ring_create(const char *name, size_t capacity); // Rounded up to a power of two, at most 16 GiB
+RGWML_API int rgwml_ring_write(RgwmlRing *ring, const void *data, size_t len); // 0, or -1 once the consumer is gone
+
+RGWML_API RgwmlRing* rgwml_ring_attach(const char *name);
+// Waits for data and points *data at the next contiguous run of it. Returns
+// its length, 0 at the end of the stream or -1 when the producer failed.
+RGWML_API long rgwml_ring_peek(RgwmlRing *ring, const void **data);
+RGWML_API void rgwml_ring_consume(RgwmlRing *ring, size_t len); // Frees the first len bytes of the peeked run
+RGWML_API long rgwml_ring_read(RgwmlRing *ring, void *buffer, size_t len); // peek, copy and consume
+
+// The producer marks the stream finished, or failed when `failed` is set. A
+// consumer closing early makes the producer's writes fail.
+RGWML_API void rgwml_ring_close(RgwmlRing *ring, int failed);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,237 +1,213 @@
+#define _GNU_SOURCE // fopencookie
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <zlib.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 #include <mysql/mysql.h>
+#include <mysql/errmsg.h>
+#include <mysql/mysqld_error.h>
 #include <cjson/cJSON.h>
 #include "fort.h" // Include libfort for table formatting
+#include "rgwml_internal.h"
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#define RGWML_HAVE_IO_URING 1
+#endif
+#endif
 
-// Structure to store query results
-typedef struct {
-    char **rows; // Array of strings
-    char **headers; // Array of column headers
-    char **mysql_types; // Array of MySQL column types
-    char **c_types; // Array of C column types
-    int rows_count;
-    int cols_count;
-} QueryResult;
+#define CONFIG_PATH "/home/rgw/Documents/rgwml.config"
+#define HISTORY_PATH "/home/rgw/Documents/rgwml.history"
+
+// ---- Option parsing ----
 
-void free_query_result(QueryResult *result) {
-    if (!result) return;
-    for (int i = 0; i < result->rows_count * result->cols_count; i++) {
-        free(result->rows[i]);
+// Parse a strictly positive integer option value
+int parse_count_option(const char *option, const char *value, unsigned long long *out) {
+    char *end = NULL;
+    if (!value || !*value || *value == '-') {
+        fprintf(stderr, "%s expects a positive number\n", option);
+        return -1;
     }
-    for (int i = 0; i < result->cols_count; i++) {
-        free(result->headers[i]);
-        free(result->mysql_types[i]);
-        free(result->c_types[i]);
+    unsigned long long parsed = strtoull(value, &end, 10);
+    if (*end != '\0' || parsed == 0) {
+        fprintf(stderr, "%s expects a positive number, got '%s'\n", option, value);
+        return -1;
     }
-    free(result->rows);
-    free(result->headers);
-    free(result->mysql_types);
-    free(result->c_types);
-    free(result);
+    *out = parsed;
+    return 0;
 }
 
-char* read_file(const char* filename) {
-    FILE* file = fopen(filename, "rb");
-    if (!file) {
-        fprintf(stderr, "Could not open file %s\n", filename);
-        return NULL;
+// Consume a throttling option at argv[*i]. Returns 1 when it was one, 0 when
+// it was not and -1 when its value is invalid.
+int parse_throttle_option(int argc, char *argv[], int *i, ThrottleOptions *options) {
+    const char *option = argv[*i];
+    unsigned long long value = 0;
+    if (strcmp(option, "--max-rows-per-sec") != 0 && strcmp(option, "--max-bytes-per-sec") != 0 &&
+        strcmp(option, "--max-threads-running") != 0 && strcmp(option, "--max-replica-lag") != 0 &&
+        strcmp(option, "--monitor-preset") != 0) {
+        return 0;
     }
-    fseek(file, 0, SEEK_END);
-    long length = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    char* content = (char*)malloc(length + 1);
-    if (!content) {
-        fprintf(stderr, "Memory allocation failed\n");
-        fclose(file);
-        return NULL;
+    if (*i + 1 >= argc) {
+        fprintf(stderr, "%s expects a value\n", option);
+        return -1;
     }
-    fread(content, 1, length, file);
-    fclose(file);
-    content[length] = '\0';
-    return content;
+    const char *arg = argv[++*i];
+    if (strcmp(option, "--monitor-preset") == 0) {
+        options->monitor_preset = arg;
+        return 1;
+    }
+    if (parse_count_option(option, arg, &value) != 0) {
+        return -1;
+    }
+    if (strcmp(option, "--max-rows-per-sec") == 0) {
+        options->max_rows_per_sec = (double)value;
+    } else if (strcmp(option, "--max-bytes-per-sec") == 0) {
+        options->max_bytes_per_sec = (double)value;
+    } else if (strcmp(option, "--max-threads-running") == 0) {
+        options->max_threads_running = value;
+    } else {
+        options->max_replica_lag = value;
+    }
+    return 1;
 }
 
-cJSON* get_db_preset(cJSON *json, const char* preset_name) {
-    cJSON *db_presets = cJSON_GetObjectItemCaseSensitive(json, "db_presets");
-    cJSON *preset = NULL;
-    cJSON_ArrayForEach(preset, db_presets) {
-        cJSON *name = cJSON_GetObjectItemCaseSensitive(preset, "name");
-        if (cJSON_IsString(name) && (strcmp(name->valuestring, preset_name) == 0)) {
-            return preset;
-        }
+// Handles --trace for every subcommand's option loop, like
+// parse_throttle_option. Returns 1 when argv[*i] was consumed, 0 when it is
+// not --trace and -1 on error.
+int parse_trace_option(int argc, char *argv[], int *i) {
+    if (strcmp(argv[*i], "--trace") != 0) {
+        return 0;
     }
-    return NULL;
+    if (*i + 1 >= argc) {
+        fprintf(stderr, "--trace expects a file name\n");
+        return -1;
+    }
+    (*i)++;
+    return trace_open(argv[*i]) == 0 ? 1 : -1;
 }
 
-typedef struct {
-    const char *mysql_type;
-    const char *c_type;
-} TypeMapping;
-
-TypeMapping mysql_type_to_c_type(enum enum_field_types type) {
-    switch (type) {
-        case MYSQL_TYPE_DECIMAL:
-        case MYSQL_TYPE_NEWDECIMAL:
-            return (TypeMapping){"DECIMAL", "double"};
-        case MYSQL_TYPE_TINY:
-            return (TypeMapping){"TINYINT", "int8_t"};
-        case MYSQL_TYPE_SHORT:
-            return (TypeMapping){"SMALLINT", "int16_t"};
-        case MYSQL_TYPE_LONG:
-            return (TypeMapping){"INT", "int32_t"};
-        case MYSQL_TYPE_FLOAT:
-            return (TypeMapping){"FLOAT", "float"};
-        case MYSQL_TYPE_DOUBLE:
-            return (TypeMapping){"DOUBLE", "double"};
-        case MYSQL_TYPE_NULL:
-            return (TypeMapping){"NULL", "void"};
-        case MYSQL_TYPE_TIMESTAMP:
-            return (TypeMapping){"TIMESTAMP", "char*"};
-        case MYSQL_TYPE_LONGLONG:
-            return (TypeMapping){"BIGINT", "int64_t"};
-        case MYSQL_TYPE_INT24:
-            return (TypeMapping){"MEDIUMINT", "int32_t"};
-        case MYSQL_TYPE_DATE:
-            return (TypeMapping){"DATE", "char*"};
-        case MYSQL_TYPE_TIME:
-            return (TypeMapping){"TIME", "char*"};
-        case MYSQL_TYPE_DATETIME:
-            return (TypeMapping){"DATETIME", "char*"};
-        case MYSQL_TYPE_YEAR:
-            return (TypeMapping){"YEAR", "int"};
-        case MYSQL_TYPE_NEWDATE:
-            return (TypeMapping){"NEWDATE", "char*"};
-        case MYSQL_TYPE_VARCHAR:
-            return (TypeMapping){"VARCHAR", "char*"};
-        case MYSQL_TYPE_BIT:
-            return (TypeMapping){"BIT", "uint8_t"};
-        case MYSQL_TYPE_JSON:
-            return (TypeMapping){"JSON", "char*"};
-        case MYSQL_TYPE_ENUM:
-            return (TypeMapping){"ENUM", "char*"};
-        case MYSQL_TYPE_SET:
-            return (TypeMapping){"SET", "char*"};
-        case MYSQL_TYPE_TINY_BLOB:
-            return (TypeMapping){"TINYBLOB", "char*"};
-        case MYSQL_TYPE_MEDIUM_BLOB:
-            return (TypeMapping){"MEDIUMBLOB", "char*"};
-        case MYSQL_TYPE_LONG_BLOB:
-            return (TypeMapping){"LONGBLOB", "char*"};
-        case MYSQL_TYPE_BLOB:
-            return (TypeMapping){"BLOB", "char*"};
-        case MYSQL_TYPE_VAR_STRING:
-        case MYSQL_TYPE_STRING:
-            return (TypeMapping){"STRING", "char*"};
-        case MYSQL_TYPE_GEOMETRY:
-            return (TypeMapping){"GEOMETRY", "char*"};
-        default:
-            return (TypeMapping){"UNKNOWN", "void"};
-    }
-}
-
-QueryResult* execute_mysql_query(const char *host, const char *user, const char *password, const char *database, const char *query) {
-    MYSQL *conn;
-    MYSQL_RES *res;
-    MYSQL_ROW row;
-    MYSQL_FIELD *fields;
-    QueryResult *result;
+// ---- Instrumentation reports ----
 
-    conn = mysql_init(NULL);
-    if (!conn) {
-        fprintf(stderr, "mysql_init() failed\n");
-        return NULL;
+void print_server_stats(const ServerStats *stats) {
+    if (!stats) {
+        printf("Server: session status unavailable\n");
+        return;
     }
-
-    if (!mysql_real_connect(conn, host, user, password, database, 0, NULL, 0)) {
-        fprintf(stderr, "Connection failed: %s\n", mysql_error(conn));
-        return NULL;
+    int shown = 0;
+    printf("Server session status deltas:\n");
+    for (int i = 0; i < stats->status.count; i++) {
+        if (stats->status.values[i] != 0) {
+            printf("  %-28s %lld\n", stats->status.names[i], stats->status.values[i]);
+            shown++;
+        }
     }
-
-    if (mysql_query(conn, query)) {
-        fprintf(stderr, "Query failed: %s\n", mysql_error(conn));
-        mysql_close(conn);
-        return NULL;
+    if (!shown) {
+        printf("  (no change)\n");
     }
-
-    res = mysql_store_result(conn);
-    if (!res) {
-        fprintf(stderr, "mysql_store_result() failed: %s\n", mysql_error(conn));
-        mysql_close(conn);
-        return NULL;
+    if (stats->statement.count == 0) {
+        printf("Statement event: performance_schema unavailable\n");
+        return;
     }
-
-    int rows_count = mysql_num_rows(res);
-    int cols_count = mysql_num_fields(res);
-    fields = mysql_fetch_fields(res);
-
-    result = (QueryResult *)malloc(sizeof(QueryResult));
-    if (!result) {
-        fprintf(stderr, "Memory allocation for result failed\n");
-        mysql_free_result(res);
-        mysql_close(conn);
-        return NULL;
+    printf("Statement event (performance_schema):\n");
+    for (int i = 0; i < stats->statement.count; i++) {
+        const char *name = stats->statement.names[i];
+        if (strcmp(name, "TIMER_WAIT") == 0 || strcmp(name, "LOCK_TIME") == 0) {
+            // Picoseconds
+            printf("  %-28s %.3f ms\n", name, stats->statement.values[i] / 1e9);
+        } else {
+            printf("  %-28s %lld\n", name, stats->statement.values[i]);
+        }
     }
-    result->rows_count = rows_count;
-    result->cols_count = cols_count;
-    result->rows = (char **)malloc(rows_count * cols_count * sizeof(char *));
-    result->headers = (char **)malloc(cols_count * sizeof(char *));
-    result->mysql_types = (char **)malloc(cols_count * sizeof(char *));
-    result->c_types = (char **)malloc(cols_count * sizeof(char *));
+}
 
-    if (!result->rows || !result->headers || !result->mysql_types || !result->c_types) {
-        fprintf(stderr, "Memory allocation for rows, headers, or types failed\n");
-        free_query_result(result);
-        mysql_free_result(res);
-        mysql_close(conn);
-        return NULL;
-    }
+void print_query_profile(const QueryResult *result) {
+    const QueryProfile *profile = &result->profile;
+    printf("\nClient: connect %.1f ms, execute %.1f ms, fetch %.1f ms, %llu rows, %llu bytes\n",
+           profile->connect_seconds * 1000.0, profile->execute_seconds * 1000.0,
+           profile->fetch_seconds * 1000.0, result->rows_count, profile->bytes);
+    print_server_stats(result->server_stats);
+}
 
-    for (int i = 0; i < cols_count; i++) {
-        result->headers[i] = strdup(fields[i].name);
-        TypeMapping mapping = mysql_type_to_c_type(fields[i].type);
-        result->mysql_types[i] = strdup(mapping.mysql_type);
-        result->c_types[i] = strdup(mapping.c_type);
-        if (!result->headers[i] || !result->mysql_types[i] || !result->c_types[i]) {
-            fprintf(stderr, "strdup failed for header[%d], mysql_type[%d], or c_type[%d]\n", i, i, i);
-            free_query_result(result);
-            mysql_free_result(res);
-            mysql_close(conn);
-            return NULL;
-        }
+void perf_report(void) {
+    if (!perf.enabled || perf.phase_count == 0) return;
+    static const char *headers[] = {"phase", "rows", "cycles", "instructions", "IPC", "cache-misses", "branch-misses",
+                                    "cycles/row", "cache-misses/row", "branch-misses/row"};
+    char cell[32];
+
+    ft_table_t *table = ft_create_table();
+    ft_set_cell_prop(table, FT_ANY_ROW, FT_ANY_COLUMN, FT_CPROP_TEXT_ALIGN, FT_ALIGNED_LEFT);
+    ft_set_cell_prop(table, 0, FT_ANY_COLUMN, FT_CPROP_ROW_TYPE, FT_ROW_HEADER);
+    for (size_t i = 0; i < sizeof(headers) / sizeof(headers[0]); i++) {
+        ft_u8write(table, headers[i]);
     }
+    ft_ln(table);
 
-    int row_index = 0;
-    while ((row = mysql_fetch_row(res))) {
-        for (int i = 0; i < cols_count; i++) {
-            if (row[i]) {
-                result->rows[row_index * cols_count + i] = strdup(row[i]);
+    for (int p = 0; p < perf.phase_count; p++) {
+        const PerfPhase *phase = &perf.phases[p];
+        ft_u8write(table, phase->name);
+        snprintf(cell, sizeof(cell), "%llu", phase->rows);
+        ft_u8write(table, cell);
+        for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+            if (phase->values[i] < 0) {
+                ft_u8write(table, "n/a");
             } else {
-                result->rows[row_index * cols_count + i] = strdup("NULL");
+                snprintf(cell, sizeof(cell), "%.0f", phase->values[i]);
+                ft_u8write(table, cell);
             }
-            if (!result->rows[row_index * cols_count + i]) {
-                fprintf(stderr, "strdup failed for row[%d][%d]\n", row_index, i);
-                free_query_result(result);
-                mysql_free_result(res);
-                mysql_close(conn);
-                return NULL;
+            if (i == 1) {
+                // IPC after instructions
+                if (phase->values[0] > 0 && phase->values[1] >= 0) {
+                    snprintf(cell, sizeof(cell), "%.2f", phase->values[1] / phase->values[0]);
+                } else {
+                    snprintf(cell, sizeof(cell), "n/a");
+                }
+                ft_u8write(table, cell);
+            }
+        }
+        int per_row[] = {0, 2, 3};
+        for (size_t i = 0; i < sizeof(per_row) / sizeof(per_row[0]); i++) {
+            double value = phase->values[per_row[i]];
+            if (phase->rows > 0 && value >= 0) {
+                snprintf(cell, sizeof(cell), "%.2f", value / (double)phase->rows);
+            } else {
+                snprintf(cell, sizeof(cell), "-");
             }
+            ft_u8write(table, cell);
         }
-        row_index++;
+        ft_ln(table);
     }
-
-    mysql_free_result(res);
-    mysql_close(conn);
-
-    return result;
+    printf("\n%s", (const char *)ft_to_u8string(table));
+    ft_destroy_table(table);
 }
 
 // Function to safely truncate and format cell data
 char *safe_strncpy(char *dest, const char *src, size_t n) {
-    if (strlen(src) > n) {
-        strncpy(dest, src, n - 3); // Leave space for ellipsis
-        strcat(dest, "...");
+    if (strlen(src) > n && n < 3) {
+        memcpy(dest, src, n); // No room for an ellipsis
+        dest[n] = '\0';
+    } else if (strlen(src) > n) {
+        memcpy(dest, src, n - 3); // Leave space for ellipsis
+        memcpy(dest + n - 3, "...", 4);
     } else {
         strncpy(dest, src, n);
         dest[n] = '\0';
@@ -239,11 +215,37 @@ char *safe_strncpy(char *dest, const char *src, size_t n) {
     return dest;
 }
 
-void print_query_result(QueryResult *result) {
-    if (!result) {
-        return;
+// Bytes held by the result: the struct, the pointer arrays and every string
+size_t query_result_size(const QueryResult *result) {
+    size_t size = sizeof(QueryResult);
+    size += result->chunks_cap * sizeof(char **);
+    size += result->chunks_cap * sizeof(unsigned long *);
+    size += result->chunks_count * result->rows_per_chunk * result->cols_count * (sizeof(char *) + sizeof(unsigned long));
+    size += result->cols_count * sizeof(char *) * 3; // headers, mysql_types, c_types
+    if (result->max_lengths) {
+        size += result->cell_bytes; // Already summed by the morsel workers
+    } else {
+        for (unsigned long long row = 0; row < result->rows_count; row++) {
+            char **cells = query_result_row(result, row);
+            unsigned long *lengths = query_result_lengths(result, row);
+            for (int i = 0; i < result->cols_count; i++) {
+                size += (lengths[i] == RESULT_NULL_LENGTH ? strlen(cells[i]) : lengths[i]) + 1;
+            }
+        }
     }
+    for (int i = 0; i < result->cols_count; i++) {
+        size += strlen(result->headers[i]) + 1;
+        size += strlen(result->mysql_types[i]) + 1;
+        size += strlen(result->c_types[i]) + 1;
+    }
+    return size;
+}
 
+// The first and last rows as a table. `result` may hold only those rows of
+// a total_rows result: the first five and then the last five.
+void print_result_table(QueryResult *result, unsigned long long total_rows) {
+    double started = trace_begin();
+    perf_begin();
     ft_table_t *table = ft_create_table();
     //ft_set_border_style(table, FT_NICE_STYLE);
     ft_set_cell_prop(table, FT_ANY_ROW, FT_ANY_COLUMN, FT_CPROP_TEXT_ALIGN, FT_ALIGNED_LEFT);
@@ -283,9 +285,9 @@ void print_query_result(QueryResult *result) {
     ft_ln(table);
 
     // Print rows
-    int rows_to_show = 5;
-    for (int i = 0; i < result->rows_count; i++) {
-        if (result->rows_count > 10 && i == rows_to_show) {
+    unsigned long long rows_to_show = 5;
+    for (unsigned long long i = 0; i < result->rows_count; i++) {
+        if (total_rows > 10 && i == rows_to_show) {
             // Print a row of "..." if rows exceed 10
             for (int j = 0; j < 3 && j < result->cols_count; j++) {
                 ft_u8write(table, "...");
@@ -302,8 +304,9 @@ void print_query_result(QueryResult *result) {
             i = result->rows_count - rows_to_show; // Skip directly to the last 5 rows
         }
 
+        char **cells = query_result_row(result, i);
         for (int j = 0; j < 3 && j < result->cols_count; j++) {
-            safe_strncpy(buffer, result->rows[i * result->cols_count + j], bufferSize - 1);
+            safe_strncpy(buffer, cells[j], bufferSize - 1);
             ft_u8write(table, buffer);
         }
         if (hidden_columns > 0) {
@@ -311,7 +314,7 @@ void print_query_result(QueryResult *result) {
         }
         if (result->cols_count > 4) {
             for (int j = result->cols_count - 4; j < result->cols_count; j++) {
-                safe_strncpy(buffer, result->rows[i * result->cols_count + j], bufferSize - 1);
+                safe_strncpy(buffer, cells[j], bufferSize - 1);
                 ft_u8write(table, buffer);
             }
         }
@@ -319,80 +322,6298 @@ void print_query_result(QueryResult *result) {
     }
 
     // Print the table
-    printf("%s\n", (const char *)ft_to_u8string(table));
+    const char *text = (const char *)ft_to_u8string(table);
+    perf_end("format", total_rows > 10 ? 2 * rows_to_show : result->rows_count);
+    trace_span("format", started, NULL, 0);
+    started = trace_begin();
+    perf_begin();
+    printf("%s\n", text);
+    fflush(stdout);
+    RGWML_PROBE2(output__flush, "stdout", result->rows_count);
+    perf_end("write", 0);
+    trace_span("write", started, NULL, 0);
     ft_destroy_table(table);
+}
 
-    // Print additional information
-    printf("Total number of rows: %d\n", result->rows_count);
-    // Calculate and print the size of the object in memory in GB
-    size_t size = sizeof(QueryResult);
-    size += result->rows_count * result->cols_count * sizeof(char *);
-    size += result->cols_count * sizeof(char *) * 3; // headers, mysql_types, c_types
-    for (int i = 0; i < result->rows_count * result->cols_count; i++) {
-         size += strlen(result->rows[i]) + 1;
+void print_query_result(QueryResult *result) {
+    if (!result) {
+        return;
     }
-    for (int i = 0; i < result->cols_count; i++) {
-        size += strlen(result->headers[i]) + 1;
-        size += strlen(result->mysql_types[i]) + 1;
-        size += strlen(result->c_types[i]) + 1;
+    if (result->cols_count == 0) {
+        printf("Query OK, %llu rows affected\n", result->affected_rows);
+        return;
+    }
+
+    print_result_table(result, result->rows_count);
+
+    // Print additional information
+    if (result->partial_reason) {
+        printf("Total number of rows: %llu (partial, query cancelled: %s)\n", result->rows_count, result->partial_reason);
+    } else {
+        printf("Total number of rows: %llu\n", result->rows_count);
     }
+    // Calculate and print the size of the object in memory in GB
+    double started = trace_begin();
+    perf_begin();
+    size_t size = query_result_size(result);
     double size_in_gb = (double)size / (1024 * 1024 * 1024);
+    perf_end("size estimate", result->rows_count);
+    trace_span("size estimate", started, NULL, 0);
     printf("Size in memory: %.7f GB\n", size_in_gb);
 
     printf("\nColumn names and data types:\n");
     for (int i = 0; i < result->cols_count; i++) {
-        printf("%s (%s => %s)\n", result->headers[i], result->mysql_types[i], result->c_types[i]);
+        if (result->max_lengths) {
+            printf("%s (%s => %s, max length %lu)\n", result->headers[i], result->mysql_types[i], result->c_types[i], result->max_lengths[i]);
+        } else {
+            printf("%s (%s => %s)\n", result->headers[i], result->mysql_types[i], result->c_types[i]);
+        }
     }
 
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <preset_name> <query>\n", argv[0]);
-        return EXIT_FAILURE;
+
+// ---- Latency histograms ----
+// Log-linear buckets in the style of HdrHistogram: values below
+// HISTOGRAM_SUB_COUNT microseconds are exact, above that every power of two
+// is split into HISTOGRAM_SUB_COUNT / 2 linear steps, so any recorded value
+// is reported within 1/64 (about 1.6%) of itself. Memory is fixed and
+// recording is a couple of shifts, so it is cheap enough for every query.
+#define HISTOGRAM_SUB_BITS 7
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_SHIFT 34 // Top bucket covers about 2^41 us, roughly 25 days
+#define HISTOGRAM_SLOTS ((HISTOGRAM_MAX_SHIFT + 2) * (HISTOGRAM_SUB_COUNT / 2))
+
+typedef struct {
+    unsigned long long counts[HISTOGRAM_SLOTS];
+    unsigned long long total;
+    unsigned long long min; // Exact, in microseconds
+    unsigned long long max;
+    double sum;
+} Histogram;
+
+void histogram_init(Histogram *h) {
+    memset(h, 0, sizeof(*h));
+}
+
+int histogram_index(unsigned long long value) {
+    if (value < HISTOGRAM_SUB_COUNT) {
+        return (int)value;
+    }
+    int shift = 63 - __builtin_clzll(value) - (HISTOGRAM_SUB_BITS - 1);
+    if (shift > HISTOGRAM_MAX_SHIFT) {
+        return HISTOGRAM_SLOTS - 1;
     }
+    return shift * (HISTOGRAM_SUB_COUNT / 2) + (int)(value >> shift);
+}
 
-    const char *preset_name = argv[1];
-    const char *query = argv[2];
-    const char *config_path = "/home/rgw/Documents/rgwml.config";
+// Highest value that lands in the slot, as HdrHistogram reports it
+unsigned long long histogram_slot_value(int index) {
+    if (index < HISTOGRAM_SUB_COUNT) {
+        return (unsigned long long)index;
+    }
+    int shift = index / (HISTOGRAM_SUB_COUNT / 2) - 1;
+    unsigned long long sub = (unsigned long long)(index - shift * (HISTOGRAM_SUB_COUNT / 2));
+    return (sub << shift) + (1ULL << shift) - 1;
+}
 
-    char *config_content = read_file(config_path);
-    if (!config_content) {
-        fprintf(stderr, "Failed to read config file\n");
-        return EXIT_FAILURE;
+void histogram_record(Histogram *h, unsigned long long micros) {
+    h->counts[histogram_index(micros)]++;
+    if (h->total == 0 || micros < h->min) h->min = micros;
+    if (micros > h->max) h->max = micros;
+    h->total++;
+    h->sum += (double)micros;
+}
+
+void histogram_merge(Histogram *into, const Histogram *from) {
+    if (from->total == 0) return;
+    for (int i = 0; i < HISTOGRAM_SLOTS; i++) {
+        into->counts[i] += from->counts[i];
     }
+    if (into->total == 0 || from->min < into->min) into->min = from->min;
+    if (from->max > into->max) into->max = from->max;
+    into->total += from->total;
+    into->sum += from->sum;
+}
 
-    cJSON *config_json = cJSON_Parse(config_content);
-    if (!config_json) {
-        fprintf(stderr, "Could not parse JSON\n");
-        free(config_content);
-        return EXIT_FAILURE;
+// `percentile` is 0-100
+unsigned long long histogram_percentile(const Histogram *h, double percentile) {
+    if (h->total == 0) return 0;
+    unsigned long long rank = (unsigned long long)(percentile / 100.0 * (double)h->total + 0.5);
+    if (rank < 1) rank = 1;
+    unsigned long long seen = 0;
+    for (int i = 0; i < HISTOGRAM_SLOTS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            unsigned long long value = histogram_slot_value(i);
+            return value > h->max ? h->max : value;
+        }
     }
+    return h->max;
+}
 
-    cJSON *preset = get_db_preset(config_json, preset_name);
-    if (!preset) {
-        fprintf(stderr, "Preset not found: %s\n", preset_name);
-        cJSON_Delete(config_json);
-        free(config_content);
-        return EXIT_FAILURE;
+// One row per histogram: count, min, p50, p90, p99, max and mean in ms
+void print_latency_table(const char *const *labels, const Histogram *const *histograms, int count) {
+    static const char *headers[] = {"", "count", "min", "p50", "p90", "p99", "max", "mean"};
+    char cell[32];
+
+    ft_table_t *table = ft_create_table();
+    ft_set_cell_prop(table, FT_ANY_ROW, FT_ANY_COLUMN, FT_CPROP_TEXT_ALIGN, FT_ALIGNED_LEFT);
+    ft_set_cell_prop(table, 0, FT_ANY_COLUMN, FT_CPROP_ROW_TYPE, FT_ROW_HEADER);
+    for (size_t i = 0; i < sizeof(headers) / sizeof(headers[0]); i++) {
+        ft_u8write(table, headers[i]);
+    }
+    ft_ln(table);
+
+    for (int i = 0; i < count; i++) {
+        const Histogram *h = histograms[i];
+        ft_u8write(table, labels[i]);
+        snprintf(cell, sizeof(cell), "%llu", h->total);
+        ft_u8write(table, cell);
+        unsigned long long values[] = {
+            h->min, histogram_percentile(h, 50), histogram_percentile(h, 90), histogram_percentile(h, 99), h->max,
+        };
+        for (size_t j = 0; j < sizeof(values) / sizeof(values[0]); j++) {
+            snprintf(cell, sizeof(cell), "%.3f ms", values[j] / 1000.0);
+            ft_u8write(table, cell);
+        }
+        snprintf(cell, sizeof(cell), "%.3f ms", h->total ? h->sum / (double)h->total / 1000.0 : 0.0);
+        ft_u8write(table, cell);
+        ft_ln(table);
     }
 
-    const char *host = cJSON_GetObjectItem(preset, "host")->valuestring;
-    const char *user = cJSON_GetObjectItem(preset, "username")->valuestring;
-    const char *password = cJSON_GetObjectItem(preset, "password")->valuestring;
-    const char *database = cJSON_GetObjectItem(preset, "database")->valuestring;
+    printf("%s\n", (const char *)ft_to_u8string(table));
+    ft_destroy_table(table);
+}
 
-    QueryResult *result = execute_mysql_query(host, user, password, database, query);
-    if (result) {
-        print_query_result(result);
-        free_query_result(result);
+// ---- Repeat mode ----
+// --repeat runs one query N times over a single connection and throws the
+// rows away, so only server work and the wire are measured. Execute is
+// mysql_query() until the result set header arrives, fetch is draining it.
+unsigned long long elapsed_micros(double since) {
+    double elapsed = now_seconds() - since;
+    return elapsed > 0 ? (unsigned long long)(elapsed * 1e6 + 0.5) : 0;
+}
+
+// Runs the query once and discards its rows. Returns the row count or -1.
+long long run_timed_query(MYSQL *conn, const char *query, unsigned long long *execute_us,
+                          unsigned long long *fetch_us) {
+    double started = now_seconds();
+    if (mysql_query(conn, query)) {
+        return -1;
+    }
+    MYSQL_RES *res = mysql_use_result(conn);
+    *execute_us = elapsed_micros(started);
+    long long rows = 0;
+    started = now_seconds();
+    if (res) {
+        while (mysql_fetch_row(res)) {
+            rows++;
+        }
+        mysql_free_result(res);
+    } else if (mysql_field_count(conn) != 0) {
+        return -1;
+    }
+    *fetch_us = elapsed_micros(started);
+    return mysql_errno(conn) ? -1 : rows;
+}
+
+int run_repeat(const DbPreset *db, const char *query, unsigned long long repeat, unsigned long long warmup) {
+    MYSQL *conn = connect_db(db, 0);
+    if (!conn) {
+        return -1;
+    }
+
+    Histogram *histograms = (Histogram *)malloc(3 * sizeof(Histogram));
+    if (!histograms) {
+        fprintf(stderr, "Memory allocation for histograms failed\n");
+        mysql_close(conn);
+        return -1;
+    }
+    for (int i = 0; i < 3; i++) {
+        histogram_init(&histograms[i]);
+    }
+
+    int status = 0;
+    long long rows = 0;
+    unsigned long long done = 0;
+    for (unsigned long long i = 0; i < warmup + repeat && !interrupted; i++) {
+        unsigned long long execute_us = 0, fetch_us = 0;
+        rows = run_timed_query(conn, query, &execute_us, &fetch_us);
+        if (rows < 0) {
+            fprintf(stderr, "Query failed on iteration %llu: %s\n", i + 1, mysql_error(conn));
+            status = -1;
+            break;
+        }
+        if (i < warmup) continue;
+        histogram_record(&histograms[0], execute_us);
+        histogram_record(&histograms[1], fetch_us);
+        histogram_record(&histograms[2], execute_us + fetch_us);
+        done++;
+    }
+    mysql_close(conn);
+
+    if (done > 0) {
+        const char *labels[] = {"execute", "fetch", "total"};
+        const Histogram *rows_of[] = {&histograms[0], &histograms[1], &histograms[2]};
+        print_latency_table(labels, rows_of, 3);
+        printf("%llu runs after %llu warmup, %lld rows per run%s\n", done, warmup, rows,
+               interrupted ? " (interrupted)" : "");
+    }
+    free(histograms);
+    return status;
+}
+
+// ---- Preset groups ----
+// A db_presets entry with "type": "group" names a "primary" preset and a list
+// of "replicas". Writes always go to the primary. Read-only statements go to
+// the healthy replica with the lowest replication lag ("routing":
+// "least_lag", the default) or the lowest probe latency ("least_latency"),
+// optionally skipping replicas lagging more than "max_lag" seconds. Replicas
+// are probed concurrently with a short timeout and the choice is cached in a
+// small file for "cache_seconds", so back-to-back runs do not probe again.
+
+#define GROUP_PROBE_TIMEOUT 2
+#define GROUP_DEFAULT_CACHE_SECONDS 5
+#define GROUP_MAX_REPLICAS 16
+
+typedef struct {
+    DbPreset db;
+    double latency_ms;
+    long long lag;
+    int healthy;
+} ReplicaProbe;
+
+void* probe_replica_main(void *arg) {
+    ReplicaProbe *probe = (ReplicaProbe *)arg;
+    unsigned int timeout = GROUP_PROBE_TIMEOUT;
+    mysql_thread_init();
+    MYSQL *conn = mysql_init(NULL);
+    if (conn) {
+        mysql_options(conn, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+        mysql_options(conn, MYSQL_OPT_READ_TIMEOUT, &timeout);
+        double started = now_seconds();
+        if (mysql_real_connect(conn, probe->db.host, probe->db.user, probe->db.password, probe->db.database, 0, NULL, 0)) {
+            long long lag = monitor_value(conn, "SHOW REPLICA STATUS", "Seconds_Behind_Source");
+            if (lag == -2) {
+                lag = monitor_value(conn, "SHOW SLAVE STATUS", "Seconds_Behind_Master");
+            }
+            probe->latency_ms = (now_seconds() - started) * 1000.0;
+            // No status row means the server does not manage its own
+            // replication (e.g. a managed read replica): take it as current.
+            // A NULL lag means replication is stopped.
+            probe->lag = lag == -1 ? 0 : lag;
+            probe->healthy = lag >= -1;
+        }
+        mysql_close(conn);
+    }
+    mysql_thread_end();
+    return NULL;
+}
+
+// SELECT, SHOW, EXPLAIN, DESCRIBE and WITH ... SELECT without locking reads
+int is_read_only_query(const char *sql) {
+    const char *p = skip_space(sql);
+    while (*p == '(') {
+        p = skip_space(p + 1);
+    }
+    if (match_keyword(p, "SHOW") || match_keyword(p, "EXPLAIN") || match_keyword(p, "DESCRIBE") || match_keyword(p, "DESC")) {
+        return 1;
+    }
+    if (!match_keyword(p, "SELECT") && !match_keyword(p, "WITH")) {
+        return 0;
+    }
+    const char *lock = find_top_level_keyword(p, "FOR");
+    return !lock && !find_top_level_keyword(p, "INTO") && !find_top_level_keyword(p, "UPDATE") &&
+           !find_top_level_keyword(p, "DELETE") && !find_top_level_keyword(p, "INSERT") &&
+           !find_top_level_keyword(p, "LOCK");
+}
+
+// The routing cache lives in $XDG_RUNTIME_DIR, or else ~/.cache/rgwml, both
+// private to the user. Shared /tmp would let another user plant a decision.
+char* route_cache_path(const char *group_name) {
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    const char *home = getenv("HOME");
+    char *path = NULL;
+    if (runtime && runtime[0] == '/') {
+        path = format_string("%s/rgwml_route_%s", runtime, group_name);
+    } else if (home && home[0] == '/') {
+        char *cache = format_string("%s/.cache", home);
+        char *dir = format_string("%s/.cache/rgwml", home);
+        if (cache && dir && (mkdir(cache, 0700) == 0 || errno == EEXIST) && (mkdir(dir, 0700) == 0 || errno == EEXIST)) {
+            path = format_string("%s/rgwml_route_%s", dir, group_name);
+        }
+        free(cache);
+        free(dir);
+    }
+    if (!path) {
+        return NULL;
+    }
+    for (char *c = path + strlen(path) - strlen(group_name); *c; c++) {
+        if (!isalnum((unsigned char)*c) && *c != '_' && *c != '-') {
+            *c = '_';
+        }
+    }
+    return path;
+}
+
+// Pick the preset for a statement; groups route reads to a replica
+int route_db_preset(cJSON *config, const char *preset_name, int read_only, DbPreset *out) {
+    cJSON *group = get_db_preset(config, preset_name);
+    if (!group || !is_preset_group(group) || !read_only) {
+        return load_db_preset(config, preset_name, out);
+    }
+    cJSON *replicas = cJSON_GetObjectItemCaseSensitive(group, "replicas");
+    cJSON *cache_item = cJSON_GetObjectItemCaseSensitive(group, "cache_seconds");
+    cJSON *max_lag_item = cJSON_GetObjectItemCaseSensitive(group, "max_lag");
+    const char *routing = preset_string(group, "routing");
+    int by_latency = routing && strcmp(routing, "least_latency") == 0;
+    long cache_seconds = cJSON_IsNumber(cache_item) ? (long)cache_item->valuedouble : GROUP_DEFAULT_CACHE_SECONDS;
+    long long max_lag = cJSON_IsNumber(max_lag_item) ? (long long)max_lag_item->valuedouble : -1;
+
+    ReplicaProbe probes[GROUP_MAX_REPLICAS];
+    int probes_count = 0;
+    cJSON *replica = NULL;
+    cJSON_ArrayForEach(replica, replicas) {
+        if (!cJSON_IsString(replica) || probes_count == GROUP_MAX_REPLICAS) {
+            continue;
+        }
+        memset(&probes[probes_count], 0, sizeof(ReplicaProbe));
+        if (load_db_preset(config, replica->valuestring, &probes[probes_count].db) == 0) {
+            probes_count++;
+        }
+    }
+    if (probes_count == 0) {
+        return load_db_preset(config, preset_name, out);
+    }
+
+    // Reuse a recent decision if it still names one of the replicas
+    char *cache_path = route_cache_path(preset_name);
+    int cache_fd = cache_path && cache_seconds > 0 ? open(cache_path, O_RDONLY | O_NOFOLLOW) : -1;
+    struct stat cache_stat;
+    FILE *cache = NULL;
+    // Only a regular file of our own counts
+    if (cache_fd >= 0 && (fstat(cache_fd, &cache_stat) != 0 || !S_ISREG(cache_stat.st_mode) ||
+                          cache_stat.st_uid != getuid() || !(cache = fdopen(cache_fd, "r")))) {
+        close(cache_fd);
+    }
+    if (cache) {
+        long long decided_at = 0;
+        char cached_name[256];
+        if (fscanf(cache, "%lld %255s", &decided_at, cached_name) == 2 && time(NULL) - decided_at < cache_seconds) {
+            for (int i = 0; i < probes_count; i++) {
+                if (strcmp(probes[i].db.name, cached_name) == 0) {
+                    *out = probes[i].db;
+                    fclose(cache);
+                    free(cache_path);
+                    return 0;
+                }
+            }
+        }
+        fclose(cache);
+    }
+
+    pthread_t threads[GROUP_MAX_REPLICAS];
+    int started[GROUP_MAX_REPLICAS];
+    for (int i = 0; i < probes_count; i++) {
+        started[i] = pthread_create(&threads[i], NULL, probe_replica_main, &probes[i]) == 0;
+    }
+    int best = -1;
+    for (int i = 0; i < probes_count; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+        ReplicaProbe *probe = &probes[i];
+        if (!probe->healthy || (max_lag >= 0 && probe->lag > max_lag)) {
+            continue;
+        }
+        if (best < 0 ||
+            (by_latency ? probe->latency_ms < probes[best].latency_ms
+                        : (probe->lag < probes[best].lag ||
+                           (probe->lag == probes[best].lag && probe->latency_ms < probes[best].latency_ms)))) {
+            best = i;
+        }
+    }
+
+    if (best < 0) {
+        fprintf(stderr, "No healthy replica in %s, using the primary\n", preset_name);
+        free(cache_path);
+        return load_db_preset(config, preset_name, out);
+    }
+    fprintf(stderr, "Routing to %s (lag %llds, %.1f ms)\n", probes[best].db.name, probes[best].lag, probes[best].latency_ms);
+    *out = probes[best].db;
+
+    if (cache_path && cache_seconds > 0) {
+        char *tmp_path = format_string("%s.XXXXXX", cache_path);
+        int fd = tmp_path ? mkstemp(tmp_path) : -1;
+        FILE *file = fd >= 0 ? fdopen(fd, "w") : NULL;
+        if (fd >= 0 && !file) {
+            close(fd);
+            unlink(tmp_path);
+        }
+        if (file) {
+            fprintf(file, "%lld %s\n", (long long)time(NULL), out->name);
+            if (fclose(file) != 0 || rename(tmp_path, cache_path) != 0) {
+                unlink(tmp_path);
+            }
+        }
+        free(tmp_path);
+    }
+    free(cache_path);
+    return 0;
+}
+
+// ---- Streaming copy between presets ----
+// The source is read with mysql_use_result() and every row is serialised into
+// LOAD DATA's default text format (tab separated, backslash escaped, \N for
+// NULL). Filled batches travel through a bounded queue to worker threads that
+// each hold a destination connection and feed them to LOAD DATA LOCAL INFILE
+// through a custom local_infile handler, so no intermediate file is written.
+
+#define COPY_BATCH_BYTES (1024 * 1024)
+#define COPY_QUEUE_DEPTH 16
+#define COPY_DEFAULT_WORKERS 4
+#define COPY_DEFAULT_ROWS_PER_LOAD 100000
+
+typedef struct Batch {
+    char *data;
+    size_t len;
+    size_t cap;
+    size_t rows; // Complete rows contained in data
+    struct Batch *next;
+} Batch;
+
+Batch* batch_new(size_t cap) {
+    Batch *batch = (Batch *)calloc(1, sizeof(Batch));
+    if (!batch) {
+        return NULL;
+    }
+    batch->data = (char *)malloc(cap);
+    if (!batch->data) {
+        free(batch);
+        return NULL;
+    }
+    batch->cap = cap;
+    return batch;
+}
+
+void batch_free(Batch *batch) {
+    if (!batch) return;
+    free(batch->data);
+    free(batch);
+}
+
+int batch_reserve(Batch *batch, size_t extra) {
+    if (batch->len + extra <= batch->cap) {
+        return 0;
+    }
+    size_t cap = batch->cap * 2;
+    while (cap < batch->len + extra) {
+        cap *= 2;
+    }
+    RGWML_PROBE2(alloc__grow, "batch", cap);
+    char *data = (char *)realloc(batch->data, cap);
+    if (!data) {
+        fprintf(stderr, "Memory allocation for batch failed\n");
+        return -1;
+    }
+    batch->data = data;
+    batch->cap = cap;
+    return 0;
+}
+
+// Bounded FIFO of batches shared between one producer and several consumers
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    Batch *head;
+    Batch *tail;
+    int depth;
+    int max_depth;
+    int closed; // Producer has finished
+    int failed; // Someone gave up; everybody should stop
+} BatchQueue;
+
+void batch_queue_init(BatchQueue *queue, int max_depth) {
+    memset(queue, 0, sizeof(*queue));
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    queue->max_depth = max_depth;
+}
+
+void batch_queue_destroy(BatchQueue *queue) {
+    while (queue->head) {
+        Batch *next = queue->head->next;
+        batch_free(queue->head);
+        queue->head = next;
+    }
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+}
+
+// Blocks while the queue is full. Returns -1 (and keeps ownership with the
+// caller) when the queue has failed.
+int batch_queue_push(BatchQueue *queue, Batch *batch) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->depth >= queue->max_depth && !queue->failed) {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+    if (queue->failed) {
+        pthread_mutex_unlock(&queue->lock);
+        return -1;
+    }
+    batch->next = NULL;
+    if (queue->tail) {
+        queue->tail->next = batch;
     } else {
-        fprintf(stderr, "Query execution failed.\n");
+        queue->head = batch;
     }
+    queue->tail = batch;
+    queue->depth++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+}
 
-    cJSON_Delete(config_json);
-    free(config_content);
+// Blocks while the queue is empty. Returns NULL once it is closed and drained,
+// or as soon as it has failed.
+Batch* batch_queue_pop(BatchQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    while (!queue->head && !queue->closed && !queue->failed) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    Batch *batch = NULL;
+    if (queue->head && !queue->failed) {
+        batch = queue->head;
+        queue->head = batch->next;
+        if (!queue->head) {
+            queue->tail = NULL;
+        }
+        queue->depth--;
+        pthread_cond_signal(&queue->not_full);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return batch;
+}
 
-    return EXIT_SUCCESS;
+void batch_queue_close(BatchQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = 1;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void batch_queue_fail(BatchQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->failed = 1;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
 }
 
+// Append one field in LOAD DATA text format (value == NULL means SQL NULL)
+int append_load_data_field(Batch *batch, const char *value, unsigned long length, char terminator) {
+    if (batch_reserve(batch, length * 2 + 3) != 0) {
+        return -1;
+    }
+    char *out = batch->data + batch->len;
+    if (!value) {
+        *out++ = '\\';
+        *out++ = 'N';
+    } else {
+        for (unsigned long i = 0; i < length; i++) {
+            switch (value[i]) {
+                case '\\': *out++ = '\\'; *out++ = '\\'; break;
+                case '\t': *out++ = '\\'; *out++ = 't'; break;
+                case '\n': *out++ = '\\'; *out++ = 'n'; break;
+                case '\r': *out++ = '\\'; *out++ = 'r'; break;
+                case '\0': *out++ = '\\'; *out++ = '0'; break;
+                default: *out++ = value[i]; break;
+            }
+        }
+    }
+    *out++ = terminator;
+    batch->len = out - batch->data;
+    return 0;
+}
+
+int append_load_data_row(Batch *batch, MYSQL_ROW row, const unsigned long *lengths, unsigned int cols_count) {
+    for (unsigned int i = 0; i < cols_count; i++) {
+        char terminator = (i + 1 == cols_count) ? '\n' : '\t';
+        if (append_load_data_field(batch, row[i], row[i] ? lengths[i] : 0, terminator) != 0) {
+            return -1;
+        }
+    }
+    batch->rows++;
+    return 0;
+}
+
+// LOAD DATA clause matching append_load_data_row()'s output
+#define LOAD_DATA_TEXT_FORMAT "FIELDS TERMINATED BY '\\t' ESCAPED BY '\\\\' LINES TERMINATED BY '\\n'"
+
+// The stream is read as CHARACTER SET binary so the bytes reach each column
+// unconverted: binary columns stay intact and text keeps its source encoding.
+char* build_load_data_statement(const char *table, const char *format_clause, const char *columns) {
+    char *quoted_table = quote_table_name(table);
+    if (!quoted_table) {
+        return NULL;
+    }
+    char *statement = format_string("LOAD DATA LOCAL INFILE 'rgwml_stream' INTO TABLE %s CHARACTER SET binary %s %s",
+                                    quoted_table, format_clause, columns);
+    free(quoted_table);
+    return statement;
+}
+
+typedef struct {
+    const DbPreset *db;
+    const char *statement;
+    BatchQueue *queue;
+    unsigned long long rows_per_load; // Rows fed to one LOAD DATA statement (one transaction)
+    Batch *current;
+    size_t offset;
+    unsigned long long rows_in_load;
+    unsigned long long rows_loaded;
+    int failed;
+} CopyWorker;
+
+int copy_infile_init(void **ptr, const char *filename, void *userdata) {
+    (void)filename;
+    *ptr = userdata;
+    return 0;
+}
+
+// Serve the LOAD DATA stream straight from queued batches. Returning 0 ends
+// the statement, which always happens on a batch (and thus row) boundary.
+int copy_infile_read(void *ptr, char *buf, unsigned int buf_len) {
+    CopyWorker *worker = (CopyWorker *)ptr;
+    while (!worker->current || worker->offset == worker->current->len) {
+        if (worker->current) {
+            worker->rows_in_load += worker->current->rows;
+            batch_free(worker->current);
+            worker->current = NULL;
+            worker->offset = 0;
+        }
+        if (worker->rows_in_load >= worker->rows_per_load) {
+            return 0;
+        }
+        worker->current = batch_queue_pop(worker->queue);
+        if (!worker->current) {
+            // A failed queue is not the end of the data: fail the LOAD DATA
+            // rather than commit the rows sent so far
+            pthread_mutex_lock(&worker->queue->lock);
+            int aborted = worker->queue->failed;
+            pthread_mutex_unlock(&worker->queue->lock);
+            return aborted ? -1 : 0;
+        }
+    }
+    size_t n = worker->current->len - worker->offset;
+    if (n > buf_len) {
+        n = buf_len;
+    }
+    memcpy(buf, worker->current->data + worker->offset, n);
+    worker->offset += n;
+    return (int)n;
+}
+
+void copy_infile_end(void *ptr) {
+    (void)ptr;
+}
+
+int copy_infile_error(void *ptr, char *error_msg, unsigned int error_msg_len) {
+    (void)ptr;
+    snprintf(error_msg, error_msg_len, "rgwml_cli stream aborted");
+    return CR_UNKNOWN_ERROR;
+}
+
+void* copy_worker_main(void *arg) {
+    CopyWorker *worker = (CopyWorker *)arg;
+    mysql_thread_init();
+    MYSQL *conn = connect_db(worker->db, CONNECT_LOCAL_INFILE);
+    if (!conn) {
+        worker->failed = 1;
+        batch_queue_fail(worker->queue);
+        mysql_thread_end();
+        return NULL;
+    }
+    mysql_set_local_infile_handler(conn, copy_infile_init, copy_infile_read, copy_infile_end, copy_infile_error, worker);
+    trace_thread_name("copy loader");
+
+    // Only start a statement once there is data for it
+    double waited = trace_begin();
+    while ((worker->current = batch_queue_pop(worker->queue))) {
+        trace_span("queue pop", waited, NULL, 0);
+        worker->offset = 0;
+        worker->rows_in_load = 0;
+        double started = trace_begin();
+        int failed = mysql_query(conn, worker->statement);
+        trace_span("LOAD DATA", started, "rows", failed ? 0 : (long long)mysql_affected_rows(conn));
+        waited = trace_begin();
+        if (failed) {
+            fprintf(stderr, "LOAD DATA into %s failed: %s\n", worker->db->name, mysql_error(conn));
+            worker->failed = 1;
+            batch_queue_fail(worker->queue);
+            break;
+        }
+        worker->rows_loaded += mysql_affected_rows(conn);
+    }
+    batch_free(worker->current);
+    worker->current = NULL;
+
+    mysql_close(conn);
+    mysql_thread_end();
+    return NULL;
+}
+
+int copy_between_presets(const DbPreset *src, const DbPreset *dst, const char *query, const char *table,
+                         int workers_count, unsigned long long rows_per_load, Throttle *throttle) {
+    double started = now_seconds();
+    MYSQL *src_conn = connect_db(src, 0);
+    if (!src_conn) {
+        return -1;
+    }
+    // Loaders can hold the fetch loop back; keep the server from dropping
+    // the streaming connection meanwhile.
+    mysql_query(src_conn, "SET SESSION net_write_timeout = 600");
+    if (mysql_query(src_conn, query)) {
+        fprintf(stderr, "Query failed: %s\n", mysql_error(src_conn));
+        mysql_close(src_conn);
+        return -1;
+    }
+    MYSQL_RES *res = mysql_use_result(src_conn);
+    if (!res) {
+        fprintf(stderr, "mysql_use_result() failed: %s\n", mysql_error(src_conn));
+        mysql_close(src_conn);
+        return -1;
+    }
+    unsigned int cols_count = mysql_num_fields(res);
+
+    char *statement = build_load_data_statement(table, LOAD_DATA_TEXT_FORMAT, "");
+    CopyWorker *workers = (CopyWorker *)calloc(workers_count, sizeof(CopyWorker));
+    pthread_t *threads = (pthread_t *)calloc(workers_count, sizeof(pthread_t));
+    if (!statement || !workers || !threads) {
+        fprintf(stderr, "Memory allocation for copy workers failed\n");
+        free(statement);
+        free(workers);
+        free(threads);
+        mysql_free_result(res);
+        mysql_close(src_conn);
+        return -1;
+    }
+
+    BatchQueue queue;
+    batch_queue_init(&queue, COPY_QUEUE_DEPTH);
+    int started_workers = 0;
+    for (int i = 0; i < workers_count; i++) {
+        workers[i].db = dst;
+        workers[i].statement = statement;
+        workers[i].queue = &queue;
+        workers[i].rows_per_load = rows_per_load;
+        if (pthread_create(&threads[i], NULL, copy_worker_main, &workers[i]) != 0) {
+            fprintf(stderr, "Could not start copy worker %d\n", i);
+            break;
+        }
+        started_workers++;
+    }
+
+    int status = started_workers > 0 ? 0 : -1;
+    unsigned long long rows_read = 0;
+    unsigned long long pending_bytes = 0;
+    Batch *batch = NULL;
+    MYSQL_ROW row;
+    trace_thread_name("copy reader");
+    double batch_started = trace_begin();
+    while (status == 0 && (row = mysql_fetch_row(res))) {
+        if (!batch && !(batch = batch_new(COPY_BATCH_BYTES + COPY_BATCH_BYTES / 4))) {
+            fprintf(stderr, "Memory allocation for batch failed\n");
+            status = -1;
+            break;
+        }
+        size_t batch_len = batch->len;
+        if (append_load_data_row(batch, row, mysql_fetch_lengths(res), cols_count) != 0) {
+            status = -1;
+            break;
+        }
+        rows_read++;
+        if (throttle) {
+            pending_bytes += batch->len - batch_len;
+            if (rows_read % THROTTLE_CHECK_ROWS == 0) {
+                throttle_wait(throttle, THROTTLE_CHECK_ROWS, pending_bytes);
+                pending_bytes = 0;
+            }
+        }
+        if (batch->len >= COPY_BATCH_BYTES) {
+            RGWML_PROBE2(fetch__batch, batch->rows, batch->len);
+            trace_span("fetch batch", batch_started, "rows", (long long)batch->rows);
+            double waited = trace_begin();
+            if (batch_queue_push(&queue, batch) != 0) {
+                status = -1;
+                break;
+            }
+            trace_span("queue push", waited, NULL, 0);
+            batch = NULL;
+            batch_started = trace_begin();
+        }
+    }
+    if (status == 0 && mysql_errno(src_conn)) {
+        fprintf(stderr, "Fetch from %s failed: %s\n", src->name, mysql_error(src_conn));
+        status = -1;
+    }
+    if (status == 0 && batch && batch->rows > 0) {
+        if (batch_queue_push(&queue, batch) == 0) {
+            batch = NULL;
+        } else {
+            status = -1;
+        }
+    }
+    batch_free(batch);
+    if (status != 0) {
+        batch_queue_fail(&queue);
+    }
+    batch_queue_close(&queue);
+
+    unsigned long long rows_loaded = 0;
+    for (int i = 0; i < started_workers; i++) {
+        pthread_join(threads[i], NULL);
+        rows_loaded += workers[i].rows_loaded;
+        if (workers[i].failed) {
+            status = -1;
+        }
+    }
+
+    double elapsed = now_seconds() - started;
+    printf("Copied %llu of %llu rows from %s into %s.%s in %.2fs (%.0f rows/s)\n",
+           rows_loaded, rows_read, src->name, dst->name, table, elapsed,
+           elapsed > 0 ? rows_loaded / elapsed : 0.0);
+
+    batch_queue_destroy(&queue);
+    free(threads);
+    free(workers);
+    free(statement);
+    mysql_free_result(res);
+    mysql_close(src_conn);
+    return status;
+}
+
+int run_copy(int argc, char *argv[], const char *program) {
+    unsigned long long workers_count = COPY_DEFAULT_WORKERS;
+    unsigned long long rows_per_load = COPY_DEFAULT_ROWS_PER_LOAD;
+    ThrottleOptions throttle_options = {0};
+    const char *positional[4];
+    int positional_count = 0;
+
+    for (int i = 0; i < argc; i++) {
+        int throttle_arg = parse_throttle_option(argc, argv, &i, &throttle_options);
+        if (throttle_arg < 0) {
+            return EXIT_FAILURE;
+        } else if (throttle_arg) {
+            continue;
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            if (parse_count_option(argv[i], argv[i + 1], &workers_count) != 0) return EXIT_FAILURE;
+            i++;
+        } else if (strcmp(argv[i], "--rows-per-load") == 0 && i + 1 < argc) {
+            if (parse_count_option(argv[i], argv[i + 1], &rows_per_load) != 0) return EXIT_FAILURE;
+            i++;
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            if (parse_trace_option(argc, argv, &i) < 0) return EXIT_FAILURE;
+        } else if (positional_count < 4 && strncmp(argv[i], "--", 2) != 0) {
+            positional[positional_count++] = argv[i];
+        } else {
+            positional_count = -1;
+            break;
+        }
+    }
+    if (positional_count != 4 || workers_count > 64) {
+        fprintf(stderr, "Usage: %s copy [--workers N] [--rows-per-load N] [--trace out.json] [throttle options] <src_preset> <dst_preset> <query> <table>\n", program);
+        return EXIT_FAILURE;
+    }
+
+    cJSON *config_json = load_config(CONFIG_PATH);
+    if (!config_json) {
+        return EXIT_FAILURE;
+    }
+    DbPreset src, dst;
+    Throttle throttle;
+    Throttle *active_throttle = NULL;
+    int status = EXIT_FAILURE;
+    if (route_db_preset(config_json, positional[0], is_read_only_query(positional[2]), &src) == 0 &&
+        load_db_preset(config_json, positional[1], &dst) == 0 &&
+        throttle_setup(&throttle, &throttle_options, config_json, &src, &active_throttle) == 0 &&
+        copy_between_presets(&src, &dst, positional[2], positional[3], (int)workers_count, rows_per_load, active_throttle) == 0) {
+        status = EXIT_SUCCESS;
+    }
+    throttle_close(active_throttle);
+    cJSON_Delete(config_json);
+    return status;
+}
+
+// ---- Bulk file import ----
+// The input file is mapped into memory and cut into chunks of roughly
+// --batch-size bytes that always end on a record boundary. Each chunk is
+// loaded by one LOAD DATA LOCAL INFILE statement on one of several worker
+// connections, so a chunk is also the unit of atomicity and of retry.
+
+#define IMPORT_DEFAULT_WORKERS 4
+#define IMPORT_DEFAULT_BATCH_MB 16
+#define IMPORT_DEFAULT_RETRIES 3
+
+typedef enum {
+    IMPORT_CSV,
+    IMPORT_TSV,
+    IMPORT_NDJSON
+} ImportFormat;
+
+typedef struct {
+    size_t offset;
+    size_t len;
+} ImportChunk;
+
+typedef struct {
+    const DbPreset *db;
+    const char *data; // Mapped input file
+    size_t size;
+    ImportFormat format;
+    const char *statement;
+    char **columns; // NDJSON keys, in the order of the column list
+    int columns_count;
+    unsigned long long retries;
+
+    pthread_mutex_t lock;
+    pthread_cond_t chunk_ready;
+    ImportChunk *chunks;
+    size_t chunks_count;
+    size_t chunks_cap;
+    size_t next_chunk;
+    int scan_done;
+
+    unsigned long long rows_loaded;
+    unsigned long long warnings;
+    size_t chunks_failed;
+} ImportJob;
+
+// Local infile source for one statement: a byte range served verbatim
+typedef struct {
+    const char *data;
+    size_t len;
+    size_t offset;
+} ImportStream;
+
+// Return the offset just past the first newline at or after target that is
+// not inside a double-quoted field. The quote state is carried in *in_quotes
+// so consecutive calls can continue where the previous one stopped. Blocks
+// without quotes or relevant newlines are skipped 16 bytes at a time.
+size_t scan_csv_boundary(const char *data, size_t size, size_t pos, size_t target, int *in_quotes) {
+    int quoted = *in_quotes;
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i newline = _mm_set1_epi8('\n');
+    while (pos + 16 <= size) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + pos));
+        unsigned int quotes = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(block, quote));
+        unsigned int newlines = 0;
+        if (pos + 16 > target) {
+            newlines = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+        }
+        if (!quotes && (!newlines || quoted)) {
+            pos += 16;
+            continue;
+        }
+        unsigned int events = quotes | newlines;
+        while (events) {
+            unsigned int bit = (unsigned int)__builtin_ctz(events);
+            events &= events - 1;
+            if (quotes & (1u << bit)) {
+                quoted = !quoted;
+            } else if (!quoted && pos + bit >= target) {
+                *in_quotes = quoted;
+                return pos + bit + 1;
+            }
+        }
+        pos += 16;
+    }
+#endif
+    for (; pos < size; pos++) {
+        if (data[pos] == '"') {
+            quoted = !quoted;
+        } else if (data[pos] == '\n' && !quoted && pos >= target) {
+            *in_quotes = quoted;
+            return pos + 1;
+        }
+    }
+    *in_quotes = quoted;
+    return size;
+}
+
+// TSV (backslash escaped) and NDJSON never contain a raw newline inside a
+// record, so the boundary is simply the next newline.
+size_t scan_line_boundary(const char *data, size_t size, size_t target) {
+    if (target >= size) {
+        return size;
+    }
+    const char *newline = (const char *)memchr(data + target, '\n', size - target);
+    return newline ? (size_t)(newline - data) + 1 : size;
+}
+
+// Length of the first line, without its line terminator
+size_t first_line_length(const char *data, size_t size) {
+    const char *newline = (const char *)memchr(data, '\n', size);
+    size_t len = newline ? (size_t)(newline - data) : size;
+    if (len > 0 && data[len - 1] == '\r') {
+        len--;
+    }
+    return len;
+}
+
+// Append `name` to a column list, quoted as an identifier
+int append_column_name(Batch *list, const char *name, size_t len) {
+    if (batch_reserve(list, len * 2 + 4) != 0) {
+        return -1;
+    }
+    char separator = list->len > 1 ? ',' : '(';
+    list->data[list->len++] = separator;
+    list->data[list->len++] = '`';
+    for (size_t i = 0; i < len; i++) {
+        if (name[i] == '`') {
+            list->data[list->len++] = '`';
+        }
+        list->data[list->len++] = name[i];
+    }
+    list->data[list->len++] = '`';
+    return 0;
+}
+
+// Turn a CSV or TSV header line into "(`a`,`b`,...)"
+char* header_column_list(const char *line, size_t len, char delimiter) {
+    Batch *list = batch_new(len * 2 + 16);
+    if (!list) {
+        return NULL;
+    }
+    list->data[list->len++] = ' ';
+    char *field = (char *)malloc(len + 1);
+    size_t pos = 0;
+    while (field && pos <= len) {
+        size_t field_len = 0;
+        if (delimiter == ',' && pos < len && line[pos] == '"') {
+            for (pos++; pos < len; pos++) {
+                if (line[pos] == '"') {
+                    if (pos + 1 < len && line[pos + 1] == '"') {
+                        pos++;
+                    } else {
+                        pos++;
+                        break;
+                    }
+                }
+                field[field_len++] = line[pos];
+            }
+        }
+        while (pos < len && line[pos] != delimiter) {
+            field[field_len++] = line[pos++];
+        }
+        if (append_column_name(list, field, field_len) != 0) {
+            break;
+        }
+        pos++;
+    }
+    char *columns = NULL;
+    if (field && pos > len && batch_reserve(list, 2) == 0) {
+        list->data[list->len++] = ')';
+        list->data[list->len] = '\0';
+        columns = list->data;
+        list->data = NULL;
+    }
+    free(field);
+    batch_free(list);
+    return columns;
+}
+
+// Write one NDJSON value in LOAD DATA text format
+int append_json_field(Batch *batch, const cJSON *item, char terminator) {
+    char number[64];
+    if (!item || cJSON_IsNull(item)) {
+        return append_load_data_field(batch, NULL, 0, terminator);
+    }
+    if (cJSON_IsString(item)) {
+        return append_load_data_field(batch, item->valuestring, strlen(item->valuestring), terminator);
+    }
+    if (cJSON_IsBool(item)) {
+        return append_load_data_field(batch, cJSON_IsTrue(item) ? "1" : "0", 1, terminator);
+    }
+    if (cJSON_IsNumber(item)) {
+        double value = item->valuedouble;
+        if (value == (double)(long long)value && value > -9007199254740992.0 && value < 9007199254740992.0) {
+            snprintf(number, sizeof(number), "%lld", (long long)value);
+        } else {
+            snprintf(number, sizeof(number), "%.17g", value);
+        }
+        return append_load_data_field(batch, number, strlen(number), terminator);
+    }
+    char *text = cJSON_PrintUnformatted(item);
+    if (!text) {
+        return -1;
+    }
+    int status = append_load_data_field(batch, text, strlen(text), terminator);
+    cJSON_free(text);
+    return status;
+}
+
+// Convert an NDJSON chunk into LOAD DATA text rows for the job's columns
+Batch* ndjson_chunk_to_load_data(const ImportJob *job, const ImportChunk *chunk) {
+    Batch *batch = batch_new(chunk->len + chunk->len / 4 + 64);
+    if (!batch) {
+        fprintf(stderr, "Memory allocation for batch failed\n");
+        return NULL;
+    }
+    const char *line = job->data + chunk->offset;
+    const char *end = line + chunk->len;
+    while (line < end) {
+        const char *newline = (const char *)memchr(line, '\n', end - line);
+        size_t len = newline ? (size_t)(newline - line) : (size_t)(end - line);
+        const char *next = line + len + 1;
+        while (len > 0 && (line[len - 1] == '\r' || line[len - 1] == ' ')) {
+            len--;
+        }
+        if (len > 0) {
+            cJSON *object = cJSON_ParseWithLength(line, len);
+            if (!cJSON_IsObject(object)) {
+                fprintf(stderr, "Invalid NDJSON record at byte %zu\n", (size_t)(line - job->data));
+                cJSON_Delete(object);
+                batch_free(batch);
+                return NULL;
+            }
+            for (int i = 0; i < job->columns_count; i++) {
+                char terminator = (i + 1 == job->columns_count) ? '\n' : '\t';
+                cJSON *item = cJSON_GetObjectItemCaseSensitive(object, job->columns[i]);
+                if (append_json_field(batch, item, terminator) != 0) {
+                    cJSON_Delete(object);
+                    batch_free(batch);
+                    return NULL;
+                }
+            }
+            batch->rows++;
+            cJSON_Delete(object);
+        }
+        line = next;
+    }
+    return batch;
+}
+
+// NDJSON has no header; the keys of the first record define the columns
+int ndjson_columns(ImportJob *job, size_t header_len, Batch *column_list) {
+    cJSON *object = cJSON_ParseWithLength(job->data, header_len);
+    if (!cJSON_IsObject(object)) {
+        fprintf(stderr, "The first NDJSON record is not an object\n");
+        cJSON_Delete(object);
+        return -1;
+    }
+    int count = 0;
+    cJSON *item = NULL;
+    cJSON_ArrayForEach(item, object) {
+        count++;
+    }
+    job->columns = (char **)calloc(count > 0 ? count : 1, sizeof(char *));
+    column_list->data[column_list->len++] = ' ';
+    int status = job->columns ? 0 : -1;
+    cJSON_ArrayForEach(item, object) {
+        if (status != 0) {
+            break;
+        }
+        job->columns[job->columns_count] = strdup(item->string);
+        if (!job->columns[job->columns_count] ||
+            append_column_name(column_list, item->string, strlen(item->string)) != 0) {
+            status = -1;
+            break;
+        }
+        job->columns_count++;
+    }
+    if (status == 0 && (count == 0 || batch_reserve(column_list, 2) != 0)) {
+        status = -1;
+    }
+    if (status == 0) {
+        column_list->data[column_list->len++] = ')';
+        column_list->data[column_list->len] = '\0';
+    }
+    cJSON_Delete(object);
+    return status;
+}
+
+int import_infile_init(void **ptr, const char *filename, void *userdata) {
+    (void)filename;
+    ImportStream *stream = (ImportStream *)userdata;
+    stream->offset = 0;
+    *ptr = stream;
+    return 0;
+}
+
+int import_infile_read(void *ptr, char *buf, unsigned int buf_len) {
+    ImportStream *stream = (ImportStream *)ptr;
+    size_t n = stream->len - stream->offset;
+    if (n > buf_len) {
+        n = buf_len;
+    }
+    memcpy(buf, stream->data + stream->offset, n);
+    stream->offset += n;
+    return (int)n;
+}
+
+void import_infile_end(void *ptr) {
+    (void)ptr;
+}
+
+int import_infile_error(void *ptr, char *error_msg, unsigned int error_msg_len) {
+    (void)ptr;
+    snprintf(error_msg, error_msg_len, "rgwml_cli import stream failed");
+    return CR_UNKNOWN_ERROR;
+}
+
+// Wait for the scanner to publish the next chunk. Returns 0 when all chunks
+// have been handed out.
+int import_next_chunk(ImportJob *job, ImportChunk *chunk, size_t *index) {
+    pthread_mutex_lock(&job->lock);
+    while (job->next_chunk == job->chunks_count && !job->scan_done) {
+        pthread_cond_wait(&job->chunk_ready, &job->lock);
+    }
+    int found = job->next_chunk < job->chunks_count;
+    if (found) {
+        *index = job->next_chunk;
+        *chunk = job->chunks[job->next_chunk++];
+    }
+    pthread_mutex_unlock(&job->lock);
+    return found;
+}
+
+int import_publish_chunk(ImportJob *job, size_t offset, size_t len) {
+    pthread_mutex_lock(&job->lock);
+    if (job->chunks_count == job->chunks_cap) {
+        size_t cap = job->chunks_cap ? job->chunks_cap * 2 : 64;
+        ImportChunk *chunks = (ImportChunk *)realloc(job->chunks, cap * sizeof(ImportChunk));
+        if (!chunks) {
+            pthread_mutex_unlock(&job->lock);
+            fprintf(stderr, "Memory allocation for chunk list failed\n");
+            return -1;
+        }
+        job->chunks = chunks;
+        job->chunks_cap = cap;
+    }
+    job->chunks[job->chunks_count++] = (ImportChunk){offset, len};
+    pthread_cond_signal(&job->chunk_ready);
+    pthread_mutex_unlock(&job->lock);
+    return 0;
+}
+
+void import_finish_scan(ImportJob *job) {
+    pthread_mutex_lock(&job->lock);
+    job->scan_done = 1;
+    pthread_cond_broadcast(&job->chunk_ready);
+    pthread_mutex_unlock(&job->lock);
+}
+
+void* import_worker_main(void *arg) {
+    ImportJob *job = (ImportJob *)arg;
+    ImportStream stream;
+    ImportChunk chunk;
+    size_t index;
+    MYSQL *conn = NULL;
+    mysql_thread_init();
+    trace_thread_name("import worker");
+
+    while (import_next_chunk(job, &chunk, &index)) {
+        Batch *converted = NULL;
+        if (job->format == IMPORT_NDJSON) {
+            double started = trace_begin();
+            converted = ndjson_chunk_to_load_data(job, &chunk);
+            trace_span("convert ndjson", started, "bytes", (long long)chunk.len);
+            if (!converted) {
+                pthread_mutex_lock(&job->lock);
+                job->chunks_failed++;
+                pthread_mutex_unlock(&job->lock);
+                fprintf(stderr, "Chunk %zu (bytes %zu-%zu) could not be converted\n", index, chunk.offset, chunk.offset + chunk.len);
+                continue;
+            }
+            stream.data = converted->data;
+            stream.len = converted->len;
+        } else {
+            stream.data = job->data + chunk.offset;
+            stream.len = chunk.len;
+        }
+
+        int loaded = 0;
+        for (unsigned long long attempt = 0; !loaded; attempt++) {
+            unsigned int error = CR_SERVER_GONE_ERROR;
+            if (!conn && (conn = connect_db(job->db, CONNECT_LOCAL_INFILE))) {
+                mysql_set_local_infile_handler(conn, import_infile_init, import_infile_read, import_infile_end, import_infile_error, &stream);
+            }
+            if (conn) {
+                double started = trace_begin();
+                int failed = mysql_query(conn, job->statement);
+                trace_span("LOAD DATA", started, "bytes", (long long)stream.len);
+                if (!failed) {
+                    pthread_mutex_lock(&job->lock);
+                    job->rows_loaded += mysql_affected_rows(conn);
+                    job->warnings += mysql_warning_count(conn);
+                    pthread_mutex_unlock(&job->lock);
+                    loaded = 1;
+                    break;
+                }
+                error = mysql_errno(conn);
+                fprintf(stderr, "Chunk %zu (bytes %zu-%zu) attempt %llu failed: %s\n",
+                        index, chunk.offset, chunk.offset + chunk.len, attempt + 1, mysql_error(conn));
+            }
+            if (attempt >= job->retries || !is_retryable_error(error)) {
+                break;
+            }
+            if (error == CR_SERVER_GONE_ERROR || error == CR_SERVER_LOST) {
+                mysql_close(conn);
+                conn = NULL;
+            }
+            sleep_ms(200UL << (attempt < 6 ? attempt : 6));
+        }
+        if (!loaded) {
+            pthread_mutex_lock(&job->lock);
+            job->chunks_failed++;
+            pthread_mutex_unlock(&job->lock);
+            fprintf(stderr, "Chunk %zu (bytes %zu-%zu) was not imported\n", index, chunk.offset, chunk.offset + chunk.len);
+        }
+        batch_free(converted);
+    }
+
+    if (conn) {
+        mysql_close(conn);
+    }
+    mysql_thread_end();
+    return NULL;
+}
+
+int import_file(const DbPreset *db, const char *path, const char *table, ImportFormat format, int header,
+                int workers_count, size_t batch_bytes, unsigned long long retries) {
+    double started = now_seconds();
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open file %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        fprintf(stderr, "Nothing to import from %s\n", path);
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    const char *data = (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Could not map %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+
+    ImportJob job;
+    memset(&job, 0, sizeof(job));
+    job.db = db;
+    job.data = data;
+    job.size = size;
+    job.format = format;
+    job.retries = retries;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.chunk_ready, NULL);
+
+    size_t header_len = first_line_length(data, size);
+    int crlf = header_len < size && data[header_len] == '\r';
+    size_t start = 0;
+    char *columns = NULL;
+    Batch *column_list = NULL;
+    if (format == IMPORT_NDJSON) {
+        column_list = batch_new(256);
+        if (!column_list || ndjson_columns(&job, header_len, column_list) != 0) {
+            fprintf(stderr, "Could not determine NDJSON columns\n");
+        } else {
+            columns = column_list->data;
+        }
+    } else if (header) {
+        columns = header_column_list(data, header_len, format == IMPORT_CSV ? ',' : '\t');
+        start = scan_line_boundary(data, size, 0);
+        if (!columns) {
+            fprintf(stderr, "Could not parse header line\n");
+        }
+    }
+
+    char *statement = NULL;
+    if (columns || (format != IMPORT_NDJSON && !header)) {
+        char format_clause[160];
+        if (format == IMPORT_CSV) {
+            snprintf(format_clause, sizeof(format_clause),
+                     "FIELDS TERMINATED BY ',' OPTIONALLY ENCLOSED BY '\"' ESCAPED BY '' LINES TERMINATED BY '%s'",
+                     crlf ? "\\r\\n" : "\\n");
+        } else if (format == IMPORT_TSV) {
+            snprintf(format_clause, sizeof(format_clause),
+                     "FIELDS TERMINATED BY '\\t' ESCAPED BY '\\\\' LINES TERMINATED BY '%s'", crlf ? "\\r\\n" : "\\n");
+        } else {
+            snprintf(format_clause, sizeof(format_clause), "%s", LOAD_DATA_TEXT_FORMAT);
+        }
+        statement = build_load_data_statement(table, format_clause, columns ? columns : "");
+    }
+    job.statement = statement;
+
+    pthread_t *threads = (pthread_t *)calloc(workers_count, sizeof(pthread_t));
+    int started_workers = 0;
+    for (int i = 0; statement && threads && i < workers_count; i++) {
+        if (pthread_create(&threads[i], NULL, import_worker_main, &job) != 0) {
+            fprintf(stderr, "Could not start import worker %d\n", i);
+            break;
+        }
+        started_workers++;
+    }
+
+    // Publish chunks as they are found so loading starts right away
+    int status = started_workers > 0 ? 0 : -1;
+    int in_quotes = 0;
+    size_t scanned = start;
+    while (status == 0 && start < size) {
+        size_t target = start + batch_bytes < size ? start + batch_bytes : size;
+        size_t end = (format == IMPORT_CSV)
+            ? scan_csv_boundary(data, size, scanned, target, &in_quotes)
+            : scan_line_boundary(data, size, target);
+        scanned = end;
+        if (import_publish_chunk(&job, start, end - start) != 0) {
+            status = -1;
+        }
+        start = end;
+    }
+    import_finish_scan(&job);
+
+    for (int i = 0; i < started_workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    if (job.chunks_failed > 0) {
+        status = -1;
+    }
+
+    double elapsed = now_seconds() - started;
+    if (started_workers > 0) {
+        printf("Imported %llu rows into %s.%s in %zu chunks (%zu failed, %llu warnings) in %.2fs (%.1f MB/s)\n",
+               job.rows_loaded, db->name, table, job.chunks_count, job.chunks_failed, job.warnings, elapsed,
+               elapsed > 0 ? size / elapsed / (1024 * 1024) : 0.0);
+    }
+
+    for (int i = 0; i < job.columns_count; i++) {
+        free(job.columns[i]);
+    }
+    free(job.columns);
+    free(job.chunks);
+    free(threads);
+    free(statement);
+    if (column_list) {
+        batch_free(column_list);
+    } else {
+        free(columns);
+    }
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.chunk_ready);
+    munmap((void *)data, size);
+    return status;
+}
+
+int run_import(int argc, char *argv[], const char *program) {
+    unsigned long long workers_count = IMPORT_DEFAULT_WORKERS;
+    unsigned long long batch_mb = IMPORT_DEFAULT_BATCH_MB;
+    unsigned long long retries = IMPORT_DEFAULT_RETRIES;
+    const char *format_name = NULL;
+    int header = 1;
+    const char *positional[3];
+    int positional_count = 0;
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            format_name = argv[++i];
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            if (parse_count_option(argv[i], argv[i + 1], &workers_count) != 0) return EXIT_FAILURE;
+            i++;
+        } else if (strcmp(argv[i], "--batch-size") == 0 && i + 1 < argc) {
+            if (parse_count_option(argv[i], argv[i + 1], &batch_mb) != 0) return EXIT_FAILURE;
+            i++;
+        } else if (strcmp(argv[i], "--retries") == 0 && i + 1 < argc) {
+            char *end = NULL;
+            retries = strtoull(argv[i + 1], &end, 10);
+            if (*end != '\0') {
+                fprintf(stderr, "--retries expects a number\n");
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--no-header") == 0) {
+            header = 0;
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            if (parse_trace_option(argc, argv, &i) < 0) return EXIT_FAILURE;
+        } else if (positional_count < 3 && strncmp(argv[i], "--", 2) != 0) {
+            positional[positional_count++] = argv[i];
+        } else {
+            positional_count = -1;
+            break;
+        }
+    }
+    if (positional_count != 3 || workers_count > 64) {
+        fprintf(stderr, "Usage: %s import [--format csv|tsv|ndjson] [--workers N] [--batch-size MB] [--retries N] [--no-header] [--trace out.json] <preset> <file> <table>\n", program);
+        return EXIT_FAILURE;
+    }
+
+    // Default the format from the file extension
+    if (!format_name) {
+        const char *dot = strrchr(positional[1], '.');
+        format_name = dot ? dot + 1 : "csv";
+    }
+    ImportFormat format;
+    if (strcmp(format_name, "csv") == 0) {
+        format = IMPORT_CSV;
+    } else if (strcmp(format_name, "tsv") == 0) {
+        format = IMPORT_TSV;
+    } else if (strcmp(format_name, "ndjson") == 0 || strcmp(format_name, "jsonl") == 0) {
+        format = IMPORT_NDJSON;
+    } else {
+        fprintf(stderr, "Unsupported import format: %s\n", format_name);
+        return EXIT_FAILURE;
+    }
+
+    cJSON *config_json = load_config(CONFIG_PATH);
+    if (!config_json) {
+        return EXIT_FAILURE;
+    }
+    DbPreset db;
+    int status = EXIT_FAILURE;
+    if (load_db_preset(config_json, positional[0], &db) == 0 &&
+        import_file(&db, positional[1], positional[2], format, header, (int)workers_count,
+                    (size_t)batch_mb * 1024 * 1024, retries) == 0) {
+        status = EXIT_SUCCESS;
+    }
+    cJSON_Delete(config_json);
+    return status;
+}
+
+// ---- Chunked DML ----
+// A large UPDATE or DELETE is split into statements that each cover a bounded
+// range of the table's primary key. Range ends are found with keyset probes
+// (first key > lo, skipping chunk_size - 1 keys), so every statement touches
+// about chunk_size index entries and holds its locks only briefly. The probe
+// is strictly past lo, so a --key column with duplicates still advances; a
+// chunk then also takes every other row sharing lo. The chunk size follows
+// the observed statement latency towards --target-ms.
+
+#define DML_DEFAULT_CHUNK_SIZE 1000
+#define DML_DEFAULT_SLEEP_MS 50
+#define DML_DEFAULT_TARGET_MS 500
+#define DML_MAX_CHUNK_SIZE 1000000
+#define DML_MAX_RETRIES 5
+
+typedef struct {
+    char *table;     // Table reference as written in the statement
+    char *head;      // Statement up to, excluding, the WHERE clause
+    char *condition; // Original WHERE condition, NULL when there is none
+} DmlStatement;
+
+void free_dml_statement(DmlStatement *dml) {
+    free(dml->table);
+    free(dml->head);
+    free(dml->condition);
+    memset(dml, 0, sizeof(*dml));
+}
+
+// Accept single-table "DELETE FROM t [WHERE ...]" and "UPDATE t SET ... [WHERE ...]"
+int parse_dml_statement(const char *sql, DmlStatement *dml) {
+    memset(dml, 0, sizeof(*dml));
+    const char *p = skip_space(sql);
+    const char *end = p + strlen(p);
+    while (end > p && (isspace((unsigned char)end[-1]) || end[-1] == ';')) {
+        end--;
+    }
+    int is_delete = match_keyword(p, "DELETE");
+    if (!is_delete && !match_keyword(p, "UPDATE")) {
+        fprintf(stderr, "--chunked-dml supports only UPDATE and DELETE statements\n");
+        return -1;
+    }
+    p = skip_space(p + 6);
+    for (;;) {
+        if (match_keyword(p, "LOW_PRIORITY")) {
+            p = skip_space(p + 12);
+        } else if (match_keyword(p, "IGNORE")) {
+            p = skip_space(p + 6);
+        } else if (is_delete && match_keyword(p, "QUICK")) {
+            p = skip_space(p + 5);
+        } else {
+            break;
+        }
+    }
+    if (is_delete) {
+        if (!match_keyword(p, "FROM")) {
+            fprintf(stderr, "Multi-table DELETE is not supported with --chunked-dml\n");
+            return -1;
+        }
+        p = skip_space(p + 4);
+    }
+    const char *table_start = p;
+    const char *table_end = skip_identifier(p);
+    if (!table_end) {
+        fprintf(stderr, "Could not find the table name in the statement\n");
+        return -1;
+    }
+    p = skip_space(table_end);
+    if (find_top_level_keyword(p, "ORDER") || find_top_level_keyword(p, "LIMIT")) {
+        fprintf(stderr, "ORDER BY and LIMIT cannot be combined with --chunked-dml\n");
+        return -1;
+    }
+    if (is_delete ? (p < end && !match_keyword(p, "WHERE")) : !match_keyword(p, "SET")) {
+        fprintf(stderr, "Only single-table statements without aliases are supported with --chunked-dml\n");
+        return -1;
+    }
+
+    const char *where = find_top_level_keyword(p, "WHERE");
+    if (where && where >= end) {
+        where = NULL;
+    }
+    dml->table = strndup(table_start, table_end - table_start);
+    dml->head = strndup(sql, (where ? where : end) - sql);
+    if (where) {
+        dml->condition = strndup(where + 5, end - (where + 5));
+    }
+    if (!dml->table || !dml->head || (where && !dml->condition)) {
+        fprintf(stderr, "Memory allocation for statement failed\n");
+        free_dml_statement(dml);
+        return -1;
+    }
+    return 0;
+}
+
+// Name of the single-column primary key of `table`
+char* primary_key_column(MYSQL *conn, const char *table) {
+    char *sql = format_string("SHOW KEYS FROM %s WHERE Key_name = 'PRIMARY'", table);
+    if (!sql) {
+        return NULL;
+    }
+    int failed = mysql_query(conn, sql);
+    free(sql);
+    MYSQL_RES *res = failed ? NULL : mysql_store_result(conn);
+    if (!res) {
+        fprintf(stderr, "Could not read the primary key of %s: %s\n", table, mysql_error(conn));
+        return NULL;
+    }
+    char *key = NULL;
+    MYSQL_ROW row = mysql_fetch_row(res);
+    if (mysql_num_rows(res) == 1 && mysql_num_fields(res) > 4 && row[4]) {
+        key = strdup(row[4]);
+    } else {
+        fprintf(stderr, "%s needs a single-column primary key; pass --key <column>\n", table);
+    }
+    mysql_free_result(res);
+    return key;
+}
+
+// A fetched value as an SQL literal: numbers verbatim, everything else quoted
+char* sql_literal(MYSQL *conn, const char *value, unsigned long len, int numeric) {
+    if (numeric) {
+        return strndup(value, len);
+    }
+    char *literal = (char *)malloc(len * 2 + 3);
+    if (literal) {
+        literal[0] = '\'';
+        unsigned long n = mysql_real_escape_string(conn, literal + 1, value, len);
+        literal[n + 1] = '\'';
+        literal[n + 2] = '\0';
+    }
+    return literal;
+}
+
+// SELECT for the page after `after` (all of the start when NULL) in key order
+char* keyset_page_sql(const char *table, const char *predicate, const char *quoted_key, const char *after,
+                      unsigned long long limit, const char *suffix) {
+    if (predicate && after) {
+        return format_string("SELECT * FROM %s WHERE (%s) AND %s > %s ORDER BY %s LIMIT %llu%s",
+                             table, predicate, quoted_key, after, quoted_key, limit, suffix);
+    }
+    if (predicate) {
+        return format_string("SELECT * FROM %s WHERE (%s) ORDER BY %s LIMIT %llu%s",
+                             table, predicate, quoted_key, limit, suffix);
+    }
+    if (after) {
+        return format_string("SELECT * FROM %s WHERE %s > %s ORDER BY %s LIMIT %llu%s",
+                             table, quoted_key, after, quoted_key, limit, suffix);
+    }
+    return format_string("SELECT * FROM %s ORDER BY %s LIMIT %llu%s", table, quoted_key, limit, suffix);
+}
+
+// Run a single-value key probe. Returns 1 and an SQL literal in *literal when
+// a row was found, 0 when there is none and -1 on error.
+int fetch_key_literal(MYSQL *conn, const char *sql, char **literal) {
+    *literal = NULL;
+    if (mysql_query(conn, sql)) {
+        fprintf(stderr, "Key probe failed: %s\n", mysql_error(conn));
+        return -1;
+    }
+    MYSQL_RES *res = mysql_store_result(conn);
+    if (!res) {
+        fprintf(stderr, "Key probe failed: %s\n", mysql_error(conn));
+        return -1;
+    }
+    int found = 0;
+    MYSQL_ROW row = mysql_fetch_row(res);
+    if (row && row[0]) {
+        *literal = sql_literal(conn, row[0], mysql_fetch_lengths(res)[0], mysql_fetch_fields(res)[0].flags & NUM_FLAG);
+        found = *literal ? 1 : -1;
+    }
+    mysql_free_result(res);
+    return found;
+}
+
+// *profile gets the connect time and the time spent in the chunk statements,
+// and *rows_affected their total
+int run_chunked_dml(const DbPreset *db, const char *statement, unsigned long long chunk_size,
+                    unsigned long long pause_ms, unsigned long long target_ms, const char *key_column, Throttle *throttle,
+                    QueryProfile *profile, unsigned long long *rows_affected) {
+    memset(profile, 0, sizeof(*profile));
+    *rows_affected = 0;
+    DmlStatement dml;
+    if (parse_dml_statement(statement, &dml) != 0) {
+        return -1;
+    }
+    double connect_started = now_seconds();
+    MYSQL *conn = connect_db(db, 0);
+    if (!conn) {
+        free_dml_statement(&dml);
+        return -1;
+    }
+    profile->connect_seconds = now_seconds() - connect_started;
+
+    int status = -1;
+    char *key = key_column ? strdup(key_column) : primary_key_column(conn, dml.table);
+    char *quoted_key = key ? quote_identifier(key) : NULL;
+    char *lo = NULL;
+    char *hi = NULL;
+    char *sql = quoted_key ? format_string("SELECT %s FROM %s ORDER BY %s LIMIT 1", quoted_key, dml.table, quoted_key) : NULL;
+    int found = sql ? fetch_key_literal(conn, sql, &lo) : -1;
+    free(sql);
+    if (found == 0) {
+        printf("%s is empty, nothing to do\n", dml.table);
+        status = 0;
+    }
+
+    double started = now_seconds();
+    unsigned long long chunks = 0;
+    unsigned long long total_affected = 0;
+    while (found == 1) {
+        sql = format_string("SELECT %s FROM %s WHERE %s > %s ORDER BY %s LIMIT 1 OFFSET %llu",
+                            quoted_key, dml.table, quoted_key, lo, quoted_key, chunk_size - 1);
+        found = sql ? fetch_key_literal(conn, sql, &hi) : -1;
+        free(sql);
+        if (found < 0) {
+            break;
+        }
+
+        // The last chunk is open-ended so rows inserted past the end are covered
+        const char *joiner = dml.condition ? " AND " : "";
+        if (hi) {
+            sql = format_string("%s WHERE %s%s%s%s%s >= %s AND %s < %s", dml.head,
+                                dml.condition ? "(" : "", dml.condition ? dml.condition : "", dml.condition ? ")" : "",
+                                joiner, quoted_key, lo, quoted_key, hi);
+        } else {
+            sql = format_string("%s WHERE %s%s%s%s%s >= %s", dml.head,
+                                dml.condition ? "(" : "", dml.condition ? dml.condition : "", dml.condition ? ")" : "",
+                                joiner, quoted_key, lo);
+        }
+        if (!sql) {
+            found = -1;
+            break;
+        }
+
+        // Deadlocks and lock wait timeouts roll the chunk back, so it is safe
+        // to run it again. A lost connection is not retried: the chunk may
+        // have committed and UPDATEs are not necessarily idempotent.
+        double chunk_started = now_seconds();
+        int failed = 0;
+        for (int attempt = 0; (failed = mysql_query(conn, sql)) != 0; attempt++) {
+            unsigned int error = mysql_errno(conn);
+            if (attempt >= DML_MAX_RETRIES || (error != ER_LOCK_DEADLOCK && error != ER_LOCK_WAIT_TIMEOUT)) {
+                break;
+            }
+            fprintf(stderr, "Chunk %llu: %s, retrying\n", chunks + 1, mysql_error(conn));
+            sleep_ms(100UL << attempt);
+        }
+        free(sql);
+        if (failed) {
+            fprintf(stderr, "Chunk %llu starting at %s failed: %s\n", chunks + 1, lo, mysql_error(conn));
+            found = -1;
+            break;
+        }
+        double elapsed_ms = (now_seconds() - chunk_started) * 1000.0;
+        profile->execute_seconds += elapsed_ms / 1000.0;
+        unsigned long long affected = mysql_affected_rows(conn);
+        total_affected += affected;
+        *rows_affected = total_affected;
+        chunks++;
+        printf("Chunk %llu: %s >= %s%s%s, %llu rows affected in %.0f ms (total %llu)\n",
+               chunks, key, lo, hi ? ", < " : "", hi ? hi : "", affected, elapsed_ms, total_affected);
+        fflush(stdout);
+
+        free(lo);
+        lo = hi;
+        hi = NULL;
+        if (!lo) {
+            status = 0;
+            break;
+        }
+
+        // Steer the chunk size towards the target latency, at most 2x per step
+        double ratio = elapsed_ms > 0.0 ? (double)target_ms / elapsed_ms : 2.0;
+        if (ratio > 2.0) ratio = 2.0;
+        if (ratio < 0.5) ratio = 0.5;
+        chunk_size = (unsigned long long)(chunk_size * ratio);
+        if (chunk_size < 1) chunk_size = 1;
+        if (chunk_size > DML_MAX_CHUNK_SIZE) chunk_size = DML_MAX_CHUNK_SIZE;
+        if (pause_ms > 0) {
+            sleep_ms(pause_ms);
+        }
+        throttle_wait(throttle, affected, 0);
+    }
+
+    if (chunks > 0) {
+        printf("%llu rows affected in %llu chunks in %.2fs\n", total_affected, chunks, now_seconds() - started);
+    }
+    free(lo);
+    free(hi);
+    free(quoted_key);
+    free(key);
+    free_dml_statement(&dml);
+    mysql_close(conn);
+    return status;
+}
+
+// ---- io_uring file output ----
+// Output files are written through io_uring when the kernel allows it. The
+// stream fills one of URING_BUFFERS buffers and submits it as a write at its
+// own file offset, then goes on filling the next free buffer while the
+// kernel completes the I/O. It only waits when every buffer is in flight.
+// The buffers are registered with the ring (IORING_OP_WRITE_FIXED) when
+// RLIMIT_MEMLOCK allows it, and used as plain buffers otherwise. The stream
+// is a FILE from fopencookie(), so the sinks keep using fwrite. Without
+// io_uring (old kernel, seccomp, or no <linux/io_uring.h> at build time),
+// output_fopen() falls back to a plain stdio FILE.
+
+#define URING_BUFFERS 8
+#define URING_BUFFER_BYTES (256 * 1024)
+
+typedef struct UringFile UringFile;
+
+#ifdef RGWML_HAVE_IO_URING
+struct UringFile {
+    int fd;
+    int ring_fd;
+    int registered;
+    int failed;
+    struct io_uring_params params;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned char *buffers[URING_BUFFERS];
+    size_t fill[URING_BUFFERS];
+    size_t done[URING_BUFFERS]; // Bytes of the buffer's write already completed
+    unsigned long long buffer_offset[URING_BUFFERS];
+    int in_flight[URING_BUFFERS];
+    int in_flight_count;
+    int current; // Buffer being filled, or -1
+    unsigned long long offset; // File offset of the next byte written to the stream
+};
+
+void uring_free(UringFile *uring) {
+    if (uring->ring_fd >= 0) close(uring->ring_fd);
+    if (uring->sqes) munmap(uring->sqes, uring->params.sq_entries * sizeof(struct io_uring_sqe));
+    if (uring->cq_ring && uring->cq_ring != uring->sq_ring) munmap(uring->cq_ring, uring->cq_ring_size);
+    if (uring->sq_ring) munmap(uring->sq_ring, uring->sq_ring_size);
+    for (int i = 0; i < URING_BUFFERS; i++) {
+        free(uring->buffers[i]);
+    }
+    free(uring);
+}
+
+UringFile* uring_open(int fd, unsigned long long offset) {
+    UringFile *uring = (UringFile *)calloc(1, sizeof(UringFile));
+    if (!uring) {
+        return NULL;
+    }
+    uring->fd = fd;
+    uring->current = -1;
+    uring->offset = offset;
+    uring->ring_fd = (int)syscall(__NR_io_uring_setup, URING_BUFFERS, &uring->params);
+    if (uring->ring_fd < 0) {
+        free(uring);
+        return NULL;
+    }
+    struct io_uring_params *p = &uring->params;
+    uring->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    uring->cq_ring_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (uring->cq_ring_size > uring->sq_ring_size) uring->sq_ring_size = uring->cq_ring_size;
+        uring->cq_ring_size = uring->sq_ring_size;
+    }
+    uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          uring->ring_fd, IORING_OFF_SQ_RING);
+    if (uring->sq_ring == MAP_FAILED) {
+        uring->sq_ring = NULL;
+        uring_free(uring);
+        return NULL;
+    }
+    uring->cq_ring = (p->features & IORING_FEAT_SINGLE_MMAP) ? uring->sq_ring
+        : mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_CQ_RING);
+    uring->sqes = (struct io_uring_sqe *)mmap(NULL, p->sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                                              MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQES);
+    if (uring->cq_ring == MAP_FAILED || uring->sqes == MAP_FAILED) {
+        if (uring->cq_ring == MAP_FAILED) uring->cq_ring = NULL;
+        if (uring->sqes == MAP_FAILED) uring->sqes = NULL;
+        uring_free(uring);
+        return NULL;
+    }
+    unsigned char *sq = (unsigned char *)uring->sq_ring;
+    unsigned char *cq = (unsigned char *)uring->cq_ring;
+    uring->sq_tail = (unsigned *)(sq + p->sq_off.tail);
+    uring->sq_mask = (unsigned *)(sq + p->sq_off.ring_mask);
+    uring->sq_array = (unsigned *)(sq + p->sq_off.array);
+    uring->cq_head = (unsigned *)(cq + p->cq_off.head);
+    uring->cq_tail = (unsigned *)(cq + p->cq_off.tail);
+    uring->cq_mask = (unsigned *)(cq + p->cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+
+    struct iovec iov[URING_BUFFERS];
+    for (int i = 0; i < URING_BUFFERS; i++) {
+        if (posix_memalign((void **)&uring->buffers[i], 4096, URING_BUFFER_BYTES) != 0) {
+            uring->buffers[i] = NULL;
+            uring_free(uring);
+            return NULL;
+        }
+        iov[i].iov_base = uring->buffers[i];
+        iov[i].iov_len = URING_BUFFER_BYTES;
+    }
+    uring->registered = syscall(__NR_io_uring_register, uring->ring_fd, IORING_REGISTER_BUFFERS, iov, URING_BUFFERS) == 0;
+    // Unregistered buffers need IORING_OP_WRITE, which came with RW_CUR_POS in 5.6
+    if (!uring->registered && !(p->features & IORING_FEAT_RW_CUR_POS)) {
+        uring_free(uring);
+        return NULL;
+    }
+    return uring;
+}
+
+// Queues the rest of buffer `index` and tells the kernel about it
+int uring_submit(UringFile *uring, int index) {
+    unsigned tail = *uring->sq_tail;
+    unsigned slot = tail & *uring->sq_mask;
+    struct io_uring_sqe *sqe = &uring->sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = uring->registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = uring->fd;
+    sqe->off = uring->buffer_offset[index] + uring->done[index];
+    sqe->addr = (unsigned long)(uring->buffers[index] + uring->done[index]);
+    sqe->len = (unsigned)(uring->fill[index] - uring->done[index]);
+    sqe->buf_index = (unsigned short)index;
+    sqe->user_data = (unsigned long long)index;
+    uring->sq_array[slot] = slot;
+    __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    if (!uring->in_flight[index]) {
+        uring->in_flight[index] = 1;
+        uring->in_flight_count++;
+    }
+    while (syscall(__NR_io_uring_enter, uring->ring_fd, 1, 0, 0, NULL, 0) < 0) {
+        if (errno != EINTR && errno != EAGAIN) {
+            fprintf(stderr, "io_uring submit failed: %s\n", strerror(errno));
+            uring->failed = 1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Waits for at least one completion and handles all that are there. A
+// short write is resubmitted for the remaining bytes.
+int uring_reap(UringFile *uring) {
+    double started = trace_begin();
+    while (syscall(__NR_io_uring_enter, uring->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+        if (errno != EINTR) {
+            fprintf(stderr, "io_uring wait failed: %s\n", strerror(errno));
+            uring->failed = 1;
+            return -1;
+        }
+    }
+    trace_span("io_uring wait", started, NULL, 0);
+    unsigned head = *uring->cq_head;
+    unsigned tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &uring->cqes[head & *uring->cq_mask];
+        int index = (int)cqe->user_data;
+        if (cqe->res <= 0) {
+            fprintf(stderr, "Write failed: %s\n", cqe->res < 0 ? strerror(-cqe->res) : "no progress");
+            uring->failed = 1;
+        } else {
+            uring->done[index] += (size_t)cqe->res;
+        }
+        if (!uring->failed && uring->done[index] < uring->fill[index]) {
+            __atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+            if (uring_submit(uring, index) != 0) return -1;
+            continue;
+        }
+        uring->in_flight[index] = 0;
+        uring->in_flight_count--;
+    }
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+    return uring->failed ? -1 : 0;
+}
+
+int uring_submit_current(UringFile *uring) {
+    int index = uring->current;
+    uring->current = -1;
+    return index >= 0 && uring->fill[index] > 0 ? uring_submit(uring, index) : 0;
+}
+
+ssize_t uring_stream_write(void *cookie, const char *data, size_t len) {
+    UringFile *uring = (UringFile *)cookie;
+    size_t left = len;
+    while (left > 0 && !uring->failed) {
+        if (uring->current < 0) {
+            int index = -1;
+            while (index < 0) {
+                for (int i = 0; i < URING_BUFFERS && index < 0; i++) {
+                    if (!uring->in_flight[i]) index = i;
+                }
+                if (index < 0 && uring_reap(uring) != 0) {
+                    return -1;
+                }
+            }
+            uring->current = index;
+            uring->fill[index] = 0;
+            uring->done[index] = 0;
+            uring->buffer_offset[index] = uring->offset;
+        }
+        int index = uring->current;
+        size_t n = URING_BUFFER_BYTES - uring->fill[index];
+        if (n > left) n = left;
+        memcpy(uring->buffers[index] + uring->fill[index], data, n);
+        uring->fill[index] += n;
+        uring->offset += n;
+        data += n;
+        left -= n;
+        if (uring->fill[index] == URING_BUFFER_BYTES && uring_submit_current(uring) != 0) {
+            return -1;
+        }
+    }
+    return uring->failed ? -1 : (ssize_t)len;
+}
+
+// Submits what is buffered and waits until all of it is on its way to disk
+int uring_drain(UringFile *uring) {
+    if (uring_submit_current(uring) != 0) {
+        return -1;
+    }
+    while (uring->in_flight_count > 0) {
+        if (uring_reap(uring) != 0) {
+            return -1;
+        }
+    }
+    return uring->failed ? -1 : 0;
+}
+
+int uring_stream_close(void *cookie) {
+    UringFile *uring = (UringFile *)cookie;
+    int status = uring_drain(uring);
+    if (close(uring->fd) != 0) {
+        status = -1;
+    }
+    uring_free(uring);
+    return status;
+}
+#endif
+
+// Opens `path` for writing from the start or, with `append`, at its end.
+// *uring is set when the FILE runs on io_uring; output_sync() needs it. A
+// non-zero stdio_buffer asks for plain stdio with a buffer of that size, for
+// callers that keep many files open at once.
+FILE* output_fopen(const char *path, int append, size_t stdio_buffer, UringFile **uring) {
+    *uring = NULL;
+    if (stdio_buffer > 0) {
+        FILE *file = fopen(path, append ? "ab" : "wb");
+        if (file) {
+            setvbuf(file, NULL, _IOFBF, stdio_buffer);
+        }
+        return file;
+    }
+#ifdef RGWML_HAVE_IO_URING
+    int fd = open(path, O_WRONLY | O_CREAT | (append ? 0 : O_TRUNC), 0666);
+    if (fd < 0) {
+        return NULL;
+    }
+    off_t end = append ? lseek(fd, 0, SEEK_END) : 0;
+    UringFile *handle = end >= 0 ? uring_open(fd, (unsigned long long)end) : NULL;
+    if (handle) {
+        cookie_io_functions_t io = {NULL, uring_stream_write, NULL, uring_stream_close};
+        FILE *file = fopencookie(handle, "w", io);
+        if (file) {
+            setvbuf(file, NULL, _IONBF, 0); // The stream buffers in its own fixed buffers
+            *uring = handle;
+            return file;
+        }
+        uring_free(handle);
+    }
+    close(fd);
+#endif
+    return fopen(path, append ? "ab" : "wb");
+}
+
+// Makes everything written so far durable and reports the file size
+int output_sync(FILE *file, UringFile *uring, long long *offset) {
+    int failed = fflush(file) != 0;
+#ifdef RGWML_HAVE_IO_URING
+    if (uring) {
+        if (failed || uring_drain(uring) != 0 || fsync(uring->fd) != 0) {
+            fprintf(stderr, "Could not sync output: %s\n", strerror(errno));
+            return -1;
+        }
+        *offset = (long long)uring->offset;
+        return 0;
+    }
+#else
+    (void)uring;
+#endif
+    if (failed || fsync(fileno(file)) != 0) {
+        fprintf(stderr, "Could not sync output: %s\n", strerror(errno));
+        return -1;
+    }
+    *offset = ftello(file);
+    return 0;
+}
+
+// ---- RGWC columnar files ----
+// Layout, all integers little endian:
+//   file header  "RGWC" u32 version, u32 column count, then per column
+//                u16 name length, name bytes, u8 MySQL field type
+//   row group    "RGRP" u32 row count, then per column
+//                u8 codec (0 raw, 1 zlib), u64 raw length, u64 stored length, stored bytes
+//   column chunk null bitmap (bit i set = row i is NULL, ceil(rows / 8) bytes),
+//                u32 value length per row, then the values back to back
+// Row groups are self-delimiting, so a file can be cut after any complete
+// group and appended to later.
+
+#define RGWC_VERSION 1
+#define RGWC_CODEC_RAW 0
+#define RGWC_CODEC_ZLIB 1
+
+typedef struct {
+    Batch *nulls;
+    Batch *lengths;
+    Batch *values;
+} ColumnBuffer;
+
+typedef struct {
+    FILE *file;
+    UringFile *uring; // Set while file runs on io_uring
+    unsigned int cols_count;
+    ColumnBuffer *columns;
+    size_t rows_in_group;
+    unsigned char *scratch;
+    size_t scratch_cap;
+    unsigned long long rows_written;
+    unsigned long long bytes_written; // Header and flushed row groups
+    size_t group_bytes;               // Raw size of the buffered rows
+} ColumnarWriter;
+
+void put_u16(unsigned char *p, uint16_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+}
+
+void put_u32(unsigned char *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = (unsigned char)(v >> (8 * i));
+    }
+}
+
+void put_u64(unsigned char *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = (unsigned char)(v >> (8 * i));
+    }
+}
+
+void columnar_free(ColumnarWriter *writer) {
+    if (!writer) return;
+    for (unsigned int i = 0; writer->columns && i < writer->cols_count; i++) {
+        batch_free(writer->columns[i].nulls);
+        batch_free(writer->columns[i].lengths);
+        batch_free(writer->columns[i].values);
+    }
+    if (writer->file) {
+        fclose(writer->file);
+    }
+    free(writer->columns);
+    free(writer->scratch);
+    free(writer);
+}
+
+ColumnarWriter* columnar_new(unsigned int cols_count) {
+    ColumnarWriter *writer = (ColumnarWriter *)calloc(1, sizeof(ColumnarWriter));
+    if (!writer || !(writer->columns = (ColumnBuffer *)calloc(cols_count, sizeof(ColumnBuffer)))) {
+        fprintf(stderr, "Memory allocation for columnar writer failed\n");
+        free(writer);
+        return NULL;
+    }
+    writer->cols_count = cols_count;
+    for (unsigned int i = 0; i < cols_count; i++) {
+        writer->columns[i].nulls = batch_new(1024);
+        writer->columns[i].lengths = batch_new(4096);
+        writer->columns[i].values = batch_new(65536);
+        if (!writer->columns[i].nulls || !writer->columns[i].lengths || !writer->columns[i].values) {
+            fprintf(stderr, "Memory allocation for columnar writer failed\n");
+            columnar_free(writer);
+            return NULL;
+        }
+    }
+    return writer;
+}
+
+int columnar_write_header(ColumnarWriter *writer, const MYSQL_FIELD *fields) {
+    unsigned char header[12];
+    memcpy(header, "RGWC", 4);
+    put_u32(header + 4, RGWC_VERSION);
+    put_u32(header + 8, writer->cols_count);
+    int ok = fwrite(header, 1, sizeof(header), writer->file) == sizeof(header);
+    writer->bytes_written = sizeof(header);
+    for (unsigned int i = 0; ok && i < writer->cols_count; i++) {
+        size_t name_len = strlen(fields[i].name);
+        unsigned char column[3];
+        put_u16(column, (uint16_t)name_len);
+        column[2] = (unsigned char)fields[i].type;
+        ok = fwrite(column, 1, 2, writer->file) == 2 &&
+             fwrite(fields[i].name, 1, name_len, writer->file) == name_len &&
+             fwrite(column + 2, 1, 1, writer->file) == 1;
+        writer->bytes_written += 3 + name_len;
+    }
+    return ok ? 0 : -1;
+}
+
+// Start a new file, or continue an existing one after cutting it back to
+// resume_offset (which must be a row group boundary) when that is non-zero.
+// stdio_buffer is as for output_fopen().
+ColumnarWriter* columnar_open(const char *path, const MYSQL_FIELD *fields, unsigned int cols_count, long long resume_offset,
+                              size_t stdio_buffer) {
+    ColumnarWriter *writer = columnar_new(cols_count);
+    if (!writer) {
+        return NULL;
+    }
+    if (resume_offset > 0) {
+        if (truncate(path, resume_offset) != 0 || !(writer->file = output_fopen(path, 1, stdio_buffer, &writer->uring))) {
+            fprintf(stderr, "Could not reopen %s at offset %lld: %s\n", path, resume_offset, strerror(errno));
+            columnar_free(writer);
+            return NULL;
+        }
+        return writer;
+    }
+
+    writer->file = output_fopen(path, 0, stdio_buffer, &writer->uring);
+    if (!writer->file) {
+        fprintf(stderr, "Could not create %s: %s\n", path, strerror(errno));
+        columnar_free(writer);
+        return NULL;
+    }
+    if (columnar_write_header(writer, fields) != 0) {
+        fprintf(stderr, "Could not write header of %s\n", path);
+        columnar_free(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+// An RGWC stream on an already open FILE, which the writer takes over
+ColumnarWriter* columnar_open_stream(FILE *file, const MYSQL_FIELD *fields, unsigned int cols_count) {
+    ColumnarWriter *writer = columnar_new(cols_count);
+    if (!writer) {
+        fclose(file);
+        return NULL;
+    }
+    writer->file = file;
+    if (columnar_write_header(writer, fields) != 0) {
+        fprintf(stderr, "Could not write RGWC stream header\n");
+        columnar_free(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+int columnar_append_row(ColumnarWriter *writer, MYSQL_ROW row, const unsigned long *lengths) {
+    size_t index = writer->rows_in_group;
+    for (unsigned int i = 0; i < writer->cols_count; i++) {
+        ColumnBuffer *column = &writer->columns[i];
+        unsigned long len = row[i] ? lengths[i] : 0;
+        if (batch_reserve(column->nulls, 1) != 0 || batch_reserve(column->lengths, 4) != 0 ||
+            batch_reserve(column->values, len) != 0) {
+            return -1;
+        }
+        if (index % 8 == 0) {
+            column->nulls->data[column->nulls->len++] = 0;
+            writer->group_bytes++;
+        }
+        if (!row[i]) {
+            column->nulls->data[index / 8] |= (char)(1 << (index % 8));
+        }
+        put_u32((unsigned char *)column->lengths->data + column->lengths->len, (uint32_t)len);
+        column->lengths->len += 4;
+        memcpy(column->values->data + column->values->len, row[i] ? row[i] : "", len);
+        column->values->len += len;
+        writer->group_bytes += 4 + len;
+    }
+    writer->rows_in_group++;
+    return 0;
+}
+
+// Compress and write the buffered rows as one row group
+int columnar_flush_group(ColumnarWriter *writer) {
+    if (writer->rows_in_group == 0) {
+        return 0;
+    }
+    unsigned char group_header[8];
+    memcpy(group_header, "RGRP", 4);
+    put_u32(group_header + 4, (uint32_t)writer->rows_in_group);
+    if (fwrite(group_header, 1, sizeof(group_header), writer->file) != sizeof(group_header)) {
+        fprintf(stderr, "Write failed: %s\n", strerror(errno));
+        return -1;
+    }
+    writer->bytes_written += sizeof(group_header);
+    for (unsigned int i = 0; i < writer->cols_count; i++) {
+        ColumnBuffer *column = &writer->columns[i];
+        size_t raw_len = column->nulls->len + column->lengths->len + column->values->len;
+        size_t needed = raw_len + compressBound(raw_len);
+        if (needed > writer->scratch_cap) {
+            unsigned char *scratch = (unsigned char *)realloc(writer->scratch, needed);
+            if (!scratch) {
+                fprintf(stderr, "Memory allocation for column chunk failed\n");
+                return -1;
+            }
+            writer->scratch = scratch;
+            writer->scratch_cap = needed;
+        }
+        unsigned char *raw = writer->scratch;
+        memcpy(raw, column->nulls->data, column->nulls->len);
+        memcpy(raw + column->nulls->len, column->lengths->data, column->lengths->len);
+        memcpy(raw + column->nulls->len + column->lengths->len, column->values->data, column->values->len);
+
+        unsigned char *stored = raw + raw_len;
+        uLongf stored_len = compressBound(raw_len);
+        unsigned char codec = RGWC_CODEC_ZLIB;
+        if (compress2(stored, &stored_len, raw, raw_len, Z_DEFAULT_COMPRESSION) != Z_OK || stored_len >= raw_len) {
+            stored = raw;
+            stored_len = raw_len;
+            codec = RGWC_CODEC_RAW;
+        }
+        unsigned char chunk_header[17];
+        chunk_header[0] = codec;
+        put_u64(chunk_header + 1, raw_len);
+        put_u64(chunk_header + 9, stored_len);
+        if (fwrite(chunk_header, 1, sizeof(chunk_header), writer->file) != sizeof(chunk_header) ||
+            fwrite(stored, 1, stored_len, writer->file) != stored_len) {
+            fprintf(stderr, "Write failed: %s\n", strerror(errno));
+            return -1;
+        }
+        writer->bytes_written += sizeof(chunk_header) + stored_len;
+        column->nulls->len = 0;
+        column->lengths->len = 0;
+        column->values->len = 0;
+    }
+    RGWML_PROBE2(output__flush, "rgwc group", writer->rows_in_group);
+    writer->rows_written += writer->rows_in_group;
+    writer->rows_in_group = 0;
+    writer->group_bytes = 0;
+    return 0;
+}
+
+// Make everything written so far durable and report the file size
+int columnar_sync(ColumnarWriter *writer, long long *offset) {
+    return output_sync(writer->file, writer->uring, offset);
+}
+
+int columnar_close(ColumnarWriter *writer) {
+    int status = columnar_flush_group(writer);
+    if (fclose(writer->file) != 0) {
+        status = -1;
+    }
+    writer->file = NULL;
+    columnar_free(writer);
+    return status;
+}
+
+// ---- Output sinks ----
+// Rows are written to a file whose format follows its extension: .csv, .tsv
+// (LOAD DATA text format, readable by the import command), .ndjson/.jsonl or
+// .rgwc. Text formats build each row in a reusable buffer and write it in
+// one call. A shm:NAME[:MB] target streams RGWC into a shared-memory ring
+// (see rgwml.h) for a consumer on the same host instead of a file.
+
+#define RING_DEFAULT_MB 64
+
+typedef enum {
+    SINK_CSV,
+    SINK_TSV,
+    SINK_NDJSON,
+    SINK_RGWC
+} SinkFormat;
+
+typedef struct {
+    SinkFormat format;
+    FILE *file;                 // Text formats
+    UringFile *uring;           // Set while file runs on io_uring
+    ColumnarWriter *columnar;   // SINK_RGWC
+    RgwmlRing *ring;            // shm: targets, under columnar
+    unsigned int cols_count;
+    char **keys;                // NDJSON: "name": prefixes, already escaped
+    int *numeric;               // NDJSON: emit the column unquoted
+    Batch *line;
+    unsigned long long rows_written;
+    unsigned long long bytes_written; // Text formats, since the sink was opened
+} OutputSink;
+
+int sink_is_ring(const char *path) {
+    return strncmp(path, "shm:", 4) == 0;
+}
+
+int sink_format_from_path(const char *path, SinkFormat *format) {
+    if (sink_is_ring(path)) {
+        *format = SINK_RGWC;
+        return 0;
+    }
+    const char *dot = strrchr(path, '.');
+    const char *ext = dot ? dot + 1 : "";
+    if (strcmp(ext, "csv") == 0) {
+        *format = SINK_CSV;
+    } else if (strcmp(ext, "tsv") == 0) {
+        *format = SINK_TSV;
+    } else if (strcmp(ext, "ndjson") == 0 || strcmp(ext, "jsonl") == 0) {
+        *format = SINK_NDJSON;
+    } else if (strcmp(ext, "rgwc") == 0) {
+        *format = SINK_RGWC;
+    } else {
+        fprintf(stderr, "Cannot tell the output format of %s (use .csv, .tsv, .ndjson or .rgwc)\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// RFC 4180 field: quoted only when needed; NULL is an empty field and an
+// empty string is written as "" to keep the two apart
+int append_csv_field(Batch *batch, const char *value, unsigned long length, char terminator) {
+    if (batch_reserve(batch, length * 2 + 3) != 0) {
+        return -1;
+    }
+    char *out = batch->data + batch->len;
+    int quote = value && (length == 0 || memchr(value, ',', length) || memchr(value, '"', length) ||
+                          memchr(value, '\n', length) || memchr(value, '\r', length));
+    if (quote) {
+        *out++ = '"';
+    }
+    for (unsigned long i = 0; value && i < length; i++) {
+        if (value[i] == '"') {
+            *out++ = '"';
+        }
+        *out++ = value[i];
+    }
+    if (quote) {
+        *out++ = '"';
+    }
+    *out++ = terminator;
+    batch->len = out - batch->data;
+    return 0;
+}
+
+int append_json_string(Batch *batch, const char *value, unsigned long length) {
+    if (batch_reserve(batch, length * 6 + 2) != 0) {
+        return -1;
+    }
+    char *out = batch->data + batch->len;
+    *out++ = '"';
+    for (unsigned long i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)value[i];
+        if (c == '"' || c == '\\') {
+            *out++ = '\\';
+            *out++ = (char)c;
+        } else if (c == '\n') {
+            *out++ = '\\';
+            *out++ = 'n';
+        } else if (c == '\t') {
+            *out++ = '\\';
+            *out++ = 't';
+        } else if (c < 0x20) {
+            out += sprintf(out, "\\u%04x", c);
+        } else {
+            *out++ = (char)c;
+        }
+    }
+    *out++ = '"';
+    batch->len = out - batch->data;
+    return 0;
+}
+
+int batch_append(Batch *batch, const char *data, size_t len) {
+    if (batch_reserve(batch, len) != 0) {
+        return -1;
+    }
+    memcpy(batch->data + batch->len, data, len);
+    batch->len += len;
+    return 0;
+}
+
+void sink_free(OutputSink *sink) {
+    if (!sink) return;
+    for (unsigned int i = 0; sink->keys && i < sink->cols_count; i++) {
+        free(sink->keys[i]);
+    }
+    if (sink->file) {
+        fclose(sink->file);
+    }
+    if (sink->columnar) {
+        columnar_free(sink->columnar);
+    }
+    rgwml_ring_close(sink->ring, 1);
+    free(sink->keys);
+    free(sink->numeric);
+    batch_free(sink->line);
+    free(sink);
+}
+
+ssize_t ring_stream_write(void *cookie, const char *data, size_t len) {
+    return rgwml_ring_write((RgwmlRing *)cookie, data, len) == 0 ? (ssize_t)len : -1;
+}
+
+// The ring behind a FILE, so the RGWC writer needs no second code path.
+// Unbuffered: the writer already hands over whole column chunks.
+int sink_open_ring(OutputSink *sink, const char *target, const MYSQL_FIELD *fields, unsigned int cols_count) {
+    char name[256];
+    unsigned long long megabytes = RING_DEFAULT_MB;
+    const char *colon = strchr(target, ':');
+    size_t name_len = colon ? (size_t)(colon - target) : strlen(target);
+    if (name_len == 0 || name_len >= sizeof(name) ||
+        (colon && parse_count_option("shm: ring size", colon + 1, &megabytes) != 0)) {
+        fprintf(stderr, "Expected shm:NAME or shm:NAME:MB, got shm:%s\n", target);
+        return -1;
+    }
+    memcpy(name, target, name_len);
+    name[name_len] = '\0';
+    // Saturate rather than wrap, so an oversized ring is refused
+    sink->ring = rgwml_ring_create(name, megabytes > SIZE_MAX >> 20 ? SIZE_MAX : (size_t)megabytes << 20);
+    if (!sink->ring) {
+        return -1;
+    }
+    cookie_io_functions_t io = {NULL, ring_stream_write, NULL, NULL};
+    FILE *file = fopencookie(sink->ring, "w", io);
+    if (!file) {
+        fprintf(stderr, "Could not open a stream on ring %s\n", name);
+        return -1;
+    }
+    setvbuf(file, NULL, _IONBF, 0);
+    sink->columnar = columnar_open_stream(file, fields, cols_count);
+    return sink->columnar ? 0 : -1;
+}
+
+// Create `path`, or continue it after cutting it back to resume_offset when
+// that is non-zero. stdio_buffer is as for output_fopen().
+OutputSink* sink_open(const char *path, const MYSQL_FIELD *fields, unsigned int cols_count, long long resume_offset,
+                      size_t stdio_buffer) {
+    SinkFormat format;
+    if (sink_format_from_path(path, &format) != 0) {
+        return NULL;
+    }
+    OutputSink *sink = (OutputSink *)calloc(1, sizeof(OutputSink));
+    if (!sink || !(sink->line = batch_new(4096))) {
+        fprintf(stderr, "Memory allocation for output sink failed\n");
+        free(sink);
+        return NULL;
+    }
+    sink->format = format;
+    sink->cols_count = cols_count;
+
+    if (sink_is_ring(path)) {
+        if (sink_open_ring(sink, path + 4, fields, cols_count) != 0) {
+            sink_free(sink);
+            return NULL;
+        }
+        return sink;
+    }
+    if (format == SINK_RGWC) {
+        sink->columnar = columnar_open(path, fields, cols_count, resume_offset, stdio_buffer);
+        if (!sink->columnar) {
+            sink_free(sink);
+            return NULL;
+        }
+        return sink;
+    }
+
+    if (resume_offset > 0 && truncate(path, resume_offset) != 0) {
+        fprintf(stderr, "Could not cut %s back to offset %lld: %s\n", path, resume_offset, strerror(errno));
+        sink_free(sink);
+        return NULL;
+    }
+    sink->file = output_fopen(path, resume_offset > 0, stdio_buffer, &sink->uring);
+    if (!sink->file) {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        sink_free(sink);
+        return NULL;
+    }
+    if (!sink->uring && !stdio_buffer) {
+        setvbuf(sink->file, NULL, _IOFBF, 1 << 20);
+    }
+
+    if (format == SINK_NDJSON) {
+        sink->keys = (char **)calloc(cols_count, sizeof(char *));
+        sink->numeric = (int *)calloc(cols_count, sizeof(int));
+        if (!sink->keys || !sink->numeric) {
+            fprintf(stderr, "Memory allocation for output sink failed\n");
+            sink_free(sink);
+            return NULL;
+        }
+        for (unsigned int i = 0; i < cols_count; i++) {
+            sink->line->len = 0;
+            if (batch_append(sink->line, i == 0 ? "{" : ",", 1) != 0 ||
+                append_json_string(sink->line, fields[i].name, strlen(fields[i].name)) != 0 ||
+                batch_append(sink->line, ":", 2) != 0 ||
+                !(sink->keys[i] = strdup(sink->line->data))) {
+                sink_free(sink);
+                return NULL;
+            }
+            sink->numeric[i] = (fields[i].flags & NUM_FLAG) != 0;
+        }
+        sink->line->len = 0;
+    } else if (resume_offset == 0) {
+        // Header line
+        for (unsigned int i = 0; i < cols_count; i++) {
+            char terminator = (i + 1 == cols_count) ? '\n' : (format == SINK_CSV ? ',' : '\t');
+            int failed = format == SINK_CSV
+                ? append_csv_field(sink->line, fields[i].name, strlen(fields[i].name), terminator)
+                : append_load_data_field(sink->line, fields[i].name, strlen(fields[i].name), terminator);
+            if (failed) {
+                sink_free(sink);
+                return NULL;
+            }
+        }
+        fwrite(sink->line->data, 1, sink->line->len, sink->file);
+        sink->bytes_written += sink->line->len;
+        sink->line->len = 0;
+    }
+    return sink;
+}
+
+int sink_write_row(OutputSink *sink, MYSQL_ROW row, const unsigned long *lengths) {
+    if (sink->format == SINK_RGWC) {
+        if (columnar_append_row(sink->columnar, row, lengths) != 0) {
+            return -1;
+        }
+        sink->rows_written++;
+        // Keep row groups bounded for callers that never sync
+        if (sink->columnar->rows_in_group >= 65536) {
+            return columnar_flush_group(sink->columnar);
+        }
+        return 0;
+    }
+
+    Batch *line = sink->line;
+    line->len = 0;
+    for (unsigned int i = 0; i < sink->cols_count; i++) {
+        unsigned long len = row[i] ? lengths[i] : 0;
+        int failed = 0;
+        if (sink->format == SINK_CSV) {
+            failed = append_csv_field(line, row[i], len, (i + 1 == sink->cols_count) ? '\n' : ',');
+        } else if (sink->format == SINK_TSV) {
+            failed = append_load_data_field(line, row[i], len, (i + 1 == sink->cols_count) ? '\n' : '\t');
+        } else {
+            // The key string already carries its leading "{" or ","
+            failed = batch_append(line, sink->keys[i], strlen(sink->keys[i]));
+            if (!failed && !row[i]) {
+                failed = batch_append(line, "null", 4);
+            } else if (!failed && sink->numeric[i] && len > 0) {
+                failed = batch_append(line, row[i], len);
+            } else if (!failed) {
+                failed = append_json_string(line, row[i], len);
+            }
+            if (!failed && i + 1 == sink->cols_count) {
+                failed = batch_append(line, "}\n", 2);
+            }
+        }
+        if (failed) {
+            return -1;
+        }
+    }
+    if (fwrite(line->data, 1, line->len, sink->file) != line->len) {
+        fprintf(stderr, "Write failed: %s\n", strerror(errno));
+        return -1;
+    }
+    sink->rows_written++;
+    sink->bytes_written += line->len;
+    return 0;
+}
+
+// What the file will hold once everything written so far is flushed. An
+// RGWC row group still in memory counts at its uncompressed size.
+unsigned long long sink_size(const OutputSink *sink) {
+    if (sink->format == SINK_RGWC) {
+        return sink->columnar->bytes_written + sink->columnar->group_bytes;
+    }
+    return sink->bytes_written;
+}
+
+// Make all rows written so far durable and report the file size
+int sink_sync(OutputSink *sink, long long *offset) {
+    if (sink->format == SINK_RGWC) {
+        return columnar_flush_group(sink->columnar) == 0 ? columnar_sync(sink->columnar, offset) : -1;
+    }
+    if (output_sync(sink->file, sink->uring, offset) != 0) {
+        return -1;
+    }
+    RGWML_PROBE2(output__flush, "sink", sink->rows_written);
+    return 0;
+}
+
+int sink_close(OutputSink *sink) {
+    int status = 0;
+    if (sink->format == SINK_RGWC) {
+        status = columnar_close(sink->columnar);
+        sink->columnar = NULL;
+        rgwml_ring_close(sink->ring, status != 0);
+        sink->ring = NULL;
+    } else if (fclose(sink->file) != 0) {
+        fprintf(stderr, "Could not close output: %s\n", strerror(errno));
+        status = -1;
+    }
+    sink->file = NULL;
+    sink_free(sink);
+    return status;
+}
+
+// ---- Partitioned output ----
+// --partition-output COLUMN and --max-file-size MB split an export into
+// several files while it streams. The --output path gives the root
+// directory, the file prefix and the format. With lake/part.csv, a row whose
+// dt is 2026-10-15 goes to lake/dt=2026-10-15/part-0001.csv. This is Hive
+// style: the partition column is left out of the files, unsafe characters
+// are %XX escaped, and NULL or empty values go to
+// dt=__HIVE_DEFAULT_PARTITION__. When a file reaches the size limit it is
+// closed, and the partition carries on in part-0002.
+//
+// The fetch thread only routes rows. A hash of the value assigns each
+// partition to one of up to PARTITION_MAX_WRITERS writer threads. The writer
+// gets the rows through a bounded BatchQueue and does the formatting,
+// compression and I/O. Partition files are plain stdio with a small buffer
+// rather than io_uring, whose ring and buffers per file would add up to
+// 128 MiB across the open files. The open files are limited by the total
+// buffer budget: each writer keeps at most its share of
+// PARTITION_MAX_OPEN_FILES open and closes the least recently used one to
+// make room. When that partition comes back, its file is reopened and
+// appended to, the same way extract resumes.
+
+#define PARTITION_MAX_WRITERS 4
+#define PARTITION_BUFFER_BUDGET (4 * 1024 * 1024)
+#define PARTITION_FILE_BUFFER_BYTES (64 * 1024)
+#define PARTITION_MAX_OPEN_FILES (PARTITION_BUFFER_BUDGET / PARTITION_FILE_BUFFER_BYTES)
+#define PARTITION_BATCH_BYTES (256 * 1024)
+#define PARTITION_QUEUE_DEPTH 4
+#define PARTITION_MAX_FILE_MB (1024 * 1024) // --max-file-size cap, 1 TiB
+#define ROW_NULL_CELL 0xFFFFFFFFu
+#define PARTITION_DEFAULT "__HIVE_DEFAULT_PARTITION__"
+
+typedef struct {
+    const char *column;                // --partition-output, or NULL
+    unsigned long long max_file_bytes; // --max-file-size, 0 for no limit
+} PartitionOptions;
+
+typedef struct Partition {
+    char *dir;                // "column=value", or "" when only rolling over by size
+    unsigned int part;        // Number of the current file, 0 before the first
+    long long size;           // Bytes in the current file when it is not open
+    OutputSink *sink;         // NULL while no file is open
+    struct Partition *newer;  // Open files, most recently used first
+    struct Partition *older;
+} Partition;
+
+typedef struct PartitionedOutput PartitionedOutput;
+
+typedef struct {
+    const PartitionedOutput *output;
+    pthread_t thread;
+    int started;
+    BatchQueue queue;
+    Batch *pending;           // Rows the fetch thread is collecting for this writer
+    Partition **table;        // Open addressing on crc32(dir)
+    size_t table_size;
+    size_t partitions;
+    Partition *newest;
+    Partition *oldest;
+    unsigned int open_files;
+    unsigned int max_open_files;
+    unsigned long long files;
+    char **cells;
+    unsigned long *lengths;
+    Batch *scratch;
+    int failed;
+} PartitionWriter;
+
+struct PartitionedOutput {
+    char *root;
+    char *prefix;
+    char *extension;               // With its dot
+    char *column;                  // As the result spells it
+    unsigned int key_index;        // Of the partition column in the result
+    unsigned int result_cols;
+    unsigned int cols_count;       // Columns in the files
+    MYSQL_FIELD *fields;           // Copies, as writers may open files after the result is freed
+    unsigned long long max_file_bytes;
+    PartitionWriter writers[PARTITION_MAX_WRITERS];
+    int writers_count;
+};
+
+// mkdir -p
+int make_directories(const char *path) {
+    char *copy = strdup(path);
+    if (!copy) {
+        return -1;
+    }
+    for (char *p = copy + 1; ; p++) {
+        if (*p == '/' || *p == '\0') {
+            char saved = *p;
+            *p = '\0';
+            if (mkdir(copy, 0777) != 0 && errno != EEXIST) {
+                fprintf(stderr, "Could not create directory %s: %s\n", copy, strerror(errno));
+                free(copy);
+                return -1;
+            }
+            *p = saved;
+            if (saved == '\0') break;
+        }
+    }
+    free(copy);
+    return 0;
+}
+
+// Hive's escaping of partition directory names
+int append_partition_escaped(Batch *batch, const char *value, size_t length) {
+    if (batch_reserve(batch, length * 3 + 1) != 0) {
+        return -1;
+    }
+    char *out = batch->data + batch->len;
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)value[i];
+        if (c < 0x20 || c == 0x7F || strchr("\"#%'*/:=?\\{[]^", c)) {
+            out += sprintf(out, "%%%02X", c);
+        } else {
+            *out++ = (char)c;
+        }
+    }
+    *out = '\0';
+    batch->len = out - batch->data;
+    return 0;
+}
+
+// Rows travel between threads as cells of u32 length (ROW_NULL_CELL for
+// NULL), the bytes and a NUL. Partition writers get the partition value in
+// front.
+int row_encode_cell(Batch *batch, const char *value, unsigned long length) {
+    if (batch_reserve(batch, 4 + (value ? length + 1 : 0)) != 0) {
+        return -1;
+    }
+    uint32_t header = value ? (uint32_t)length : ROW_NULL_CELL;
+    memcpy(batch->data + batch->len, &header, 4);
+    batch->len += 4;
+    if (value) {
+        memcpy(batch->data + batch->len, value, length);
+        batch->data[batch->len + length] = '\0';
+        batch->len += length + 1;
+    }
+    return 0;
+}
+
+const char* row_decode_cell(const char *p, char **value, unsigned long *length) {
+    uint32_t header;
+    memcpy(&header, p, 4);
+    if (header == ROW_NULL_CELL) {
+        *value = NULL;
+        *length = 0;
+        return p + 4;
+    }
+    *value = (char *)p + 4;
+    *length = header;
+    return p + 4 + header + 1;
+}
+
+void partition_lru_unlink(PartitionWriter *writer, Partition *partition) {
+    if (partition->newer) partition->newer->older = partition->older;
+    else writer->newest = partition->older;
+    if (partition->older) partition->older->newer = partition->newer;
+    else writer->oldest = partition->newer;
+    partition->newer = NULL;
+    partition->older = NULL;
+}
+
+void partition_lru_push(PartitionWriter *writer, Partition *partition) {
+    partition->older = writer->newest;
+    if (writer->newest) writer->newest->newer = partition;
+    else writer->oldest = partition;
+    writer->newest = partition;
+}
+
+// Closes the file, to be continued later unless it is full
+int partition_close_file(PartitionWriter *writer, Partition *partition, int full) {
+    OutputSink *sink = partition->sink;
+    partition_lru_unlink(writer, partition);
+    partition->sink = NULL;
+    writer->open_files--;
+    // Flushing first makes the RGWC size exact
+    if (sink->format == SINK_RGWC && columnar_flush_group(sink->columnar) != 0) {
+        sink_free(sink);
+        return -1;
+    }
+    partition->size += (long long)sink_size(sink);
+    if (full) {
+        partition->part++;
+        partition->size = 0;
+    }
+    return sink_close(sink);
+}
+
+Partition* partition_writer_find(PartitionWriter *writer, const char *dir) {
+    if (2 * (writer->partitions + 1) > writer->table_size) {
+        size_t size = writer->table_size ? writer->table_size * 2 : 64;
+        Partition **table = (Partition **)calloc(size, sizeof(Partition *));
+        if (!table) {
+            fprintf(stderr, "Memory allocation for partitions failed\n");
+            return NULL;
+        }
+        for (size_t i = 0; i < writer->table_size; i++) {
+            Partition *partition = writer->table[i];
+            if (!partition) continue;
+            size_t slot = crc32(0, (const Bytef *)partition->dir, (uInt)strlen(partition->dir)) & (size - 1);
+            while (table[slot]) slot = (slot + 1) & (size - 1);
+            table[slot] = partition;
+        }
+        free(writer->table);
+        writer->table = table;
+        writer->table_size = size;
+    }
+    size_t mask = writer->table_size - 1;
+    size_t slot = crc32(0, (const Bytef *)dir, (uInt)strlen(dir)) & mask;
+    while (writer->table[slot] && strcmp(writer->table[slot]->dir, dir) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    if (!writer->table[slot]) {
+        Partition *partition = (Partition *)calloc(1, sizeof(Partition));
+        if (!partition || !(partition->dir = strdup(dir))) {
+            fprintf(stderr, "Memory allocation for partitions failed\n");
+            free(partition);
+            return NULL;
+        }
+        writer->table[slot] = partition;
+        writer->partitions++;
+    }
+    return writer->table[slot];
+}
+
+// Opens or reopens the partition's current file, closing the least
+// recently used one first when the writer is at its limit
+int partition_open_file(PartitionWriter *writer, Partition *partition) {
+    const PartitionedOutput *output = writer->output;
+    if (writer->open_files >= writer->max_open_files && partition_close_file(writer, writer->oldest, 0) != 0) {
+        return -1;
+    }
+    size_t size = strlen(output->root) + strlen(partition->dir) + strlen(output->prefix) + strlen(output->extension) + 32;
+    char *path = (char *)malloc(size);
+    if (!path) {
+        fprintf(stderr, "Memory allocation for partition path failed\n");
+        return -1;
+    }
+    int dir_len = snprintf(path, size, "%s/%s", output->root, partition->dir);
+    if (partition->part == 0) {
+        if (partition->dir[0] && make_directories(path) != 0) {
+            free(path);
+            return -1;
+        }
+        partition->part = 1;
+    }
+    snprintf(path + dir_len, size - dir_len, "%s%s-%04u%s", partition->dir[0] ? "/" : "", output->prefix,
+             partition->part, output->extension);
+    partition->sink = sink_open(path, output->fields, output->cols_count, partition->size, PARTITION_FILE_BUFFER_BYTES);
+    free(path);
+    if (!partition->sink) {
+        return -1;
+    }
+    writer->open_files++;
+    if (partition->size == 0) {
+        writer->files++;
+    }
+    partition_lru_push(writer, partition);
+    return 0;
+}
+
+int partition_writer_batch(PartitionWriter *writer, const Batch *batch) {
+    const PartitionedOutput *output = writer->output;
+    const char *p = batch->data;
+    const char *end = batch->data + batch->len;
+    while (p < end) {
+        char *key;
+        unsigned long key_len;
+        p = row_decode_cell(p, &key, &key_len);
+        for (unsigned int i = 0; i < output->cols_count; i++) {
+            p = row_decode_cell(p, &writer->cells[i], &writer->lengths[i]);
+        }
+
+        Batch *dir = writer->scratch;
+        dir->len = 0;
+        if (output->column) {
+            if (append_partition_escaped(dir, output->column, strlen(output->column)) != 0 ||
+                batch_append(dir, "=", 1) != 0 ||
+                (key && key_len > 0 ? append_partition_escaped(dir, key, key_len)
+                                    : append_partition_escaped(dir, PARTITION_DEFAULT, strlen(PARTITION_DEFAULT))) != 0) {
+                return -1;
+            }
+        } else if (batch_reserve(dir, 1) != 0) {
+            return -1;
+        }
+        dir->data[dir->len] = '\0';
+
+        Partition *partition = partition_writer_find(writer, dir->data);
+        if (!partition) {
+            return -1;
+        }
+        if (!partition->sink) {
+            if (partition_open_file(writer, partition) != 0) {
+                return -1;
+            }
+        } else if (writer->newest != partition) {
+            partition_lru_unlink(writer, partition);
+            partition_lru_push(writer, partition);
+        }
+        if (sink_write_row(partition->sink, writer->cells, writer->lengths) != 0) {
+            return -1;
+        }
+        if (output->max_file_bytes && partition->size + sink_size(partition->sink) >= output->max_file_bytes &&
+            partition_close_file(writer, partition, 1) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void* partition_writer_main(void *arg) {
+    PartitionWriter *writer = (PartitionWriter *)arg;
+    trace_thread_name("partition writer");
+    Batch *batch;
+    while (!writer->failed && (batch = batch_queue_pop(&writer->queue))) {
+        double started = trace_begin();
+        if (partition_writer_batch(writer, batch) != 0) {
+            writer->failed = 1;
+            batch_queue_fail(&writer->queue);
+        }
+        trace_span("partition batch", started, "rows", (long long)batch->rows);
+        batch_free(batch);
+    }
+    pthread_mutex_lock(&writer->queue.lock);
+    int aborted = writer->queue.failed;
+    pthread_mutex_unlock(&writer->queue.lock);
+    // Finished files are closed here, in parallel; after an abort
+    // partitioned_free() drops them
+    while (!aborted && writer->newest) {
+        if (partition_close_file(writer, writer->newest, 0) != 0) {
+            writer->failed = 1;
+        }
+    }
+    return NULL;
+}
+
+void partitioned_free(PartitionedOutput *output) {
+    if (!output) return;
+    for (int w = 0; w < output->writers_count; w++) {
+        PartitionWriter *writer = &output->writers[w];
+        if (writer->started) {
+            batch_queue_fail(&writer->queue);
+            pthread_join(writer->thread, NULL);
+            writer->started = 0;
+        }
+        for (size_t i = 0; i < writer->table_size; i++) {
+            Partition *partition = writer->table[i];
+            if (!partition) continue;
+            sink_free(partition->sink);
+            free(partition->dir);
+            free(partition);
+        }
+        free(writer->table);
+        free(writer->cells);
+        free(writer->lengths);
+        batch_free(writer->scratch);
+        batch_free(writer->pending);
+        batch_queue_destroy(&writer->queue);
+    }
+    for (unsigned int i = 0; output->fields && i < output->cols_count; i++) {
+        free(output->fields[i].name);
+    }
+    free(output->fields);
+    free(output->root);
+    free(output->prefix);
+    free(output->extension);
+    free(output->column);
+    free(output);
+}
+
+PartitionedOutput* partitioned_open(const char *target, const MYSQL_FIELD *fields, unsigned int cols_count,
+                                    const PartitionOptions *options) {
+    SinkFormat format;
+    if (sink_is_ring(target)) {
+        fprintf(stderr, "--partition-output and --max-file-size need a file --output, not %s\n", target);
+        return NULL;
+    }
+    if (sink_format_from_path(target, &format) != 0) {
+        return NULL;
+    }
+    unsigned int key_index = 0;
+    if (options->column) {
+        while (key_index < cols_count && strcasecmp(fields[key_index].name, options->column) != 0) {
+            key_index++;
+        }
+        if (key_index == cols_count) {
+            fprintf(stderr, "Partition column %s is not in the result\n", options->column);
+            return NULL;
+        }
+        if (cols_count == 1) {
+            fprintf(stderr, "Nothing is left to write once partition column %s is taken out\n", options->column);
+            return NULL;
+        }
+    }
+
+    PartitionedOutput *output = (PartitionedOutput *)calloc(1, sizeof(PartitionedOutput));
+    if (!output) {
+        fprintf(stderr, "Memory allocation for partitioned output failed\n");
+        return NULL;
+    }
+    output->column = options->column ? strdup(fields[key_index].name) : NULL;
+    output->key_index = key_index;
+    output->max_file_bytes = options->max_file_bytes;
+    const char *slash = strrchr(target, '/');
+    const char *base = slash ? slash + 1 : target;
+    const char *dot = strrchr(base, '.');
+    output->root = slash ? strndup(target, slash == target ? 1 : (size_t)(slash - target)) : strdup(".");
+    output->prefix = dot == base ? strdup("part") : strndup(base, (size_t)(dot - base));
+    output->extension = strdup(dot);
+    output->result_cols = cols_count;
+    output->cols_count = options->column ? cols_count - 1 : cols_count;
+    output->fields = (MYSQL_FIELD *)calloc(output->cols_count, sizeof(MYSQL_FIELD));
+    if (!output->root || !output->prefix || !output->extension || !output->fields || (options->column && !output->column)) {
+        fprintf(stderr, "Memory allocation for partitioned output failed\n");
+        partitioned_free(output);
+        return NULL;
+    }
+    for (unsigned int i = 0, j = 0; i < cols_count; i++) {
+        if (options->column && i == key_index) continue;
+        output->fields[j] = fields[i];
+        if (!(output->fields[j].name = strdup(fields[i].name))) {
+            fprintf(stderr, "Memory allocation for partitioned output failed\n");
+            partitioned_free(output);
+            return NULL;
+        }
+        j++;
+    }
+    if (make_directories(output->root) != 0) {
+        partitioned_free(output);
+        return NULL;
+    }
+
+    // Rolling over by size alone keeps to one file at a time
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    output->writers_count = !options->column ? 1 : cpus < 1 ? 1 : cpus > PARTITION_MAX_WRITERS ? PARTITION_MAX_WRITERS : (int)cpus;
+    for (int w = 0; w < output->writers_count; w++) {
+        PartitionWriter *writer = &output->writers[w];
+        writer->output = output;
+        writer->max_open_files = PARTITION_MAX_OPEN_FILES / output->writers_count;
+        batch_queue_init(&writer->queue, PARTITION_QUEUE_DEPTH);
+        writer->cells = (char **)calloc(output->cols_count, sizeof(char *));
+        writer->lengths = (unsigned long *)calloc(output->cols_count, sizeof(unsigned long));
+        writer->scratch = batch_new(256);
+        if (!writer->cells || !writer->lengths || !writer->scratch) {
+            fprintf(stderr, "Memory allocation for partitioned output failed\n");
+            partitioned_free(output);
+            return NULL;
+        }
+        if (pthread_create(&writer->thread, NULL, partition_writer_main, writer) != 0) {
+            fprintf(stderr, "Could not start a partition writer\n");
+            partitioned_free(output);
+            return NULL;
+        }
+        writer->started = 1;
+    }
+    return output;
+}
+
+// Hands the row to its partition's writer. Fails once a writer has failed.
+int partitioned_write_row(PartitionedOutput *output, MYSQL_ROW row, const unsigned long *lengths) {
+    const char *key = output->column ? row[output->key_index] : NULL;
+    unsigned long key_len = key ? lengths[output->key_index] : 0;
+    // NULL and '' share the default partition, so they must share a writer
+    int w = key_len > 0 && output->writers_count > 1 ? (int)(crc32(0, (const Bytef *)key, (uInt)key_len) % output->writers_count) : 0;
+    PartitionWriter *writer = &output->writers[w];
+    if (!writer->pending && !(writer->pending = batch_new(PARTITION_BATCH_BYTES + 4096))) {
+        fprintf(stderr, "Memory allocation for partition batch failed\n");
+        return -1;
+    }
+    Batch *batch = writer->pending;
+    if (row_encode_cell(batch, key, key_len) != 0) {
+        return -1;
+    }
+    for (unsigned int i = 0; i < output->result_cols; i++) {
+        if (output->column && i == output->key_index) continue;
+        if (row_encode_cell(batch, row[i], row[i] ? lengths[i] : 0) != 0) {
+            return -1;
+        }
+    }
+    batch->rows++;
+    if (batch->len >= PARTITION_BATCH_BYTES) {
+        if (batch_queue_push(&writer->queue, batch) != 0) {
+            return -1;
+        }
+        writer->pending = NULL;
+    }
+    return 0;
+}
+
+// Flushes the remaining rows, waits for the writers to close their files
+// and frees the output. *files is how many files were written.
+int partitioned_close(PartitionedOutput *output, unsigned long long *files) {
+    int status = 0;
+    *files = 0;
+    for (int w = 0; w < output->writers_count; w++) {
+        PartitionWriter *writer = &output->writers[w];
+        if (writer->pending && batch_queue_push(&writer->queue, writer->pending) == 0) {
+            writer->pending = NULL;
+        }
+        batch_queue_close(&writer->queue);
+    }
+    for (int w = 0; w < output->writers_count; w++) {
+        PartitionWriter *writer = &output->writers[w];
+        pthread_join(writer->thread, NULL);
+        writer->started = 0;
+        if (writer->failed || writer->pending) {
+            status = -1;
+        }
+        *files += writer->files;
+    }
+    partitioned_free(output);
+    return status;
+}
+
+// ---- Tee output ----
+// One fetch can feed several --output targets. The fetch thread encodes the
+// rows into batches (row_encode_cell) and publishes each batch once, into a
+// ring of TEE_RING_DEPTH slots. Every target reads the ring on its own
+// thread at its own pace. A slot is only reused once all targets are past
+// it, so a slow target holds up the fetch, and through it the others, only
+// when it falls a full ring behind. Besides files and shm: rings, a target
+// can be "preview", which prints the first and last rows the way a normal
+// query does, or "stats", which prints per-column nulls, lengths and numeric
+// ranges. --partition-output and --max-file-size apply to every file target.
+// A lone file or partitioned target skips all that: the fetch thread writes
+// to it directly.
+
+#define TEE_MAX_OUTPUTS 8
+#define TEE_RING_DEPTH 8
+#define TEE_BATCH_BYTES (256 * 1024)
+#define TEE_PREVIEW_ROWS 5 // At each end, as print_query_result() shows them
+
+typedef enum {
+    TEE_SINK,
+    TEE_PARTITIONED,
+    TEE_PREVIEW,
+    TEE_STATS
+} TeeKind;
+
+typedef struct {
+    char *name;
+    const char *type;
+    int numeric;                // Track min and max
+    unsigned long long nulls;
+    unsigned long min_length;
+    unsigned long max_length;
+    unsigned long long numbers; // Cells that parsed as numbers
+    double min;
+    double max;
+} ColumnStats;
+
+typedef struct Tee Tee;
+
+typedef struct {
+    Tee *tee;
+    TeeKind kind;
+    const char *target;
+    pthread_t thread;
+    int started;
+    unsigned long long next;  // Sequence number of the next batch to read
+    int done;                 // Stopped reading, so it no longer holds slots
+    int failed;
+    unsigned long long rows;
+    OutputSink *sink;
+    PartitionedOutput *partitioned;
+    unsigned long long files;
+    QueryResult *preview;     // The first rows, and the last ones once finished
+    Batch *tail[TEE_PREVIEW_ROWS]; // Latest rows past the first, still encoded
+    ColumnStats *stats;
+    char **cells;
+    unsigned long *lengths;
+} TeeConsumer;
+
+struct Tee {
+    pthread_mutex_t lock;
+    pthread_cond_t published;
+    pthread_cond_t consumed;
+    Batch *slots[TEE_RING_DEPTH];
+    unsigned long long head;  // Batches published so far
+    int closed;
+    int failed;
+    unsigned int cols_count;
+    Batch *pending;           // Rows the fetch thread is collecting
+    TeeConsumer consumers[TEE_MAX_OUTPUTS];
+    int consumers_count;
+    int direct;               // A single file target, written without the ring
+};
+
+// Waits for the consumer's next batch. NULL at the end, or once the tee
+// has failed.
+const Batch* tee_next(TeeConsumer *consumer) {
+    Tee *tee = consumer->tee;
+    pthread_mutex_lock(&tee->lock);
+    while (consumer->next == tee->head && !tee->closed && !tee->failed) {
+        pthread_cond_wait(&tee->published, &tee->lock);
+    }
+    const Batch *batch = consumer->next < tee->head && !tee->failed ? tee->slots[consumer->next % TEE_RING_DEPTH] : NULL;
+    pthread_mutex_unlock(&tee->lock);
+    return batch;
+}
+
+void tee_release(TeeConsumer *consumer) {
+    Tee *tee = consumer->tee;
+    pthread_mutex_lock(&tee->lock);
+    consumer->next++;
+    pthread_cond_signal(&tee->consumed);
+    pthread_mutex_unlock(&tee->lock);
+}
+
+// The consumer stops reading. A failure stops the whole tee.
+void tee_stop(TeeConsumer *consumer, int failed) {
+    Tee *tee = consumer->tee;
+    pthread_mutex_lock(&tee->lock);
+    consumer->done = 1;
+    consumer->failed = failed;
+    if (failed) {
+        tee->failed = 1;
+        pthread_cond_broadcast(&tee->published);
+    }
+    pthread_cond_signal(&tee->consumed);
+    pthread_mutex_unlock(&tee->lock);
+}
+
+int tee_failed(Tee *tee) {
+    pthread_mutex_lock(&tee->lock);
+    int failed = tee->failed;
+    pthread_mutex_unlock(&tee->lock);
+    return failed;
+}
+
+// Waits until the ring has a free slot and publishes the batch there. The
+// batch that was in that slot, which every consumer is done with, comes
+// back through *recycled. Returns -1 once the tee has failed.
+int tee_publish(Tee *tee, Batch *batch, Batch **recycled) {
+    pthread_mutex_lock(&tee->lock);
+    for (;;) {
+        unsigned long long oldest = tee->head;
+        for (int i = 0; i < tee->consumers_count; i++) {
+            const TeeConsumer *consumer = &tee->consumers[i];
+            if (!consumer->done && consumer->next < oldest) {
+                oldest = consumer->next;
+            }
+        }
+        if (tee->failed || tee->head - oldest < TEE_RING_DEPTH) break;
+        pthread_cond_wait(&tee->consumed, &tee->lock);
+    }
+    if (tee->failed) {
+        pthread_mutex_unlock(&tee->lock);
+        return -1;
+    }
+    Batch **slot = &tee->slots[tee->head % TEE_RING_DEPTH];
+    *recycled = *slot;
+    *slot = batch;
+    tee->head++;
+    pthread_cond_broadcast(&tee->published);
+    pthread_mutex_unlock(&tee->lock);
+    return 0;
+}
+
+int tee_preview_row(TeeConsumer *consumer, const char *encoded, size_t len) {
+    if (consumer->rows < TEE_PREVIEW_ROWS) {
+        QueryResult *preview = consumer->preview;
+        char **cells = query_result_append_row(preview);
+        if (!cells || copy_row_cells(cells, query_result_lengths(preview, preview->rows_count), consumer->cells,
+                                     consumer->lengths, (int)consumer->tee->cols_count) != 0) {
+            fprintf(stderr, "Memory allocation for preview failed\n");
+            return -1;
+        }
+        consumer->preview->rows_count++;
+        return 0;
+    }
+    Batch **slot = &consumer->tail[(consumer->rows - TEE_PREVIEW_ROWS) % TEE_PREVIEW_ROWS];
+    if (!*slot && !(*slot = batch_new(len > 256 ? len : 256))) {
+        fprintf(stderr, "Memory allocation for preview failed\n");
+        return -1;
+    }
+    (*slot)->len = 0;
+    return batch_append(*slot, encoded, len);
+}
+
+// Appends the last rows after the first ones
+int tee_preview_finish(TeeConsumer *consumer) {
+    unsigned int cols_count = consumer->tee->cols_count;
+    unsigned long long past = consumer->rows > TEE_PREVIEW_ROWS ? consumer->rows - TEE_PREVIEW_ROWS : 0;
+    unsigned long long count = past < TEE_PREVIEW_ROWS ? past : TEE_PREVIEW_ROWS;
+    for (unsigned long long k = 0; k < count; k++) {
+        const Batch *slot = consumer->tail[(past - count + k) % TEE_PREVIEW_ROWS];
+        const char *p = slot->data;
+        for (unsigned int i = 0; i < cols_count; i++) {
+            p = row_decode_cell(p, &consumer->cells[i], &consumer->lengths[i]);
+        }
+        QueryResult *preview = consumer->preview;
+        char **cells = query_result_append_row(preview);
+        if (!cells || copy_row_cells(cells, query_result_lengths(preview, preview->rows_count), consumer->cells,
+                                     consumer->lengths, (int)cols_count) != 0) {
+            fprintf(stderr, "Memory allocation for preview failed\n");
+            return -1;
+        }
+        consumer->preview->rows_count++;
+    }
+    return 0;
+}
+
+void tee_stats_row(TeeConsumer *consumer) {
+    for (unsigned int i = 0; i < consumer->tee->cols_count; i++) {
+        ColumnStats *column = &consumer->stats[i];
+        const char *value = consumer->cells[i];
+        if (!value) {
+            column->nulls++;
+            continue;
+        }
+        unsigned long len = consumer->lengths[i];
+        if (consumer->rows == column->nulls || len < column->min_length) column->min_length = len;
+        if (len > column->max_length) column->max_length = len;
+        if (column->numeric && len > 0) {
+            char *end = NULL;
+            double number = strtod(value, &end);
+            if (*end == '\0') {
+                if (column->numbers == 0 || number < column->min) column->min = number;
+                if (column->numbers == 0 || number > column->max) column->max = number;
+                column->numbers++;
+            }
+        }
+    }
+}
+
+int tee_consume_batch(TeeConsumer *consumer, const Batch *batch) {
+    unsigned int cols_count = consumer->tee->cols_count;
+    const char *p = batch->data;
+    const char *end = batch->data + batch->len;
+    while (p < end) {
+        const char *encoded = p;
+        for (unsigned int i = 0; i < cols_count; i++) {
+            p = row_decode_cell(p, &consumer->cells[i], &consumer->lengths[i]);
+        }
+        int failed = 0;
+        if (consumer->kind == TEE_SINK) {
+            failed = sink_write_row(consumer->sink, consumer->cells, consumer->lengths);
+        } else if (consumer->kind == TEE_PARTITIONED) {
+            failed = partitioned_write_row(consumer->partitioned, consumer->cells, consumer->lengths);
+        } else if (consumer->kind == TEE_PREVIEW) {
+            failed = tee_preview_row(consumer, encoded, (size_t)(p - encoded));
+        } else {
+            tee_stats_row(consumer);
+        }
+        if (failed) {
+            return -1;
+        }
+        consumer->rows++;
+    }
+    return 0;
+}
+
+void* tee_consumer_main(void *arg) {
+    TeeConsumer *consumer = (TeeConsumer *)arg;
+    trace_thread_name(consumer->target);
+    int failed = 0;
+    const Batch *batch;
+    while (!failed && (batch = tee_next(consumer))) {
+        double started = trace_begin();
+        failed = tee_consume_batch(consumer, batch) != 0;
+        trace_span("tee batch", started, "rows", (long long)batch->rows);
+        tee_release(consumer);
+    }
+    // Files are closed here, in parallel with the other targets
+    if (!failed && !tee_failed(consumer->tee)) {
+        if (consumer->kind == TEE_SINK) {
+            failed = sink_close(consumer->sink) != 0;
+            consumer->sink = NULL;
+        } else if (consumer->kind == TEE_PARTITIONED) {
+            failed = partitioned_close(consumer->partitioned, &consumer->files) != 0;
+            consumer->partitioned = NULL;
+        } else if (consumer->kind == TEE_PREVIEW) {
+            failed = tee_preview_finish(consumer) != 0;
+        }
+    }
+    tee_stop(consumer, failed);
+    return NULL;
+}
+
+void tee_free(Tee *tee) {
+    if (!tee) return;
+    pthread_mutex_lock(&tee->lock);
+    tee->failed = 1;
+    pthread_cond_broadcast(&tee->published);
+    pthread_mutex_unlock(&tee->lock);
+    for (int c = 0; c < tee->consumers_count; c++) {
+        TeeConsumer *consumer = &tee->consumers[c];
+        if (consumer->started) {
+            pthread_join(consumer->thread, NULL);
+        }
+        sink_free(consumer->sink);
+        partitioned_free(consumer->partitioned);
+        free_query_result(consumer->preview);
+        for (int i = 0; i < TEE_PREVIEW_ROWS; i++) {
+            batch_free(consumer->tail[i]);
+        }
+        for (unsigned int i = 0; consumer->stats && i < tee->cols_count; i++) {
+            free(consumer->stats[i].name);
+        }
+        free(consumer->stats);
+        free(consumer->cells);
+        free(consumer->lengths);
+    }
+    for (int i = 0; i < TEE_RING_DEPTH; i++) {
+        batch_free(tee->slots[i]);
+    }
+    batch_free(tee->pending);
+    pthread_mutex_destroy(&tee->lock);
+    pthread_cond_destroy(&tee->published);
+    pthread_cond_destroy(&tee->consumed);
+    free(tee);
+}
+
+int tee_open_consumer(TeeConsumer *consumer, const MYSQL_FIELD *fields, unsigned int cols_count,
+                      const PartitionOptions *partition) {
+    const char *target = consumer->target;
+    consumer->cells = (char **)calloc(cols_count, sizeof(char *));
+    consumer->lengths = (unsigned long *)calloc(cols_count, sizeof(unsigned long));
+    if (!consumer->cells || !consumer->lengths) {
+        fprintf(stderr, "Memory allocation for %s failed\n", target);
+        return -1;
+    }
+    if (strcmp(target, "preview") == 0) {
+        consumer->kind = TEE_PREVIEW;
+        consumer->preview = query_result_new(fields, (int)cols_count);
+        return consumer->preview ? 0 : -1;
+    }
+    if (strcmp(target, "stats") == 0) {
+        consumer->kind = TEE_STATS;
+        consumer->stats = (ColumnStats *)calloc(cols_count, sizeof(ColumnStats));
+        if (!consumer->stats) {
+            fprintf(stderr, "Memory allocation for %s failed\n", target);
+            return -1;
+        }
+        for (unsigned int i = 0; i < cols_count; i++) {
+            if (!(consumer->stats[i].name = strdup(fields[i].name))) {
+                fprintf(stderr, "Memory allocation for %s failed\n", target);
+                return -1;
+            }
+            consumer->stats[i].type = mysql_type_to_c_type(fields[i].type).mysql_type;
+            consumer->stats[i].numeric = (fields[i].flags & NUM_FLAG) != 0;
+        }
+        return 0;
+    }
+    if (!sink_is_ring(target) && (partition->column || partition->max_file_bytes)) {
+        consumer->kind = TEE_PARTITIONED;
+        consumer->partitioned = partitioned_open(target, fields, cols_count, partition);
+        return consumer->partitioned ? 0 : -1;
+    }
+    consumer->kind = TEE_SINK;
+    consumer->sink = sink_open(target, fields, cols_count, 0, 0);
+    return consumer->sink ? 0 : -1;
+}
+
+// The same file spelled two ways, e.g. a.csv and ./a.csv, counts as the
+// same target: same name in the same directory, or the same existing file
+int tee_same_target(const char *a, const char *b) {
+    if (strcmp(a, b) == 0) {
+        return 1;
+    }
+    if (sink_is_ring(a) || sink_is_ring(b) || strcmp(a, "preview") == 0 || strcmp(b, "preview") == 0 ||
+        strcmp(a, "stats") == 0 || strcmp(b, "stats") == 0) {
+        return 0;
+    }
+    struct stat file_a, file_b;
+    if (stat(a, &file_a) == 0 && stat(b, &file_b) == 0) {
+        return file_a.st_dev == file_b.st_dev && file_a.st_ino == file_b.st_ino;
+    }
+    const char *slash_a = strrchr(a, '/');
+    const char *slash_b = strrchr(b, '/');
+    if (strcmp(slash_a ? slash_a + 1 : a, slash_b ? slash_b + 1 : b) != 0) {
+        return 0;
+    }
+    // "/x" lives in "/", not in ""
+    char *dir_a = slash_a ? strndup(a, slash_a == a ? 1 : (size_t)(slash_a - a)) : strdup(".");
+    char *dir_b = slash_b ? strndup(b, slash_b == b ? 1 : (size_t)(slash_b - b)) : strdup(".");
+    int same = dir_a && dir_b && stat(dir_a, &file_a) == 0 && stat(dir_b, &file_b) == 0 &&
+               file_a.st_dev == file_b.st_dev && file_a.st_ino == file_b.st_ino;
+    free(dir_a);
+    free(dir_b);
+    return same;
+}
+
+// Opens every target, then starts their threads
+Tee* tee_open(const char *const *targets, int targets_count, const MYSQL_FIELD *fields, unsigned int cols_count,
+              const PartitionOptions *partition) {
+    Tee *tee = (Tee *)calloc(1, sizeof(Tee));
+    if (!tee) {
+        fprintf(stderr, "Memory allocation for outputs failed\n");
+        return NULL;
+    }
+    pthread_mutex_init(&tee->lock, NULL);
+    pthread_cond_init(&tee->published, NULL);
+    pthread_cond_init(&tee->consumed, NULL);
+    tee->cols_count = cols_count;
+    for (int c = 0; c < targets_count; c++) {
+        for (int other = 0; other < c; other++) {
+            if (tee_same_target(targets[c], targets[other])) {
+                if (strcmp(targets[c], targets[other]) == 0) {
+                    fprintf(stderr, "--output %s is given twice\n", targets[c]);
+                } else {
+                    fprintf(stderr, "--output %s and %s are the same file\n", targets[other], targets[c]);
+                }
+                tee_free(tee);
+                return NULL;
+            }
+        }
+        TeeConsumer *consumer = &tee->consumers[tee->consumers_count++];
+        consumer->tee = tee;
+        consumer->target = targets[c];
+        if (tee_open_consumer(consumer, fields, cols_count, partition) != 0) {
+            tee_free(tee);
+            return NULL;
+        }
+    }
+    TeeKind kind = tee->consumers[0].kind;
+    if (tee->consumers_count == 1 && (kind == TEE_SINK || kind == TEE_PARTITIONED)) {
+        tee->direct = 1;
+        return tee;
+    }
+    for (int c = 0; c < tee->consumers_count; c++) {
+        TeeConsumer *consumer = &tee->consumers[c];
+        if (pthread_create(&consumer->thread, NULL, tee_consumer_main, consumer) != 0) {
+            fprintf(stderr, "Could not start the writer for %s\n", consumer->target);
+            tee_free(tee);
+            return NULL;
+        }
+        consumer->started = 1;
+    }
+    return tee;
+}
+
+// Fails once any target has failed
+int tee_write_row(Tee *tee, MYSQL_ROW row, const unsigned long *lengths) {
+    if (tee->direct) {
+        TeeConsumer *consumer = &tee->consumers[0];
+        int failed = consumer->kind == TEE_SINK ? sink_write_row(consumer->sink, row, lengths)
+                                                : partitioned_write_row(consumer->partitioned, row, lengths);
+        consumer->rows++;
+        return failed ? -1 : 0;
+    }
+    if (!tee->pending && !(tee->pending = batch_new(TEE_BATCH_BYTES + 4096))) {
+        fprintf(stderr, "Memory allocation for output batch failed\n");
+        return -1;
+    }
+    Batch *batch = tee->pending;
+    for (unsigned int i = 0; i < tee->cols_count; i++) {
+        if (row_encode_cell(batch, row[i], row[i] ? lengths[i] : 0) != 0) {
+            return -1;
+        }
+    }
+    batch->rows++;
+    if (batch->len >= TEE_BATCH_BYTES) {
+        Batch *recycled = NULL;
+        if (tee_publish(tee, batch, &recycled) != 0) {
+            return -1;
+        }
+        tee->pending = recycled;
+        if (recycled) {
+            recycled->len = 0;
+            recycled->rows = 0;
+        }
+    }
+    return 0;
+}
+
+// Publishes the last rows and waits for every target to finish
+int tee_close(Tee *tee) {
+    if (tee->direct) {
+        TeeConsumer *consumer = &tee->consumers[0];
+        int failed;
+        if (consumer->kind == TEE_SINK) {
+            failed = sink_close(consumer->sink) != 0;
+            consumer->sink = NULL;
+        } else {
+            failed = partitioned_close(consumer->partitioned, &consumer->files) != 0;
+            consumer->partitioned = NULL;
+        }
+        return failed ? -1 : 0;
+    }
+    Batch *recycled = NULL;
+    if (tee->pending && tee->pending->rows > 0) {
+        if (tee_publish(tee, tee->pending, &recycled) == 0) {
+            tee->pending = NULL;
+        }
+        batch_free(recycled);
+    }
+    pthread_mutex_lock(&tee->lock);
+    tee->closed = 1;
+    pthread_cond_broadcast(&tee->published);
+    pthread_mutex_unlock(&tee->lock);
+    int status = 0;
+    for (int c = 0; c < tee->consumers_count; c++) {
+        TeeConsumer *consumer = &tee->consumers[c];
+        pthread_join(consumer->thread, NULL);
+        consumer->started = 0;
+        if (consumer->failed) {
+            status = -1;
+        }
+    }
+    return tee->failed ? -1 : status;
+}
+
+void print_column_stats(const TeeConsumer *consumer) {
+    static const char *headers[] = {"column", "type", "nulls", "min length", "max length", "min", "max"};
+    char cell[32];
+
+    ft_table_t *table = ft_create_table();
+    ft_set_cell_prop(table, FT_ANY_ROW, FT_ANY_COLUMN, FT_CPROP_TEXT_ALIGN, FT_ALIGNED_LEFT);
+    ft_set_cell_prop(table, 0, FT_ANY_COLUMN, FT_CPROP_ROW_TYPE, FT_ROW_HEADER);
+    for (size_t i = 0; i < sizeof(headers) / sizeof(headers[0]); i++) {
+        ft_u8write(table, headers[i]);
+    }
+    ft_ln(table);
+
+    for (unsigned int i = 0; i < consumer->tee->cols_count; i++) {
+        const ColumnStats *column = &consumer->stats[i];
+        int has_values = column->nulls < consumer->rows;
+        ft_u8write(table, column->name);
+        ft_u8write(table, column->type);
+        snprintf(cell, sizeof(cell), "%llu", column->nulls);
+        ft_u8write(table, cell);
+        if (has_values) {
+            snprintf(cell, sizeof(cell), "%lu", column->min_length);
+            ft_u8write(table, cell);
+            snprintf(cell, sizeof(cell), "%lu", column->max_length);
+            ft_u8write(table, cell);
+        } else {
+            ft_u8write(table, "-");
+            ft_u8write(table, "-");
+        }
+        if (column->numbers) {
+            snprintf(cell, sizeof(cell), "%.15g", column->min);
+            ft_u8write(table, cell);
+            snprintf(cell, sizeof(cell), "%.15g", column->max);
+            ft_u8write(table, cell);
+        } else {
+            ft_u8write(table, "-");
+            ft_u8write(table, "-");
+        }
+        ft_ln(table);
+    }
+
+    printf("%s\n", (const char *)ft_to_u8string(table));
+    ft_destroy_table(table);
+}
+
+void tee_report(const Tee *tee, unsigned long long rows, double seconds) {
+    for (int c = 0; c < tee->consumers_count; c++) {
+        const TeeConsumer *consumer = &tee->consumers[c];
+        if (consumer->kind == TEE_PREVIEW) {
+            print_result_table(consumer->preview, rows);
+            printf("Total number of rows: %llu\n", rows);
+        } else if (consumer->kind == TEE_STATS) {
+            print_column_stats(consumer);
+        } else if (consumer->kind == TEE_PARTITIONED) {
+            const char *slash = strrchr(consumer->target, '/');
+            printf("Exported %llu rows to %llu files under %.*s (%.2fs)\n", rows, consumer->files,
+                   slash ? (slash == consumer->target ? 1 : (int)(slash - consumer->target)) : 1,
+                   slash ? consumer->target : ".", seconds);
+        } else {
+            printf("Exported %llu rows to %s (%.2fs)\n", rows, consumer->target, seconds);
+        }
+    }
+}
+
+// ---- Query export ----
+// --output streams a query's rows from mysql_use_result() straight to its
+// targets instead of printing them. Neither the whole result nor a text
+// rendering of it is ever held in memory.
+
+// *profile and *rows_exported describe the fetch, for the query history
+int export_query(const DbPreset *db, const char *query, const char *const *targets, int targets_count,
+                 const PartitionOptions *partition, const QueryOptions *options, QueryProfile *profile,
+                 unsigned long long *rows_exported) {
+    memset(profile, 0, sizeof(*profile));
+    *rows_exported = 0;
+    double started = now_seconds();
+    MYSQL *conn = connect_db(db, 0);
+    if (!conn) {
+        return -1;
+    }
+    profile->connect_seconds = now_seconds() - started;
+    throttle_prepare_stream(options->throttle, conn);
+    StatList status_before, status_calibration;
+    int server_stats = options->server_stats && capture_session_status(conn, &status_before) == 0 &&
+                       capture_session_status(conn, &status_calibration) == 0;
+    double execute_started = now_seconds();
+    QueryGuard guard;
+    if (query_guard_start(&guard, db, conn, options->timeout_ms) != 0) {
+        fprintf(stderr, "Could not start the query watchdog\n");
+        mysql_close(conn);
+        return -1;
+    }
+    perf_begin();
+    RGWML_PROBE1(query__start, query);
+    char *limited_query = apply_execution_time_limit(conn, query, options->timeout_ms);
+    int failed = mysql_query(conn, limited_query ? limited_query : query);
+    free(limited_query);
+    MYSQL_RES *res = failed ? NULL : mysql_use_result(conn);
+    perf_end("execute", 0);
+    profile->execute_seconds = now_seconds() - execute_started;
+    if (!res) {
+        RGWML_PROBE2(query__done, 0, 1);
+        query_guard_stop(&guard);
+        if (guard.reason) {
+            fprintf(stderr, "Query cancelled (%s) before returning rows\n", guard.reason);
+        } else if (failed) {
+            fprintf(stderr, "Query failed: %s\n", mysql_error(conn));
+        } else {
+            fprintf(stderr, "Query returned no result set to export\n");
+        }
+        mysql_close(conn);
+        return -1;
+    }
+
+    unsigned int cols_count = mysql_num_fields(res);
+    Tee *tee = tee_open(targets, targets_count, mysql_fetch_fields(res), cols_count, partition);
+    int ok = tee != NULL;
+    unsigned long long rows = 0;
+    double fetch_started = now_seconds();
+    unsigned long long pending_bytes = 0;
+    double batch_started = trace_begin();
+    MYSQL_ROW row;
+    perf_begin();
+    while (ok && (row = mysql_fetch_row(res))) {
+        unsigned long *lengths = mysql_fetch_lengths(res);
+        for (unsigned int i = 0; i < cols_count; i++) {
+            pending_bytes += lengths[i];
+        }
+        ok = tee_write_row(tee, row, lengths) == 0;
+        if (++rows % THROTTLE_CHECK_ROWS == 0) {
+            RGWML_PROBE2(fetch__batch, rows, pending_bytes);
+            trace_span("export batch", batch_started, "rows", THROTTLE_CHECK_ROWS);
+            throttle_wait(options->throttle, THROTTLE_CHECK_ROWS, pending_bytes);
+            profile->bytes += pending_bytes;
+            pending_bytes = 0;
+            batch_started = trace_begin();
+        }
+    }
+    perf_end("fetch", rows);
+    unsigned int fetch_error = ok ? mysql_errno(conn) : 0;
+    profile->fetch_seconds = now_seconds() - fetch_started;
+    profile->bytes += pending_bytes;
+    *rows_exported = rows;
+    RGWML_PROBE2(query__done, rows, !ok || fetch_error != 0);
+    mysql_free_result(res);
+    query_guard_stop(&guard);
+    if (fetch_error) {
+        if (guard.reason || query_timed_out(fetch_error)) {
+            fprintf(stderr, "Export cancelled (%s) after %llu rows\n", guard.reason ? guard.reason : "timeout", rows);
+        } else {
+            fprintf(stderr, "Fetch failed after %llu rows: %s\n", rows, mysql_error(conn));
+        }
+        ok = 0;
+    }
+    ServerStats *stats = server_stats && ok ? finish_server_stats(conn, &status_before, &status_calibration) : NULL;
+    mysql_close(conn);
+
+    if (tee && ok) {
+        ok = tee_close(tee) == 0;
+    }
+    if (ok) {
+        tee_report(tee, rows, now_seconds() - started);
+        if (options->server_stats) {
+            printf("\n");
+            print_server_stats(stats);
+        }
+    }
+    free(stats);
+    tee_free(tee);
+    return ok ? 0 : -1;
+}
+
+// ---- Checkpoints ----
+// A checkpoint records how far a resumable job got: the output size that is
+// known to be good, the last key processed and, while a chunk is in flight,
+// the same values for that chunk. It is replaced atomically via rename().
+
+typedef struct {
+    long long committed_offset;
+    char *last_key; // SQL literal, NULL before the first chunk
+    unsigned long long rows;
+    long long pending_offset; // 0 when no chunk is in flight
+    char *pending_key;
+    unsigned long long pending_rows;
+} Checkpoint;
+
+void checkpoint_clear(Checkpoint *checkpoint) {
+    free(checkpoint->last_key);
+    free(checkpoint->pending_key);
+    memset(checkpoint, 0, sizeof(*checkpoint));
+}
+
+// Returns 1 when a checkpoint was loaded, 0 when there is none, -1 on error
+int checkpoint_read(const char *path, Checkpoint *checkpoint) {
+    memset(checkpoint, 0, sizeof(*checkpoint));
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, file)) > 0) {
+        if (line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        char *value = strchr(line, ' ');
+        if (!value) {
+            continue;
+        }
+        *value++ = '\0';
+        if (strcmp(line, "committed_offset") == 0) {
+            checkpoint->committed_offset = strtoll(value, NULL, 10);
+        } else if (strcmp(line, "last_key") == 0) {
+            checkpoint->last_key = strdup(value);
+        } else if (strcmp(line, "rows") == 0) {
+            checkpoint->rows = strtoull(value, NULL, 10);
+        } else if (strcmp(line, "pending_offset") == 0) {
+            checkpoint->pending_offset = strtoll(value, NULL, 10);
+        } else if (strcmp(line, "pending_key") == 0) {
+            checkpoint->pending_key = strdup(value);
+        } else if (strcmp(line, "pending_rows") == 0) {
+            checkpoint->pending_rows = strtoull(value, NULL, 10);
+        }
+    }
+    free(line);
+    fclose(file);
+    return 1;
+}
+
+int checkpoint_write(const char *path, const Checkpoint *checkpoint) {
+    char *tmp_path = format_string("%s.tmp", path);
+    if (!tmp_path) {
+        return -1;
+    }
+    FILE *file = fopen(tmp_path, "w");
+    if (!file) {
+        fprintf(stderr, "Could not write checkpoint %s: %s\n", tmp_path, strerror(errno));
+        free(tmp_path);
+        return -1;
+    }
+    fprintf(file, "committed_offset %lld\n", checkpoint->committed_offset);
+    if (checkpoint->last_key) {
+        fprintf(file, "last_key %s\n", checkpoint->last_key);
+    }
+    fprintf(file, "rows %llu\n", checkpoint->rows);
+    if (checkpoint->pending_offset > 0) {
+        fprintf(file, "pending_offset %lld\n", checkpoint->pending_offset);
+        fprintf(file, "pending_key %s\n", checkpoint->pending_key);
+        fprintf(file, "pending_rows %llu\n", checkpoint->pending_rows);
+    }
+    int ok = fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = (fclose(file) == 0) && ok;
+    ok = ok && rename(tmp_path, path) == 0;
+    if (!ok) {
+        fprintf(stderr, "Could not write checkpoint %s: %s\n", path, strerror(errno));
+    }
+    free(tmp_path);
+    return ok ? 0 : -1;
+}
+
+// ---- Archive and purge ----
+// Rows matching the predicate are walked in key order, chunk by chunk. Each
+// chunk is selected FOR UPDATE, written to the RGWC file as a row group and
+// fsynced, and only then deleted by key range in the same transaction. The
+// checkpoint marks the chunk as pending, with its row count, before the
+// DELETE is committed. A resumed run counts the rows still in the pending
+// range: none means the DELETE made it and the last row group is kept, all
+// of them means it did not and the row group is cut off. Any other count
+// means the range changed meanwhile, and the run stops for the operator
+// rather than guess.
+
+#define ARCHIVE_DEFAULT_CHUNK_SIZE 5000
+
+// Rows of (after, upto] that still match the predicate, or -1 on error
+long long archive_range_count(MYSQL *conn, const char *table, const char *predicate, const char *quoted_key,
+                              const char *after, const char *upto) {
+    char *sql = format_string("SELECT COUNT(*) FROM %s WHERE (%s)%s%s%s AND %s <= %s", table, predicate,
+                              after ? " AND " : "", after ? quoted_key : "", after ? " > " : "", quoted_key, upto);
+    if (!sql) {
+        return -1;
+    }
+    int failed = mysql_query(conn, sql);
+    free(sql);
+    MYSQL_RES *res = failed ? NULL : mysql_store_result(conn);
+    if (!res) {
+        fprintf(stderr, "Could not check the pending chunk: %s\n", mysql_error(conn));
+        return -1;
+    }
+    MYSQL_ROW row = mysql_fetch_row(res);
+    long long count = row && row[0] ? strtoll(row[0], NULL, 10) : -1;
+    mysql_free_result(res);
+    if (count < 0) {
+        fprintf(stderr, "Could not check the pending chunk: no count returned\n");
+    }
+    return count;
+}
+
+int archive_table(const DbPreset *db, const char *table, const char *predicate, const char *out_path,
+                  const char *checkpoint_path, const char *key_column, unsigned long long chunk_size,
+                  unsigned long long pause_ms, Throttle *throttle) {
+    MYSQL *conn = connect_db(db, 0);
+    if (!conn) {
+        return -1;
+    }
+    int status = -1;
+    ColumnarWriter *writer = NULL;
+    char *sql = NULL;
+    Checkpoint checkpoint;
+    char *key = key_column ? strdup(key_column) : primary_key_column(conn, table);
+    char *quoted_key = key ? quote_identifier(key) : NULL;
+    int resumed = checkpoint_read(checkpoint_path, &checkpoint);
+    if (!quoted_key || resumed < 0) {
+        goto done;
+    }
+    if (!resumed && access(out_path, F_OK) == 0) {
+        fprintf(stderr, "%s already exists and there is no checkpoint to resume from\n", out_path);
+        goto done;
+    }
+
+    if (checkpoint.pending_offset > 0) {
+        // Find out whether the DELETE of the in-flight chunk was committed
+        long long remaining = archive_range_count(conn, table, predicate, quoted_key, checkpoint.last_key,
+                                                  checkpoint.pending_key);
+        if (remaining < 0) {
+            goto done;
+        }
+        if (remaining > 0 && (unsigned long long)remaining != checkpoint.pending_rows) {
+            fprintf(stderr, "The pending chunk up to %s = %s was archived with %llu rows, but %lld rows now match it, "
+                    "so it is unclear whether its DELETE committed. Compare the table with the last row group of %s, "
+                    "then fix %s by hand.\n", key, checkpoint.pending_key, checkpoint.pending_rows, remaining,
+                    out_path, checkpoint_path);
+            goto done;
+        }
+        if (!remaining) {
+            free(checkpoint.last_key);
+            checkpoint.last_key = checkpoint.pending_key;
+            checkpoint.pending_key = NULL;
+            checkpoint.committed_offset = checkpoint.pending_offset;
+            checkpoint.rows += checkpoint.pending_rows;
+        }
+        free(checkpoint.pending_key);
+        checkpoint.pending_key = NULL;
+        checkpoint.pending_offset = 0;
+        checkpoint.pending_rows = 0;
+        if (checkpoint_write(checkpoint_path, &checkpoint) != 0) {
+            goto done;
+        }
+    }
+    if (resumed) {
+        // Drop whatever was written after the last committed chunk
+        if (checkpoint.committed_offset > 0 ? truncate(out_path, checkpoint.committed_offset) != 0
+                                            : (unlink(out_path) != 0 && errno != ENOENT)) {
+            fprintf(stderr, "Could not cut %s back to the checkpoint: %s\n", out_path, strerror(errno));
+            goto done;
+        }
+        printf("Resuming after %llu archived rows\n", checkpoint.rows);
+    }
+
+    mysql_autocommit(conn, 0);
+    double started = now_seconds();
+    for (;;) {
+        free(sql);
+        sql = keyset_page_sql(table, predicate, quoted_key, checkpoint.last_key, chunk_size, " FOR UPDATE");
+        if (!sql) {
+            break;
+        }
+        double phase = trace_begin();
+        MYSQL_RES *res = NULL;
+        if (mysql_query(conn, sql) || !(res = mysql_store_result(conn))) {
+            fprintf(stderr, "Chunk select failed: %s\n", mysql_error(conn));
+            mysql_rollback(conn);
+            break;
+        }
+        unsigned long long rows_count = mysql_num_rows(res);
+        trace_span("chunk select", phase, "rows", (long long)rows_count);
+        if (rows_count == 0) {
+            mysql_free_result(res);
+            mysql_rollback(conn);
+            status = 0;
+            break;
+        }
+
+        unsigned int cols_count = mysql_num_fields(res);
+        MYSQL_FIELD *fields = mysql_fetch_fields(res);
+        unsigned int key_index = cols_count;
+        for (unsigned int i = 0; i < cols_count; i++) {
+            if (strcasecmp(fields[i].name, key) == 0) {
+                key_index = i;
+            }
+        }
+        if (key_index == cols_count) {
+            fprintf(stderr, "Key column %s is not part of %s\n", key, table);
+            mysql_free_result(res);
+            mysql_rollback(conn);
+            break;
+        }
+        if (!writer && !(writer = columnar_open(out_path, fields, cols_count, checkpoint.committed_offset, 0))) {
+            mysql_free_result(res);
+            mysql_rollback(conn);
+            break;
+        }
+
+        char *chunk_last_key = NULL;
+        int ok = 1;
+        MYSQL_ROW row;
+        unsigned long long row_index = 0;
+        unsigned long long chunk_bytes = 0;
+        phase = trace_begin();
+        while (ok && (row = mysql_fetch_row(res))) {
+            unsigned long *lengths = mysql_fetch_lengths(res);
+            for (unsigned int i = 0; i < cols_count; i++) {
+                chunk_bytes += lengths[i];
+            }
+            ok = columnar_append_row(writer, row, lengths) == 0;
+            if (ok && ++row_index == rows_count) {
+                chunk_last_key = sql_literal(conn, row[key_index], lengths[key_index], fields[key_index].flags & NUM_FLAG);
+                ok = chunk_last_key != NULL;
+            }
+        }
+        mysql_free_result(res);
+
+        long long offset = 0;
+        if (ok) {
+            ok = columnar_flush_group(writer) == 0 && columnar_sync(writer, &offset) == 0;
+        }
+        trace_span("chunk write", phase, "bytes", (long long)chunk_bytes);
+        if (ok) {
+            checkpoint.pending_offset = offset;
+            checkpoint.pending_key = chunk_last_key;
+            checkpoint.pending_rows = rows_count;
+            chunk_last_key = NULL;
+            ok = checkpoint_write(checkpoint_path, &checkpoint) == 0;
+        }
+        free(chunk_last_key);
+        if (!ok) {
+            mysql_rollback(conn);
+            break;
+        }
+
+        // The selected rows are locked, so this removes exactly what was archived
+        phase = trace_begin();
+        free(sql);
+        sql = format_string("DELETE FROM %s WHERE (%s)%s%s%s AND %s <= %s", table, predicate,
+                            checkpoint.last_key ? " AND " : "", checkpoint.last_key ? quoted_key : "",
+                            checkpoint.last_key ? " > " : "", quoted_key, checkpoint.pending_key);
+        if (!sql || mysql_query(conn, sql)) {
+            fprintf(stderr, "Chunk delete failed: %s\n", mysql_error(conn));
+            mysql_rollback(conn);
+            break;
+        }
+        unsigned long long deleted = mysql_affected_rows(conn);
+        if (deleted != rows_count) {
+            fprintf(stderr, "Chunk delete removed %llu rows but %llu were archived; rolled back\n", deleted, rows_count);
+            mysql_rollback(conn);
+            break;
+        }
+        if (mysql_commit(conn)) {
+            fprintf(stderr, "Commit failed: %s\n", mysql_error(conn));
+            break;
+        }
+        trace_span("chunk delete", phase, "rows", (long long)deleted);
+
+        free(checkpoint.last_key);
+        checkpoint.last_key = checkpoint.pending_key;
+        checkpoint.pending_key = NULL;
+        checkpoint.committed_offset = checkpoint.pending_offset;
+        checkpoint.pending_offset = 0;
+        checkpoint.rows += rows_count;
+        checkpoint.pending_rows = 0;
+        if (checkpoint_write(checkpoint_path, &checkpoint) != 0) {
+            break;
+        }
+        printf("Archived and deleted %llu rows up to %s = %s (total %llu, %.2fs)\n",
+               rows_count, key, checkpoint.last_key, checkpoint.rows, now_seconds() - started);
+        fflush(stdout);
+        if (pause_ms > 0) {
+            sleep_ms(pause_ms);
+        }
+        throttle_wait(throttle, rows_count, chunk_bytes);
+    }
+
+    if (writer && columnar_close(writer) != 0) {
+        status = -1;
+    }
+    writer = NULL;
+    if (status == 0) {
+        if (checkpoint.rows > 0) {
+            printf("Archive complete: %llu rows in %s\n", checkpoint.rows, out_path);
+        } else {
+            printf("No rows of %s match the predicate\n", table);
+        }
+        unlink(checkpoint_path);
+    }
+
+done:
+    if (writer) {
+        columnar_free(writer);
+    }
+    free(sql);
+    checkpoint_clear(&checkpoint);
+    free(quoted_key);
+    free(key);
+    mysql_close(conn);
+    return status;
+}
+
+int run_archive(int argc, char *argv[], const char *program) {
+    unsigned long long chunk_size = ARCHIVE_DEFAULT_CHUNK_SIZE;
+    unsigned long long pause_ms = DML_DEFAULT_SLEEP_MS;
+    const char *checkpoint_arg = NULL;
+    const char *key_column = NULL;
+    ThrottleOptions throttle_options = {0};
+    const char *positional[4];
+    int positional_count = 0;
+
+    for (int i = 0; i < argc; i++) {
+        int throttle_arg = parse_throttle_option(argc, argv, &i, &throttle_options);
+        if (throttle_arg < 0) {
+            return EXIT_FAILURE;
+        } else if (throttle_arg) {
+            continue;
+        } else if (strcmp(argv[i], "--chunk-size") == 0 && i + 1 < argc) {
+            if (parse_count_option(argv[i], argv[i + 1], &chunk_size) != 0) return EXIT_FAILURE;
+            i++;
+        } else if (strcmp(argv[i], "--sleep-ms") == 0 && i + 1 < argc) {
+            char *end = NULL;
+            pause_ms = strtoull(argv[++i], &end, 10);
+            if (*end != '\0') {
+                fprintf(stderr, "--sleep-ms expects a number\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            checkpoint_arg = argv[++i];
+        } else if (strcmp(argv[i], "--key") == 0 && i + 1 < argc) {
+            key_column = argv[++i];
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            if (parse_trace_option(argc, argv, &i) < 0) return EXIT_FAILURE;
+        } else if (positional_count < 4 && strncmp(argv[i], "--", 2) != 0) {
+            positional[positional_count++] = argv[i];
+        } else {
+            positional_count = -1;
+            break;
+        }
+    }
+    if (positional_count != 4) {
+        fprintf(stderr, "Usage: %s archive [--chunk-size N] [--sleep-ms N] [--key column] [--checkpoint file] [--trace out.json] [throttle options] <preset> <table> <predicate> <out.rgwc>\n", program);
+        return EXIT_FAILURE;
+    }
+
+    char *checkpoint_path = checkpoint_arg ? strdup(checkpoint_arg) : format_string("%s.checkpoint", positional[3]);
+    cJSON *config_json = load_config(CONFIG_PATH);
+    if (!config_json || !checkpoint_path) {
+        cJSON_Delete(config_json);
+        free(checkpoint_path);
+        return EXIT_FAILURE;
+    }
+    DbPreset db;
+    Throttle throttle;
+    Throttle *active_throttle = NULL;
+    int status = EXIT_FAILURE;
+    if (load_db_preset(config_json, positional[0], &db) == 0 &&
+        throttle_setup(&throttle, &throttle_options, config_json, &db, &active_throttle) == 0 &&
+        archive_table(&db, positional[1], positional[2], positional[3], checkpoint_path, key_column, chunk_size, pause_ms,
+                      active_throttle) == 0) {
+        status = EXIT_SUCCESS;
+    }
+    throttle_close(active_throttle);
+    cJSON_Delete(config_json);
+    free(checkpoint_path);
+    return status;
+}
+
+// ---- Resumable extraction ----
+// The table is read page by page with keyset pagination (key > last ORDER BY
+// key LIMIT n). Every page is written to the output and synced before the
+// checkpoint moves past it, so a rerun cuts the output back to the last
+// checkpoint and continues from the next key. Lost connections are retried
+// with a reconnect and exponential backoff.
+
+#define EXTRACT_DEFAULT_PAGE_SIZE 10000
+#define EXTRACT_DEFAULT_RETRIES 10
+
+// Run a query that returns a bounded result, reconnecting on network errors
+MYSQL_RES* query_with_retry(MYSQL **conn, const DbPreset *db, const char *sql, unsigned long long retries) {
+    for (unsigned long long attempt = 0; ; attempt++) {
+        unsigned int error = CR_SERVER_GONE_ERROR;
+        if (!*conn) {
+            *conn = connect_db(db, 0);
+        }
+        if (*conn) {
+            MYSQL_RES *res = NULL;
+            if (mysql_query(*conn, sql) == 0 && (res = mysql_store_result(*conn))) {
+                return res;
+            }
+            error = mysql_errno(*conn);
+            fprintf(stderr, "Query failed: %s\n", mysql_error(*conn));
+        }
+        if (attempt >= retries || !is_retryable_error(error)) {
+            return NULL;
+        }
+        if (*conn && (error == CR_SERVER_GONE_ERROR || error == CR_SERVER_LOST)) {
+            mysql_close(*conn);
+            *conn = NULL;
+        }
+        unsigned long backoff = 250UL << (attempt < 7 ? attempt : 7);
+        fprintf(stderr, "Retrying in %lu ms (attempt %llu of %llu)\n", backoff, attempt + 1, retries);
+        sleep_ms(backoff);
+    }
+}
+
+int extract_table(const DbPreset *db, const char *table, const char *predicate, const char *out_path,
+                  const char *checkpoint_path, const char *key_column, unsigned long long page_size,
+                  unsigned long long retries, Throttle *throttle) {
+    if (sink_is_ring(out_path)) {
+        fprintf(stderr, "extract resumes by cutting its output back, which %s does not allow\n", out_path);
+        return -1;
+    }
+    MYSQL *conn = connect_db(db, 0);
+    if (!conn) {
+        return -1;
+    }
+    int status = -1;
+    OutputSink *sink = NULL;
+    Checkpoint checkpoint;
+    char *key = key_column ? strdup(key_column) : primary_key_column(conn, table);
+    char *quoted_key = key ? quote_identifier(key) : NULL;
+    int resumed = checkpoint_read(checkpoint_path, &checkpoint);
+    if (!quoted_key || resumed < 0) {
+        goto done;
+    }
+    if (!resumed && access(out_path, F_OK) == 0) {
+        fprintf(stderr, "%s already exists and there is no checkpoint to resume from\n", out_path);
+        goto done;
+    }
+    if (resumed) {
+        printf("Resuming after %llu rows\n", checkpoint.rows);
+    }
+
+    double started = now_seconds();
+    for (;;) {
+        char *sql = keyset_page_sql(table, predicate, quoted_key, checkpoint.last_key, page_size, "");
+        double phase = trace_begin();
+        MYSQL_RES *res = sql ? query_with_retry(&conn, db, sql, retries) : NULL;
+        free(sql);
+        if (!res) {
+            break;
+        }
+
+        unsigned long long rows_count = mysql_num_rows(res);
+        trace_span("page select", phase, "rows", (long long)rows_count);
+        unsigned int cols_count = mysql_num_fields(res);
+        MYSQL_FIELD *fields = mysql_fetch_fields(res);
+        unsigned int key_index = cols_count;
+        for (unsigned int i = 0; i < cols_count; i++) {
+            if (strcasecmp(fields[i].name, key) == 0) {
+                key_index = i;
+            }
+        }
+        if (key_index == cols_count) {
+            fprintf(stderr, "Key column %s is not part of %s\n", key, table);
+            mysql_free_result(res);
+            break;
+        }
+        if (!sink && !(sink = sink_open(out_path, fields, cols_count, checkpoint.committed_offset, 0))) {
+            mysql_free_result(res);
+            break;
+        }
+
+        int ok = 1;
+        char *page_last_key = NULL;
+        unsigned long long row_index = 0;
+        unsigned long long page_bytes = 0;
+        MYSQL_ROW row;
+        phase = trace_begin();
+        while (ok && (row = mysql_fetch_row(res))) {
+            unsigned long *lengths = mysql_fetch_lengths(res);
+            for (unsigned int i = 0; i < cols_count; i++) {
+                page_bytes += lengths[i];
+            }
+            ok = sink_write_row(sink, row, lengths) == 0;
+            if (ok && ++row_index == rows_count) {
+                page_last_key = sql_literal(conn, row[key_index], lengths[key_index], fields[key_index].flags & NUM_FLAG);
+                ok = page_last_key != NULL;
+            }
+        }
+        mysql_free_result(res);
+
+        long long offset = 0;
+        if (ok && rows_count > 0) {
+            ok = sink_sync(sink, &offset) == 0;
+        }
+        trace_span("page write", phase, "bytes", (long long)page_bytes);
+        if (ok && rows_count > 0) {
+            free(checkpoint.last_key);
+            checkpoint.last_key = page_last_key;
+            page_last_key = NULL;
+            checkpoint.committed_offset = offset;
+            checkpoint.rows += rows_count;
+            ok = checkpoint_write(checkpoint_path, &checkpoint) == 0;
+            printf("Extracted %llu rows up to %s = %s (%.2fs)\n", checkpoint.rows, key, checkpoint.last_key, now_seconds() - started);
+            fflush(stdout);
+        }
+        free(page_last_key);
+        if (!ok) {
+            break;
+        }
+        if (rows_count < page_size) {
+            status = 0;
+            break;
+        }
+        throttle_wait(throttle, rows_count, page_bytes);
+    }
+
+    if (sink && sink_close(sink) != 0) {
+        status = -1;
+    }
+    sink = NULL;
+    if (status == 0) {
+        printf("Extraction complete: %llu rows in %s\n", checkpoint.rows, out_path);
+        unlink(checkpoint_path);
+    }
+
+done:
+    if (sink) {
+        sink_free(sink);
+    }
+    checkpoint_clear(&checkpoint);
+    free(quoted_key);
+    free(key);
+    if (conn) {
+        mysql_close(conn);
+    }
+    return status;
+}
+
+int run_extract(int argc, char *argv[], const char *program) {
+    unsigned long long page_size = EXTRACT_DEFAULT_PAGE_SIZE;
+    unsigned long long retries = EXTRACT_DEFAULT_RETRIES;
+    const char *checkpoint_arg = NULL;
+    const char *key_column = NULL;
+    const char *predicate = NULL;
+    ThrottleOptions throttle_options = {0};
+    const char *positional[3];
+    int positional_count = 0;
+
+    for (int i = 0; i < argc; i++) {
+        int throttle_arg = parse_throttle_option(argc, argv, &i, &throttle_options);
+        if (throttle_arg < 0) {
+            return EXIT_FAILURE;
+        } else if (throttle_arg) {
+            continue;
+        } else if (strcmp(argv[i], "--page-size") == 0 && i + 1 < argc) {
+            if (parse_count_option(argv[i], argv[i + 1], &page_size) != 0) return EXIT_FAILURE;
+            i++;
+        } else if (strcmp(argv[i], "--retries") == 0 && i + 1 < argc) {
+            char *end = NULL;
+            retries = strtoull(argv[++i], &end, 10);
+            if (*end != '\0') {
+                fprintf(stderr, "--retries expects a number\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            checkpoint_arg = argv[++i];
+        } else if (strcmp(argv[i], "--key") == 0 && i + 1 < argc) {
+            key_column = argv[++i];
+        } else if (strcmp(argv[i], "--where") == 0 && i + 1 < argc) {
+            predicate = argv[++i];
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            if (parse_trace_option(argc, argv, &i) < 0) return EXIT_FAILURE;
+        } else if (positional_count < 3 && strncmp(argv[i], "--", 2) != 0) {
+            positional[positional_count++] = argv[i];
+        } else {
+            positional_count = -1;
+            break;
+        }
+    }
+    if (positional_count != 3) {
+        fprintf(stderr, "Usage: %s extract [--where predicate] [--key column] [--page-size N] [--retries N] [--checkpoint file] [--trace out.json] [throttle options] <preset> <table> <out.csv|.tsv|.ndjson|.rgwc>\n", program);
+        return EXIT_FAILURE;
+    }
+
+    char *checkpoint_path = checkpoint_arg ? strdup(checkpoint_arg) : format_string("%s.checkpoint", positional[2]);
+    cJSON *config_json = load_config(CONFIG_PATH);
+    if (!config_json || !checkpoint_path) {
+        cJSON_Delete(config_json);
+        free(checkpoint_path);
+        return EXIT_FAILURE;
+    }
+    DbPreset db;
+    Throttle throttle;
+    Throttle *active_throttle = NULL;
+    int status = EXIT_FAILURE;
+    if (route_db_preset(config_json, positional[0], 1, &db) == 0 &&
+        throttle_setup(&throttle, &throttle_options, config_json, &db, &active_throttle) == 0 &&
+        extract_table(&db, positional[1], predicate, positional[2], checkpoint_path, key_column, page_size, retries,
+                      active_throttle) == 0) {
+        status = EXIT_SUCCESS;
+    }
+    throttle_close(active_throttle);
+    cJSON_Delete(config_json);
+    free(checkpoint_path);
+    return status;
+}
+
+// ---- Load generation ----
+// `loadgen` replays a weighted mix of queries from a file, one query per
+// line with an optional leading weight:
+//
+//     # weight  query
+//     5 SELECT * FROM recentincomingcalls WHERE caller = '9876543210'
+//     1 SELECT COUNT(*) FROM recentincomingcalls
+//
+// Without --qps each worker fires its next query as soon as the previous one
+// finished (closed loop). With --qps the requests follow a fixed schedule
+// shared by all workers (open loop). A request that starts late because the
+// server fell behind is then also charged the time it spent waiting for its
+// slot. That "corrected" latency is what a client arriving at that rate would
+// have seen; the plain service time hides the stall (coordinated omission).
+#define LOADGEN_DEFAULT_CONCURRENCY 8
+#define LOADGEN_DEFAULT_DURATION 30
+
+typedef struct {
+    char *sql;
+    unsigned int weight;
+    Histogram latency; // Service time: start to last row
+    Histogram corrected; // Scheduled start to last row, open loop only
+    unsigned long long errors;
+    pthread_mutex_t lock;
+} LoadQuery;
+
+typedef struct {
+    const DbPreset *db;
+    LoadQuery *queries;
+    int query_count;
+    unsigned int total_weight;
+    double qps; // 0 for closed loop
+    double started;
+    double deadline;
+    unsigned long long next_slot; // Open loop schedule position
+    int connected; // Workers that managed to connect
+} LoadGen;
+
+typedef struct {
+    LoadGen *gen;
+    unsigned int seed;
+    pthread_t thread;
+} LoadWorker;
+
+void free_load_queries(LoadQuery *queries, int count) {
+    for (int i = 0; i < count; i++) {
+        free(queries[i].sql);
+        pthread_mutex_destroy(&queries[i].lock);
+    }
+    free(queries);
+}
+
+// Parses the mix file. Returns the number of queries or -1.
+int load_query_mix(const char *path, LoadQuery **out) {
+    char *text = read_file(path);
+    if (!text) {
+        return -1;
+    }
+    LoadQuery *queries = NULL;
+    int count = 0;
+    char *save = NULL;
+    for (char *line = strtok_r(text, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        char *p = (char *)skip_space(line);
+        size_t len = strlen(p);
+        while (len > 0 && (isspace((unsigned char)p[len - 1]) || p[len - 1] == ';')) {
+            p[--len] = '\0';
+        }
+        if (len == 0 || *p == '#' || strncmp(p, "--", 2) == 0) {
+            continue;
+        }
+        unsigned long weight = 1;
+        if (isdigit((unsigned char)*p)) {
+            weight = strtoul(p, &p, 10);
+            p = (char *)skip_space(p);
+        }
+        if (weight == 0 || *p == '\0') {
+            continue;
+        }
+        LoadQuery *grown = (LoadQuery *)realloc(queries, (size_t)(count + 1) * sizeof(LoadQuery));
+        if (!grown) {
+            fprintf(stderr, "Memory allocation for query mix failed\n");
+            free_load_queries(queries, count);
+            free(text);
+            return -1;
+        }
+        queries = grown;
+        memset(&queries[count], 0, sizeof(LoadQuery));
+        queries[count].sql = strdup(p);
+        queries[count].weight = (unsigned int)weight;
+        histogram_init(&queries[count].latency);
+        histogram_init(&queries[count].corrected);
+        pthread_mutex_init(&queries[count].lock, NULL);
+        count++;
+        if (!queries[count - 1].sql) {
+            fprintf(stderr, "Memory allocation for query mix failed\n");
+            free_load_queries(queries, count);
+            free(text);
+            return -1;
+        }
+    }
+    free(text);
+    if (count == 0) {
+        fprintf(stderr, "No queries found in %s\n", path);
+        free(queries);
+        return -1;
+    }
+    *out = queries;
+    return count;
+}
+
+LoadQuery* pick_load_query(LoadGen *gen, unsigned int *seed) {
+    unsigned int r = (unsigned int)rand_r(seed) % gen->total_weight;
+    for (int i = 0; i < gen->query_count; i++) {
+        if (r < gen->queries[i].weight) return &gen->queries[i];
+        r -= gen->queries[i].weight;
+    }
+    return &gen->queries[gen->query_count - 1];
+}
+
+void* load_worker_main(void *arg) {
+    LoadWorker *worker = (LoadWorker *)arg;
+    LoadGen *gen = worker->gen;
+    mysql_thread_init();
+    MYSQL *conn = connect_db(gen->db, 0);
+    if (!conn) {
+        mysql_thread_end();
+        return NULL;
+    }
+    __atomic_add_fetch(&gen->connected, 1, __ATOMIC_RELAXED);
+    trace_thread_name("load worker");
+
+    while (!interrupted) {
+        double scheduled = now_seconds();
+        if (gen->qps > 0) {
+            unsigned long long slot = __atomic_fetch_add(&gen->next_slot, 1, __ATOMIC_RELAXED);
+            scheduled = gen->started + (double)slot / gen->qps;
+            if (scheduled >= gen->deadline) break;
+            double wait = scheduled - now_seconds();
+            if (wait > 0) {
+                sleep_ms((unsigned long long)(wait * 1000.0));
+            }
+        } else if (scheduled >= gen->deadline) {
+            break;
+        }
+
+        LoadQuery *query = pick_load_query(gen, &worker->seed);
+        double started = now_seconds();
+        unsigned long long execute_us = 0, fetch_us = 0;
+        long long rows = run_timed_query(conn, query->sql, &execute_us, &fetch_us);
+        unsigned long long service_us = elapsed_micros(started);
+        unsigned long long corrected_us = elapsed_micros(scheduled);
+        trace_span("query", started, "mix_index", query - gen->queries + 1);
+
+        pthread_mutex_lock(&query->lock);
+        if (rows < 0) {
+            query->errors++;
+        } else {
+            histogram_record(&query->latency, service_us);
+            if (gen->qps > 0) {
+                histogram_record(&query->corrected, corrected_us);
+            }
+        }
+        pthread_mutex_unlock(&query->lock);
+
+        if (rows < 0 && is_retryable_error(mysql_errno(conn))) {
+            mysql_close(conn);
+            conn = connect_db(gen->db, 0);
+            if (!conn) break;
+        }
+    }
+    if (conn) {
+        mysql_close(conn);
+    }
+    mysql_thread_end();
+    return NULL;
+}
+
+void print_load_report(const LoadGen *gen, double elapsed) {
+    int rows_per_query = gen->qps > 0 ? 2 : 1;
+    int count = gen->query_count * rows_per_query + rows_per_query;
+    const char **labels = (const char **)calloc((size_t)count, sizeof(char *));
+    const Histogram **histograms = (const Histogram **)calloc((size_t)count, sizeof(Histogram *));
+    char **owned = (char **)calloc((size_t)count, sizeof(char *));
+    Histogram *all = (Histogram *)malloc(2 * sizeof(Histogram));
+    if (!labels || !histograms || !owned || !all) {
+        fprintf(stderr, "Memory allocation for load report failed\n");
+        free(labels);
+        free(histograms);
+        free(owned);
+        free(all);
+        return;
+    }
+    histogram_init(&all[0]);
+    histogram_init(&all[1]);
+
+    unsigned long long completed = 0, errors = 0;
+    int n = 0;
+    for (int i = 0; i < gen->query_count; i++) {
+        const LoadQuery *query = &gen->queries[i];
+        completed += query->latency.total;
+        errors += query->errors;
+        histogram_merge(&all[0], &query->latency);
+        owned[n] = format_string("q%d", i + 1);
+        labels[n] = owned[n] ? owned[n] : "?";
+        histograms[n++] = &query->latency;
+        if (gen->qps > 0) {
+            histogram_merge(&all[1], &query->corrected);
+            owned[n] = format_string("q%d corrected", i + 1);
+            labels[n] = owned[n] ? owned[n] : "?";
+            histograms[n++] = &query->corrected;
+        }
+    }
+    labels[n] = "all";
+    histograms[n++] = &all[0];
+    if (gen->qps > 0) {
+        labels[n] = "all corrected";
+        histograms[n++] = &all[1];
+    }
+
+    print_latency_table(labels, histograms, n);
+    for (int i = 0; i < gen->query_count; i++) {
+        printf("q%d (weight %u, %llu errors): %.80s\n", i + 1, gen->queries[i].weight, gen->queries[i].errors,
+               gen->queries[i].sql);
+    }
+    printf("%llu queries in %.1f s, %.1f queries/s", completed, elapsed, elapsed > 0 ? completed / elapsed : 0.0);
+    if (gen->qps > 0) {
+        printf(" (target %.1f)", gen->qps);
+    }
+    printf(", %llu errors%s\n", errors, interrupted ? " (interrupted)" : "");
+
+    for (int i = 0; i < count; i++) {
+        free(owned[i]);
+    }
+    free(owned);
+    free(labels);
+    free(histograms);
+    free(all);
+}
+
+int run_loadgen(int argc, char *argv[], const char *program) {
+    unsigned long long concurrency = LOADGEN_DEFAULT_CONCURRENCY;
+    unsigned long long duration = LOADGEN_DEFAULT_DURATION;
+    double qps = 0;
+    const char *positional[2];
+    int positional_count = 0;
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--concurrency") == 0 && i + 1 < argc) {
+            if (parse_count_option(argv[i], argv[i + 1], &concurrency) != 0) return EXIT_FAILURE;
+            i++;
+        } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+            if (parse_count_option(argv[i], argv[i + 1], &duration) != 0) return EXIT_FAILURE;
+            i++;
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            if (parse_trace_option(argc, argv, &i) < 0) return EXIT_FAILURE;
+        } else if (strcmp(argv[i], "--qps") == 0 && i + 1 < argc) {
+            char *end = NULL;
+            qps = strtod(argv[++i], &end);
+            if (*end != '\0' || qps <= 0) {
+                fprintf(stderr, "--qps expects a positive rate\n");
+                return EXIT_FAILURE;
+            }
+        } else if (positional_count < 2 && strncmp(argv[i], "--", 2) != 0) {
+            positional[positional_count++] = argv[i];
+        } else {
+            positional_count = -1;
+            break;
+        }
+    }
+    if (positional_count != 2) {
+        fprintf(stderr, "Usage: %s loadgen [--concurrency N] [--qps rate] [--duration seconds] [--trace out.json] <preset> <mix_file>\n", program);
+        return EXIT_FAILURE;
+    }
+
+    LoadGen gen;
+    memset(&gen, 0, sizeof(gen));
+    gen.query_count = load_query_mix(positional[1], &gen.queries);
+    if (gen.query_count < 0) {
+        return EXIT_FAILURE;
+    }
+    int read_only = 1;
+    for (int i = 0; i < gen.query_count; i++) {
+        gen.total_weight += gen.queries[i].weight;
+        read_only = read_only && is_read_only_query(gen.queries[i].sql);
+    }
+
+    cJSON *config_json = load_config(CONFIG_PATH);
+    DbPreset db;
+    if (!config_json || route_db_preset(config_json, positional[0], read_only, &db) != 0) {
+        cJSON_Delete(config_json);
+        free_load_queries(gen.queries, gen.query_count);
+        return EXIT_FAILURE;
+    }
+    LoadWorker *workers = (LoadWorker *)calloc(concurrency, sizeof(LoadWorker));
+    if (!workers) {
+        fprintf(stderr, "Memory allocation for workers failed\n");
+        cJSON_Delete(config_json);
+        free_load_queries(gen.queries, gen.query_count);
+        return EXIT_FAILURE;
+    }
+
+    install_sigint_handler();
+    gen.db = &db;
+    gen.qps = qps;
+    gen.started = now_seconds();
+    gen.deadline = gen.started + (double)duration;
+    unsigned long long started_workers = 0;
+    for (; started_workers < concurrency; started_workers++) {
+        workers[started_workers].gen = &gen;
+        workers[started_workers].seed = (unsigned int)(time(NULL) ^ (started_workers * 2654435761u));
+        if (pthread_create(&workers[started_workers].thread, NULL, load_worker_main, &workers[started_workers]) != 0) {
+            fprintf(stderr, "Could not start load worker %llu\n", started_workers + 1);
+            break;
+        }
+    }
+    for (unsigned long long i = 0; i < started_workers; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    double elapsed = now_seconds() - gen.started;
+
+    int status = EXIT_SUCCESS;
+    if (gen.connected == 0) {
+        fprintf(stderr, "No load worker could connect\n");
+        status = EXIT_FAILURE;
+    } else {
+        print_load_report(&gen, elapsed);
+    }
+    free(workers);
+    cJSON_Delete(config_json);
+    free_load_queries(gen.queries, gen.query_count);
+    return status;
+}
+
+// ---- Query history ----
+// Every query run from the command line, printed, exported with --output or
+// run with --chunked-dml, appends one tab-separated line to HISTORY_PATH:
+//
+//     epoch  fingerprint_hash  preset  status  rows  bytes  connect_ms  execute_ms  fetch_ms  fingerprint
+//
+// The fingerprint is the query with comments dropped, literals replaced by
+// ?, lists of literals folded to (?+) and whitespace collapsed, so runs that
+// differ only in their values group together. Lines are written with a single
+// O_APPEND write, so concurrent runs do not interleave.
+#define HISTORY_FINGERPRINT_MAX 512
+#define FINGERPRINT_NO_SPACE_AFTER "(.=<>!,"
+#define FINGERPRINT_NO_SPACE_BEFORE ").=<>!,;"
+
+// Returns a malloc'd fingerprint of at most HISTORY_FINGERPRINT_MAX bytes
+char* query_fingerprint(const char *query) {
+    size_t cap = strlen(query) + 1;
+    char *out = (char *)malloc(cap);
+    if (!out) return NULL;
+    size_t len = 0;
+    int pending_space = 0;
+    const char *p = query;
+
+    while (*p) {
+        unsigned char c = (unsigned char)*p;
+        if (c == '/' && p[1] == '*') {
+            const char *end = strstr(p + 2, "*/");
+            p = end ? end + 2 : p + strlen(p);
+            c = ' ';
+        } else if ((c == '-' && p[1] == '-' && (p[2] == ' ' || p[2] == '\t')) || c == '#') {
+            while (*p && *p != '\n') p++;
+            c = ' ';
+        } else if (c == '\'' || c == '"') {
+            for (p++; *p; p++) {
+                if (*p == '\\' && p[1]) {
+                    p++;
+                } else if (*p == (char)c) {
+                    if (p[1] != (char)c) break;
+                    p++; // Doubled quote
+                }
+            }
+            if (*p) p++;
+            c = '?';
+        } else if (c == '`') {
+            const char *end = strchr(p + 1, '`');
+            size_t n = end ? (size_t)(end - p) + 1 : strlen(p);
+            if (pending_space && !strchr(FINGERPRINT_NO_SPACE_AFTER, out[len - 1])) out[len++] = ' ';
+            pending_space = 0;
+            memcpy(out + len, p, n);
+            len += n;
+            p += n;
+            continue;
+        } else if (isdigit(c) && !(pending_space == 0 && len > 0 && (isalnum((unsigned char)out[len - 1]) || out[len - 1] == '_'))) {
+            if (c == '0' && (p[1] == 'x' || p[1] == 'X')) p += 2;
+            while (isalnum((unsigned char)*p) || *p == '.' ||
+                   ((*p == '-' || *p == '+') && (p[-1] == 'e' || p[-1] == 'E'))) {
+                p++;
+            }
+            // A unary minus belongs to the literal
+            if (len >= 2 && out[len - 1] == '-' && strchr("=<>(,+-*/", out[len - 2])) len--;
+            c = '?';
+        } else {
+            p++;
+        }
+
+        if (isspace(c)) {
+            pending_space = len > 0;
+            continue;
+        }
+        // One space between words, none next to operators and punctuation,
+        // so "a = 1" and "a=1" fingerprint the same
+        if (pending_space && !strchr(FINGERPRINT_NO_SPACE_AFTER, out[len - 1]) &&
+            !strchr(FINGERPRINT_NO_SPACE_BEFORE, (char)c)) {
+            out[len++] = ' ';
+        }
+        pending_space = 0;
+        out[len++] = (char)tolower(c);
+    }
+    while (len > 0 && out[len - 1] == ';') len--;
+    out[len] = '\0';
+
+    // Fold "(?, ?, ?)" to "(?+)" and "(?+), (?+)" to "(?+)". "(?)" grows by
+    // one byte, so this pass writes to a second buffer.
+    char *folded = (char *)malloc(len * 2 + 5);
+    if (!folded) {
+        free(out);
+        return NULL;
+    }
+    size_t w = 0;
+    for (size_t r = 0; r < len;) {
+        if (out[r] == '(') {
+            size_t q = r + 1;
+            int literals = 0;
+            while (q < len && (out[q] == '?' || out[q] == ',' || out[q] == ' ')) {
+                literals += out[q] == '?';
+                q++;
+            }
+            if (q < len && out[q] == ')' && literals > 0) {
+                size_t back = w;
+                while (back > 0 && (folded[back - 1] == ' ' || folded[back - 1] == ',')) back--;
+                if (back >= 4 && memchr(folded + back, ',', w - back) && memcmp(folded + back - 4, "(?+)", 4) == 0) {
+                    w = back;
+                } else {
+                    memcpy(folded + w, "(?+)", 4);
+                    w += 4;
+                }
+                r = q + 1;
+                continue;
+            }
+        }
+        folded[w++] = out[r++];
+    }
+    free(out);
+    folded[w < HISTORY_FINGERPRINT_MAX ? w : HISTORY_FINGERPRINT_MAX] = '\0';
+    return folded;
+}
+
+unsigned long long fnv1a_hash(const char *text) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)text; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Best effort: a history file that cannot be written never fails the query.
+// `rows` is what the run fetched, exported or changed.
+void record_history(const char *preset, const char *query, int failed, unsigned long long rows,
+                    const QueryProfile *profile) {
+    char *fingerprint = query_fingerprint(query);
+    if (!fingerprint) return;
+    char *line = format_string("%lld\t%016llx\t%s\t%d\t%llu\t%llu\t%.3f\t%.3f\t%.3f\t%s\n", (long long)time(NULL),
+                               fnv1a_hash(fingerprint), preset, failed, rows,
+                               profile->bytes, profile->connect_seconds * 1000.0, profile->execute_seconds * 1000.0,
+                               profile->fetch_seconds * 1000.0, fingerprint);
+    free(fingerprint);
+    if (!line) return;
+    int fd = open(HISTORY_PATH, O_WRONLY | O_APPEND | O_CREAT, 0600);
+    if (fd >= 0) {
+        if (write(fd, line, strlen(line)) < 0) {
+            fprintf(stderr, "Could not append to %s: %s\n", HISTORY_PATH, strerror(errno));
+        }
+        close(fd);
+    }
+    free(line);
+}
+
+// `result` may be NULL for a query that failed outright
+void record_query_history(const char *preset, const char *query, const QueryResult *result) {
+    QueryProfile profile;
+    memset(&profile, 0, sizeof(profile));
+    if (result) {
+        profile = result->profile;
+    }
+    record_history(preset, query, !result || result->partial_reason != NULL, result ? result->rows_count : 0ULL,
+                   &profile);
+}
+
+typedef struct {
+    unsigned long long hash;
+    long long period; // Start of the reporting period, epoch seconds
+    int failed;
+    double total_ms; // connect + execute + fetch
+    long long rows;
+    const char *fingerprint; // Points into the loaded history text
+} HistoryRecord;
+
+int compare_history_records(const void *a, const void *b) {
+    const HistoryRecord *x = (const HistoryRecord *)a;
+    const HistoryRecord *y = (const HistoryRecord *)b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    if (x->period != y->period) return x->period < y->period ? -1 : 1;
+    if (x->failed != y->failed) return x->failed - y->failed;
+    return x->total_ms < y->total_ms ? -1 : x->total_ms > y->total_ms;
+}
+
+long long history_period_start(long long epoch, char unit) {
+    time_t t = (time_t)epoch;
+    struct tm tm;
+    localtime_r(&t, &tm);
+    tm.tm_sec = 0;
+    tm.tm_min = 0;
+    if (unit != 'h') {
+        tm.tm_hour = 0;
+    }
+    if (unit == 'w') {
+        tm.tm_mday -= tm.tm_wday;
+    }
+    tm.tm_isdst = -1;
+    return (long long)mktime(&tm);
+}
+
+// Nearest-rank percentile of an ascending array
+double sorted_percentile(const HistoryRecord *records, int count, double percentile) {
+    int rank = (int)(percentile / 100.0 * count + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > count) rank = count;
+    return records[rank - 1].total_ms;
+}
+
+void print_history_fingerprint(const HistoryRecord *records, int count, char unit) {
+    char cell[64];
+    ft_table_t *table = ft_create_table();
+    ft_set_cell_prop(table, FT_ANY_ROW, FT_ANY_COLUMN, FT_CPROP_TEXT_ALIGN, FT_ALIGNED_LEFT);
+    ft_set_cell_prop(table, 0, FT_ANY_COLUMN, FT_CPROP_ROW_TYPE, FT_ROW_HEADER);
+    const char *headers[] = {unit == 'h' ? "hour" : unit == 'w' ? "week of" : "day", "runs", "failed", "p50", "p95",
+                             "avg rows"};
+    for (size_t i = 0; i < sizeof(headers) / sizeof(headers[0]); i++) {
+        ft_u8write(table, headers[i]);
+    }
+    ft_ln(table);
+
+    double first_p50 = -1, last_p50 = -1;
+    for (int start = 0; start < count;) {
+        int end = start;
+        while (end < count && records[end].period == records[start].period) end++;
+        int ok = 0;
+        long long rows = 0;
+        while (start + ok < end && !records[start + ok].failed) {
+            rows += records[start + ok].rows;
+            ok++;
+        }
+
+        time_t period = (time_t)records[start].period;
+        struct tm tm;
+        localtime_r(&period, &tm);
+        strftime(cell, sizeof(cell), unit == 'h' ? "%Y-%m-%d %H:00" : "%Y-%m-%d", &tm);
+        ft_u8write(table, cell);
+        snprintf(cell, sizeof(cell), "%d", end - start);
+        ft_u8write(table, cell);
+        snprintf(cell, sizeof(cell), "%d", end - start - ok);
+        ft_u8write(table, cell);
+        if (ok > 0) {
+            double p50 = sorted_percentile(records + start, ok, 50);
+            if (first_p50 < 0) first_p50 = p50;
+            last_p50 = p50;
+            snprintf(cell, sizeof(cell), "%.1f ms", p50);
+            ft_u8write(table, cell);
+            snprintf(cell, sizeof(cell), "%.1f ms", sorted_percentile(records + start, ok, 95));
+            ft_u8write(table, cell);
+            snprintf(cell, sizeof(cell), "%lld", rows / ok);
+            ft_u8write(table, cell);
+        } else {
+            ft_u8write(table, "-");
+            ft_u8write(table, "-");
+            ft_u8write(table, "-");
+        }
+        ft_ln(table);
+        start = end;
+    }
+    printf("%s", (const char *)ft_to_u8string(table));
+    ft_destroy_table(table);
+    if (first_p50 > 0 && last_p50 >= 0) {
+        printf("p50 trend: %.1f ms -> %.1f ms (%+.0f%%)\n", first_p50, last_p50, (last_p50 / first_p50 - 1.0) * 100.0);
+    }
+    printf("\n");
+}
+
+int run_history(int argc, char *argv[], const char *program) {
+    const char *filter = NULL;
+    char unit = 'd';
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--period") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "hour") == 0 || strcmp(argv[i], "day") == 0 || strcmp(argv[i], "week") == 0) {
+                unit = argv[i][0];
+            } else {
+                fprintf(stderr, "--period expects hour, day or week\n");
+                return EXIT_FAILURE;
+            }
+        } else if (!filter && strncmp(argv[i], "--", 2) != 0) {
+            filter = argv[i];
+        } else {
+            fprintf(stderr, "Usage: %s --history [--period hour|day|week] [fingerprint substring or hash]\n", program);
+            return EXIT_FAILURE;
+        }
+    }
+
+    char *text = read_file(HISTORY_PATH);
+    if (!text) {
+        return EXIT_FAILURE;
+    }
+    HistoryRecord *records = NULL;
+    int count = 0, cap = 0;
+    char *save = NULL;
+    for (char *line = strtok_r(text, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        char *fields[10];
+        int n = 0;
+        for (char *p = line; n < 10; n++) {
+            fields[n] = p;
+            if (n == 9) break;
+            p = strchr(p, '\t');
+            if (!p) break;
+            *p++ = '\0';
+        }
+        if (n != 9) continue; // Malformed or truncated line
+        if (filter && !strstr(fields[9], filter) && strncmp(fields[1], filter, strlen(filter)) != 0) continue;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 1024;
+            HistoryRecord *grown = (HistoryRecord *)realloc(records, (size_t)cap * sizeof(HistoryRecord));
+            if (!grown) {
+                fprintf(stderr, "Memory allocation for history failed\n");
+                free(records);
+                free(text);
+                return EXIT_FAILURE;
+            }
+            records = grown;
+        }
+        HistoryRecord *record = &records[count++];
+        record->hash = strtoull(fields[1], NULL, 16);
+        record->period = history_period_start(strtoll(fields[0], NULL, 10), unit);
+        record->failed = atoi(fields[3]);
+        record->rows = strtoll(fields[4], NULL, 10);
+        record->total_ms = strtod(fields[6], NULL) + strtod(fields[7], NULL) + strtod(fields[8], NULL);
+        record->fingerprint = fields[9];
+    }
+
+    if (count == 0) {
+        printf("No history recorded%s\n", filter ? " for that filter" : "");
+    }
+    qsort(records, (size_t)count, sizeof(HistoryRecord), compare_history_records);
+    for (int start = 0; start < count;) {
+        int end = start;
+        while (end < count && records[end].hash == records[start].hash) end++;
+        printf("%016llx (%d runs): %.200s\n", records[start].hash, end - start, records[start].fingerprint);
+        print_history_fingerprint(records + start, end - start, unit);
+        start = end;
+    }
+    free(records);
+    free(text);
+    return EXIT_SUCCESS;
+}
+
+// ---- Microbenchmarks ----
+// `bench` times the CPU kernels of the fetch, print, import and export paths
+// on fixed synthetic input, without a database. The input is generated from
+// a fixed seed, so numbers are comparable between builds. Each sample is one
+// pass over the input. A case's prepare/cleanup hooks run outside the timed
+// region. The median over the samples is reported, with the median absolute
+// deviation as a noise estimate. Cycles come from the TSC where there is
+// one, so they count reference cycles rather than core cycles. Each case
+// also reports its own peak RSS: the kernel's high-water mark is reset
+// before the case runs.
+//
+// --baseline gates against results from the same host only, and a missing
+// baseline is an error rather than a pass. The gating machine records its own
+// numbers first with --record-baseline.
+#define BENCH_DEFAULT_ROWS 20000
+#define BENCH_DEFAULT_SAMPLES 15
+#define BENCH_COLS 8
+#define BENCH_TRUNCATE_WIDTH 20
+#define BENCH_DEFAULT_MAX_REGRESSION 10.0 // Percent, unless the baseline or --max-regression says otherwise
+
+typedef struct {
+    int rows_count;
+    int cols_count;
+    char **cells; // rows_count * cols_count, NULL for SQL NULL
+    unsigned long *lengths;
+    unsigned long long bytes; // Sum of the non-NULL cell lengths
+    char **copies; // Scratch for the cell copy benchmark
+    QueryResult *result; // Built by prepare hooks for teardown and size
+    Batch *csv; // The cells as CSV text
+    Batch *scratch;
+    Histogram *histogram;
+} BenchFixture;
+
+typedef struct {
+    const char *name;
+    // One pass; returns the items processed and sets *bytes to the bytes touched
+    unsigned long long (*run)(BenchFixture *fixture, unsigned long long *bytes);
+    int (*prepare)(BenchFixture *fixture); // Optional, untimed, before every pass
+    void (*cleanup)(BenchFixture *fixture); // Optional, untimed, after every pass
+} BenchCase;
+
+typedef struct {
+    const char *name;
+    unsigned long long items; // Per pass
+    unsigned long long bytes; // Per pass
+    int samples;
+    double ns_per_item; // Median
+    double ci_low; // 95% confidence interval of the median
+    double ci_high;
+    double mad_percent; // Median absolute deviation relative to the median
+    double cycles_per_byte; // Median, 0 without a TSC or without bytes
+    long peak_rss_kb; // Peak RSS while the case ran, -1 when unknown
+} BenchResult;
+
+volatile unsigned long long bench_sink;
+
+unsigned long long bench_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+unsigned long long bench_random(unsigned long long *state) {
+    // xorshift64
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+void bench_fixture_free(BenchFixture *fixture) {
+    for (int i = 0; i < fixture->rows_count * fixture->cols_count; i++) {
+        free(fixture->cells ? fixture->cells[i] : NULL);
+    }
+    free(fixture->cells);
+    free(fixture->lengths);
+    free(fixture->copies);
+    free_query_result(fixture->result);
+    batch_free(fixture->csv);
+    batch_free(fixture->scratch);
+    free(fixture->histogram);
+    memset(fixture, 0, sizeof(*fixture));
+}
+
+// Rows shaped like a typical call log table: an id, a name, a decimal, a
+// datetime, free text with quotes, commas and the odd newline, a mostly
+// NULL column, a phone number and a small int.
+int bench_fixture_init(BenchFixture *fixture, int rows_count) {
+    static const char text_chars[] = "abcdefghijklmnopqrstuvwxyz ABCDEFGHIJ,\"0123456789 ";
+    unsigned long long state = 0x9E3779B97F4A7C15ULL;
+    char cell[160];
+
+    memset(fixture, 0, sizeof(*fixture));
+    fixture->rows_count = rows_count;
+    fixture->cols_count = BENCH_COLS;
+    size_t cells_count = (size_t)rows_count * BENCH_COLS;
+    fixture->cells = (char **)calloc(cells_count, sizeof(char *));
+    fixture->lengths = (unsigned long *)calloc(cells_count, sizeof(unsigned long));
+    fixture->copies = (char **)calloc(cells_count, sizeof(char *));
+    fixture->csv = batch_new(cells_count * 24);
+    fixture->scratch = batch_new(4096);
+    fixture->histogram = (Histogram *)malloc(sizeof(Histogram));
+    if (!fixture->cells || !fixture->lengths || !fixture->copies || !fixture->csv || !fixture->scratch ||
+        !fixture->histogram) {
+        fprintf(stderr, "Memory allocation for benchmark input failed\n");
+        bench_fixture_free(fixture);
+        return -1;
+    }
+
+    for (int r = 0; r < rows_count; r++) {
+        for (int c = 0; c < BENCH_COLS; c++) {
+            unsigned long long x = bench_random(&state);
+            int len = 0;
+            switch (c) {
+                case 0: len = snprintf(cell, sizeof(cell), "%d", r + 1); break;
+                case 1:
+                    len = 5 + (int)(x % 11);
+                    for (int i = 0; i < len; i++) cell[i] = (char)('a' + (x >> (i % 50)) % 26);
+                    break;
+                case 2: len = snprintf(cell, sizeof(cell), "%llu.%02llu", x % 100000, (x >> 20) % 100); break;
+                case 3:
+                    len = snprintf(cell, sizeof(cell), "2026-%02llu-%02llu %02llu:%02llu:%02llu", x % 12 + 1,
+                                   (x >> 8) % 28 + 1, (x >> 16) % 24, (x >> 24) % 60, (x >> 32) % 60);
+                    break;
+                case 4:
+                    len = 20 + (int)(x % 100);
+                    for (int i = 0; i < len; i++) {
+                        cell[i] = text_chars[bench_random(&state) % (sizeof(text_chars) - 1)];
+                    }
+                    if (x % 50 == 0) cell[len / 2] = '\n';
+                    break;
+                case 5: len = x % 10 < 7 ? -1 : snprintf(cell, sizeof(cell), "%llu", x % 1000); break;
+                case 6: len = snprintf(cell, sizeof(cell), "9%09llu", x % 1000000000ULL); break;
+                default: len = snprintf(cell, sizeof(cell), "%llu", x % 8); break;
+            }
+            size_t index = (size_t)r * BENCH_COLS + c;
+            if (len >= 0) {
+                cell[len] = '\0';
+                fixture->cells[index] = strdup(cell);
+                if (!fixture->cells[index]) {
+                    fprintf(stderr, "Memory allocation for benchmark input failed\n");
+                    bench_fixture_free(fixture);
+                    return -1;
+                }
+                fixture->lengths[index] = (unsigned long)len;
+                fixture->bytes += (unsigned long long)len;
+            }
+            const char *value = fixture->cells[index];
+            if (append_csv_field(fixture->csv, value, value ? fixture->lengths[index] : 0,
+                                 c + 1 == BENCH_COLS ? '\n' : ',') != 0) {
+                bench_fixture_free(fixture);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+unsigned long long bench_cell_copy(BenchFixture *fixture, unsigned long long *bytes) {
+    for (int r = 0; r < fixture->rows_count; r++) {
+        size_t offset = (size_t)r * fixture->cols_count;
+        if (copy_row_cells(fixture->copies + offset, NULL, (MYSQL_ROW)(fixture->cells + offset), fixture->lengths + offset,
+                           fixture->cols_count) != 0) {
+            memset(fixture->copies + offset, 0, fixture->cols_count * sizeof(char *));
+        }
+    }
+    *bytes = fixture->bytes;
+    return (unsigned long long)fixture->rows_count * fixture->cols_count;
+}
+
+void bench_cell_copy_cleanup(BenchFixture *fixture) {
+    for (int i = 0; i < fixture->rows_count * fixture->cols_count; i++) {
+        free(fixture->copies[i]);
+        fixture->copies[i] = NULL;
+    }
+}
+
+// A QueryResult holding the fixture's cells, as execute_mysql_query builds it
+int bench_build_result(BenchFixture *fixture) {
+    if (fixture->result) return 0;
+    QueryResult *result = (QueryResult *)calloc(1, sizeof(QueryResult));
+    if (!result) return -1;
+    int cols = fixture->cols_count;
+    result->cols_count = cols;
+    result->headers = (char **)calloc(cols, sizeof(char *));
+    result->mysql_types = (char **)calloc(cols, sizeof(char *));
+    result->c_types = (char **)calloc(cols, sizeof(char *));
+    if (!result->headers || !result->mysql_types || !result->c_types) {
+        free_query_result(result);
+        return -1;
+    }
+    for (int i = 0; i < cols; i++) {
+        result->headers[i] = format_string("column_%d", i + 1);
+        result->mysql_types[i] = strdup("VARCHAR");
+        result->c_types[i] = strdup("char*");
+        if (!result->headers[i] || !result->mysql_types[i] || !result->c_types[i]) {
+            free_query_result(result);
+            return -1;
+        }
+    }
+    for (int r = 0; r < fixture->rows_count; r++) {
+        size_t offset = (size_t)r * cols;
+        char **cells = query_result_append_row(result);
+        if (!cells || copy_row_cells(cells, query_result_lengths(result, result->rows_count),
+                                     (MYSQL_ROW)(fixture->cells + offset), fixture->lengths + offset, cols) != 0) {
+            free_query_result(result);
+            return -1;
+        }
+        result->rows_count++;
+    }
+    fixture->result = result;
+    return 0;
+}
+
+unsigned long long bench_free_result(BenchFixture *fixture, unsigned long long *bytes) {
+    unsigned long long cells = (unsigned long long)fixture->result->rows_count * fixture->result->cols_count;
+    free_query_result(fixture->result);
+    fixture->result = NULL;
+    *bytes = 0;
+    return cells;
+}
+
+unsigned long long bench_truncate(BenchFixture *fixture, unsigned long long *bytes) {
+    char buffer[BENCH_TRUNCATE_WIDTH + 1];
+    unsigned long long items = 0, sum = 0;
+    *bytes = 0;
+    for (int i = 0; i < fixture->rows_count * fixture->cols_count; i++) {
+        const char *value = fixture->cells[i] ? fixture->cells[i] : "NULL";
+        safe_strncpy(buffer, value, BENCH_TRUNCATE_WIDTH);
+        sum += (unsigned char)buffer[0];
+        *bytes += fixture->cells[i] ? fixture->lengths[i] : 4;
+        items++;
+    }
+    bench_sink += sum;
+    return items;
+}
+
+unsigned long long bench_result_size(BenchFixture *fixture, unsigned long long *bytes) {
+    bench_sink += query_result_size(fixture->result);
+    *bytes = fixture->bytes;
+    return (unsigned long long)fixture->result->rows_count * fixture->result->cols_count;
+}
+
+unsigned long long bench_type_mapping(BenchFixture *fixture, unsigned long long *bytes) {
+    static const enum enum_field_types types[] = {
+        MYSQL_TYPE_LONG, MYSQL_TYPE_VAR_STRING, MYSQL_TYPE_NEWDECIMAL, MYSQL_TYPE_DATETIME,
+        MYSQL_TYPE_BLOB, MYSQL_TYPE_LONGLONG, MYSQL_TYPE_STRING, MYSQL_TYPE_TINY,
+    };
+    unsigned long long items = (unsigned long long)fixture->rows_count * fixture->cols_count;
+    uintptr_t sum = 0;
+    for (unsigned long long i = 0; i < items; i++) {
+        TypeMapping mapping = mysql_type_to_c_type(types[i % (sizeof(types) / sizeof(types[0]))]);
+        sum += (uintptr_t)mapping.c_type;
+    }
+    bench_sink += sum;
+    *bytes = 0;
+    return items;
+}
+
+unsigned long long bench_fingerprint(BenchFixture *fixture, unsigned long long *bytes) {
+    static const char *queries[] = {
+        "SELECT * FROM recentincomingcalls WHERE caller = '9876543210' AND created_at > '2026-01-01' LIMIT 50",
+        "select id, name from users where id in (1, 2, 3, 4, 5, 6, 7, 8) /* dashboard */",
+        "INSERT INTO events (a, b, c) VALUES (1, 'x', 2.5), (2, 'y', -3.5), (3, 'it''s', 4e10)",
+        "UPDATE accounts SET balance = balance - 100 WHERE id = 42 -- transfer\n",
+    };
+    unsigned long long items = (unsigned long long)fixture->rows_count / 4;
+    *bytes = 0;
+    for (unsigned long long i = 0; i < items; i++) {
+        const char *query = queries[i % (sizeof(queries) / sizeof(queries[0]))];
+        char *fingerprint = query_fingerprint(query);
+        bench_sink += fingerprint ? (unsigned char)fingerprint[0] : 0;
+        free(fingerprint);
+        *bytes += strlen(query);
+    }
+    return items;
+}
+
+// Cells formatted as CSV (append_csv_field) or JSON strings (append_json_string)
+unsigned long long bench_format(BenchFixture *fixture, unsigned long long *bytes, int json) {
+    Batch *line = fixture->scratch;
+    unsigned long long out = 0;
+    for (int r = 0; r < fixture->rows_count; r++) {
+        line->len = 0;
+        for (int c = 0; c < fixture->cols_count; c++) {
+            size_t index = (size_t)r * fixture->cols_count + c;
+            const char *value = fixture->cells[index];
+            unsigned long len = value ? fixture->lengths[index] : 0;
+            if (json) {
+                append_json_string(line, value ? value : "", len);
+            } else {
+                append_csv_field(line, value, len, c + 1 == fixture->cols_count ? '\n' : ',');
+            }
+        }
+        out += line->len;
+    }
+    bench_sink += out;
+    *bytes = fixture->bytes;
+    return (unsigned long long)fixture->rows_count * fixture->cols_count;
+}
+
+unsigned long long bench_csv_format(BenchFixture *fixture, unsigned long long *bytes) {
+    return bench_format(fixture, bytes, 0);
+}
+
+unsigned long long bench_json_format(BenchFixture *fixture, unsigned long long *bytes) {
+    return bench_format(fixture, bytes, 1);
+}
+
+// Chunk boundaries as import finds them, at 64 KiB targets
+unsigned long long bench_csv_scan(BenchFixture *fixture, unsigned long long *bytes) {
+    const char *data = fixture->csv->data;
+    size_t size = fixture->csv->len;
+    size_t start = 0, scanned = 0;
+    int in_quotes = 0;
+    unsigned long long chunks = 0;
+    while (start < size) {
+        size_t target = start + 65536 < size ? start + 65536 : size;
+        size_t end = scan_csv_boundary(data, size, scanned, target, &in_quotes);
+        scanned = end;
+        start = end;
+        chunks++;
+    }
+    bench_sink += chunks;
+    *bytes = size;
+    return size;
+}
+
+unsigned long long bench_histogram(BenchFixture *fixture, unsigned long long *bytes) {
+    histogram_init(fixture->histogram);
+    unsigned long long items = (unsigned long long)fixture->rows_count * fixture->cols_count;
+    for (unsigned long long i = 0; i < items; i++) {
+        histogram_record(fixture->histogram, fixture->lengths[i] * 997 + i % 1000);
+    }
+    bench_sink += histogram_percentile(fixture->histogram, 99);
+    *bytes = 0;
+    return items;
+}
+
+static const BenchCase bench_cases[] = {
+    {"cell copy", bench_cell_copy, NULL, bench_cell_copy_cleanup},
+    {"free_query_result", bench_free_result, bench_build_result, NULL},
+    {"safe_strncpy", bench_truncate, NULL, NULL},
+    {"result size", bench_result_size, bench_build_result, NULL},
+    {"type mapping", bench_type_mapping, NULL, NULL},
+    {"fingerprint", bench_fingerprint, NULL, NULL},
+    {"csv format", bench_csv_format, NULL, NULL},
+    {"json format", bench_json_format, NULL, NULL},
+    {"csv scan", bench_csv_scan, NULL, NULL},
+    {"histogram record", bench_histogram, NULL, NULL},
+};
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+double median_of(double *values, int count) {
+    qsort(values, (size_t)count, sizeof(double), compare_doubles);
+    return count % 2 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2.0;
+}
+
+// Writing 5 to clear_refs resets VmHWM to the current RSS (Linux 4.0+)
+int bench_reset_peak_rss(void) {
+    FILE *file = fopen("/proc/self/clear_refs", "w");
+    if (!file) {
+        return -1;
+    }
+    int ok = fputs("5", file) >= 0;
+    return fclose(file) == 0 && ok ? 0 : -1;
+}
+
+long bench_peak_rss_kb(void) {
+    FILE *file = fopen("/proc/self/status", "r");
+    char line[256];
+    long peak = -1;
+    while (file && fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "VmHWM: %ld kB", &peak) == 1) {
+            break;
+        }
+    }
+    if (file) fclose(file);
+    return peak;
+}
+
+// Identifies the machine a baseline was recorded on: host name and CPU model
+void bench_host(char *out, size_t size) {
+    char name[256] = "unknown", model[256] = "";
+    gethostname(name, sizeof(name) - 1);
+    FILE *file = fopen("/proc/cpuinfo", "r");
+    char line[512];
+    while (file && fgets(line, sizeof(line), file)) {
+        char *colon = strchr(line, ':');
+        if (colon && strncmp(line, "model name", 10) == 0) {
+            snprintf(model, sizeof(model), "%s", skip_space(colon + 1));
+            model[strcspn(model, "\n")] = '\0';
+            break;
+        }
+    }
+    if (file) fclose(file);
+    snprintf(out, size, "%s, %s", name, model[0] ? model : "unknown CPU");
+    for (char *p = out; *p; p++) {
+        if (*p == '"' || *p == '\\' || (unsigned char)*p < 0x20) *p = ' '; // Stays a plain JSON string
+    }
+}
+
+int bench_run_case(const BenchCase *bench, BenchFixture *fixture, int samples, BenchResult *out) {
+    double *ns = (double *)calloc((size_t)samples * 3, sizeof(double));
+    if (!ns) {
+        fprintf(stderr, "Memory allocation for benchmark samples failed\n");
+        return -1;
+    }
+    double *cycles = ns + samples;
+    double *deviations = cycles + samples;
+    memset(out, 0, sizeof(*out));
+    out->name = bench->name;
+    out->samples = samples;
+    int rss_reset = bench_reset_peak_rss() == 0;
+
+    // The first pass only warms caches and the allocator
+    for (int s = -1; s < samples; s++) {
+        if (bench->prepare && bench->prepare(fixture) != 0) {
+            fprintf(stderr, "Could not prepare benchmark %s\n", bench->name);
+            free(ns);
+            return -1;
+        }
+        unsigned long long bytes = 0;
+        double started = now_seconds();
+        unsigned long long cycles_started = bench_cycles();
+        unsigned long long items = bench->run(fixture, &bytes);
+        unsigned long long cycles_spent = bench_cycles() - cycles_started;
+        double elapsed = now_seconds() - started;
+        if (bench->cleanup) {
+            bench->cleanup(fixture);
+        }
+        if (s < 0) continue;
+        out->items = items;
+        out->bytes = bytes;
+        ns[s] = items ? elapsed * 1e9 / (double)items : 0;
+        cycles[s] = bytes ? (double)cycles_spent / (double)bytes : 0;
+    }
+
+    out->ns_per_item = median_of(ns, samples);
+    // Distribution-free interval for the median from the order statistics:
+    // ranks n/2 -+ 0.98 sqrt(n), which covers it with ~95% probability
+    int spread = 0;
+    while ((double)spread * spread < 0.9604 * samples) spread++;
+    int low = samples / 2 - spread;
+    int high = (samples + 1) / 2 + spread;
+    out->ci_low = ns[low < 0 ? 0 : low];
+    out->ci_high = ns[high >= samples ? samples - 1 : high];
+    out->cycles_per_byte = median_of(cycles, samples);
+    for (int s = 0; s < samples; s++) {
+        double d = ns[s] - out->ns_per_item;
+        deviations[s] = d < 0 ? -d : d;
+    }
+    out->mad_percent = out->ns_per_item > 0 ? median_of(deviations, samples) / out->ns_per_item * 100.0 : 0;
+    out->peak_rss_kb = rss_reset ? bench_peak_rss_kb() : -1;
+    free(ns);
+    return 0;
+}
+
+void print_bench_results(const BenchResult *results, int count) {
+    static const char *headers[] = {"benchmark", "items/pass", "p50 ns/item", "noise", "cycles/byte", "peak RSS"};
+    char cell[32];
+    ft_table_t *table = ft_create_table();
+    ft_set_cell_prop(table, FT_ANY_ROW, FT_ANY_COLUMN, FT_CPROP_TEXT_ALIGN, FT_ALIGNED_LEFT);
+    ft_set_cell_prop(table, 0, FT_ANY_COLUMN, FT_CPROP_ROW_TYPE, FT_ROW_HEADER);
+    for (size_t i = 0; i < sizeof(headers) / sizeof(headers[0]); i++) {
+        ft_u8write(table, headers[i]);
+    }
+    ft_ln(table);
+    for (int i = 0; i < count; i++) {
+        ft_u8write(table, results[i].name);
+        snprintf(cell, sizeof(cell), "%llu", results[i].items);
+        ft_u8write(table, cell);
+        snprintf(cell, sizeof(cell), "%.2f", results[i].ns_per_item);
+        ft_u8write(table, cell);
+        snprintf(cell, sizeof(cell), "+-%.1f%%", results[i].mad_percent);
+        ft_u8write(table, cell);
+        if (results[i].cycles_per_byte > 0) {
+            snprintf(cell, sizeof(cell), "%.3f", results[i].cycles_per_byte);
+        } else {
+            snprintf(cell, sizeof(cell), "-");
+        }
+        ft_u8write(table, cell);
+        if (results[i].peak_rss_kb >= 0) {
+            snprintf(cell, sizeof(cell), "%ld KB", results[i].peak_rss_kb);
+        } else {
+            snprintf(cell, sizeof(cell), "-");
+        }
+        ft_u8write(table, cell);
+        ft_ln(table);
+    }
+    printf("%s", (const char *)ft_to_u8string(table));
+    ft_destroy_table(table);
+}
+
+// Machine-readable results for `bench --json`, in the same shape the
+// baseline is read back from
+int write_bench_json(const char *path, const BenchResult *results, int count, unsigned long long rows,
+                     unsigned long long samples) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    char host[512];
+    bench_host(host, sizeof(host));
+    fprintf(file, "{\n  \"host\": \"%s\",\n  \"rows\": %llu,\n  \"columns\": %d,\n  \"samples\": %llu,\n",
+            host, rows, BENCH_COLS, samples);
+    fprintf(file, "  \"benchmarks\": [\n");
+    for (int i = 0; i < count; i++) {
+        const BenchResult *r = &results[i];
+        fprintf(file,
+                "    {\"name\": \"%s\", \"items_per_pass\": %llu, \"bytes_per_pass\": %llu, \"ns_per_item\": %.4f, "
+                "\"ci_low\": %.4f, \"ci_high\": %.4f, \"mad_percent\": %.2f, \"items_per_sec\": %.0f, "
+                "\"cycles_per_byte\": %.4f, \"peak_rss_kb\": %ld}%s\n",
+                r->name, r->items, r->bytes, r->ns_per_item, r->ci_low, r->ci_high, r->mad_percent,
+                r->ns_per_item > 0 ? 1e9 / r->ns_per_item : 0.0, r->cycles_per_byte, r->peak_rss_kb,
+                i + 1 < count ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    if (fclose(file) != 0) {
+        fprintf(stderr, "Could not write %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Reads the benchmarks array of a baseline written by --json. Names and
+// *host point into *json_out, which the caller deletes. Returns the count or
+// -1.
+int load_bench_baseline(const char *path, cJSON **json_out, BenchResult **out, double *max_regression,
+                        const char **host) {
+    char *text = read_file(path);
+    if (!text) {
+        return -1;
+    }
+    cJSON *json = cJSON_Parse(text);
+    free(text);
+    cJSON *benchmarks = json ? cJSON_GetObjectItemCaseSensitive(json, "benchmarks") : NULL;
+    if (!cJSON_IsArray(benchmarks)) {
+        fprintf(stderr, "%s is not a benchmark baseline\n", path);
+        cJSON_Delete(json);
+        return -1;
+    }
+    cJSON *threshold = cJSON_GetObjectItemCaseSensitive(json, "max_regression_percent");
+    if (cJSON_IsNumber(threshold)) {
+        *max_regression = threshold->valuedouble;
+    }
+    cJSON *recorded_on = cJSON_GetObjectItemCaseSensitive(json, "host");
+    *host = cJSON_IsString(recorded_on) ? recorded_on->valuestring : NULL;
+
+    BenchResult *results = (BenchResult *)calloc((size_t)cJSON_GetArraySize(benchmarks) + 1, sizeof(BenchResult));
+    if (!results) {
+        fprintf(stderr, "Memory allocation for baseline failed\n");
+        cJSON_Delete(json);
+        return -1;
+    }
+    int count = 0;
+    cJSON *entry;
+    cJSON_ArrayForEach(entry, benchmarks) {
+        cJSON *name = cJSON_GetObjectItemCaseSensitive(entry, "name");
+        cJSON *median = cJSON_GetObjectItemCaseSensitive(entry, "ns_per_item");
+        cJSON *low = cJSON_GetObjectItemCaseSensitive(entry, "ci_low");
+        cJSON *high = cJSON_GetObjectItemCaseSensitive(entry, "ci_high");
+        cJSON *rss = cJSON_GetObjectItemCaseSensitive(entry, "peak_rss_kb");
+        if (!cJSON_IsString(name) || !cJSON_IsNumber(median)) {
+            continue;
+        }
+        results[count].name = name->valuestring;
+        results[count].ns_per_item = median->valuedouble;
+        results[count].ci_low = cJSON_IsNumber(low) ? low->valuedouble : median->valuedouble;
+        results[count].ci_high = cJSON_IsNumber(high) ? high->valuedouble : median->valuedouble;
+        results[count].peak_rss_kb = cJSON_IsNumber(rss) ? (long)rss->valuedouble : -1;
+        count++;
+    }
+    *json_out = json;
+    *out = results;
+    return count;
+}
+
+// A benchmark regresses when its median (p50) is more than max_regression
+// percent slower than the baseline and the two confidence intervals do not
+// overlap, so a noisy run alone cannot fail the gate. Its peak RSS regresses
+// when it grows by more than max_regression percent. Returns the count of
+// benchmarks that regressed either way.
+int compare_bench_results(const BenchResult *baseline, int baseline_count, const BenchResult *results, int count,
+                          double max_regression) {
+    static const char *headers[] = {"benchmark", "baseline p50 ns/item", "current p50 ns/item", "change",
+                                    "peak RSS", "verdict"};
+    char cell[48];
+    int regressions = 0;
+
+    ft_table_t *table = ft_create_table();
+    ft_set_cell_prop(table, FT_ANY_ROW, FT_ANY_COLUMN, FT_CPROP_TEXT_ALIGN, FT_ALIGNED_LEFT);
+    ft_set_cell_prop(table, 0, FT_ANY_COLUMN, FT_CPROP_ROW_TYPE, FT_ROW_HEADER);
+    for (size_t i = 0; i < sizeof(headers) / sizeof(headers[0]); i++) {
+        ft_u8write(table, headers[i]);
+    }
+    ft_ln(table);
+
+    for (int b = 0; b < baseline_count; b++) {
+        const BenchResult *base = &baseline[b];
+        const BenchResult *current = NULL;
+        for (int i = 0; i < count; i++) {
+            if (strcmp(results[i].name, base->name) == 0) current = &results[i];
+        }
+        if (!current) continue; // Filtered out of this run
+        double change = base->ns_per_item > 0 ? (current->ns_per_item / base->ns_per_item - 1.0) * 100.0 : 0;
+        double rss_change = base->peak_rss_kb > 0 && current->peak_rss_kb >= 0
+            ? ((double)current->peak_rss_kb / (double)base->peak_rss_kb - 1.0) * 100.0 : 0;
+        int rss_regressed = rss_change > max_regression;
+        const char *verdict = "ok";
+        if (change > max_regression && current->ci_low > base->ci_high) {
+            verdict = rss_regressed ? "REGRESSION, RSS REGRESSION" : "REGRESSION";
+        } else if (rss_regressed) {
+            verdict = "RSS REGRESSION";
+        } else if (change > max_regression) {
+            verdict = "slower, within noise";
+        } else if (change < -max_regression && current->ci_high < base->ci_low) {
+            verdict = "faster";
+        }
+        ft_u8write(table, base->name);
+        snprintf(cell, sizeof(cell), "%.2f [%.2f, %.2f]", base->ns_per_item, base->ci_low, base->ci_high);
+        ft_u8write(table, cell);
+        snprintf(cell, sizeof(cell), "%.2f [%.2f, %.2f]", current->ns_per_item, current->ci_low, current->ci_high);
+        ft_u8write(table, cell);
+        if (strstr(verdict, "REGRESSION")) {
+            regressions++;
+        }
+        snprintf(cell, sizeof(cell), "%+.1f%%", change);
+        ft_u8write(table, cell);
+        if (base->peak_rss_kb > 0 && current->peak_rss_kb >= 0) {
+            snprintf(cell, sizeof(cell), "%ld -> %ld KB (%+.1f%%)", base->peak_rss_kb, current->peak_rss_kb, rss_change);
+        } else {
+            snprintf(cell, sizeof(cell), "-");
+        }
+        ft_u8write(table, cell);
+        ft_u8write(table, verdict);
+        ft_ln(table);
+    }
+    printf("%s", (const char *)ft_to_u8string(table));
+    ft_destroy_table(table);
+    printf("%d regression%s beyond %.1f%%\n", regressions, regressions == 1 ? "" : "s", max_regression);
+    return regressions;
+}
+
+int run_bench(int argc, char *argv[], const char *program) {
+    unsigned long long rows = BENCH_DEFAULT_ROWS;
+    unsigned long long samples = BENCH_DEFAULT_SAMPLES;
+    const char *filter = NULL;
+    const char *json_path = NULL;
+    const char *baseline_path = NULL;
+    const char *record_path = NULL;
+    double max_regression = -1;
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--rows") == 0 && i + 1 < argc) {
+            if (parse_count_option(argv[i], argv[i + 1], &rows) != 0) return EXIT_FAILURE;
+            i++;
+        } else if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+            if (parse_count_option(argv[i], argv[i + 1], &samples) != 0) return EXIT_FAILURE;
+            i++;
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json_path = argv[++i];
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baseline_path = argv[++i];
+        } else if (strcmp(argv[i], "--record-baseline") == 0 && i + 1 < argc) {
+            record_path = argv[++i];
+        } else if (strcmp(argv[i], "--max-regression") == 0 && i + 1 < argc) {
+            char *end = NULL;
+            max_regression = strtod(argv[++i], &end);
+            if (*end != '\0' || max_regression < 0) {
+                fprintf(stderr, "--max-regression expects a percentage\n");
+                return EXIT_FAILURE;
+            }
+        } else {
+            fprintf(stderr, "Usage: %s bench [--filter name] [--rows N] [--samples N] [--json out.json] [--baseline file [--max-regression pct] | --record-baseline file]\n", program);
+            return EXIT_FAILURE;
+        }
+    }
+    if (baseline_path && record_path) {
+        fprintf(stderr, "--baseline and --record-baseline cannot be combined\n");
+        return EXIT_FAILURE;
+    }
+    if (baseline_path && access(baseline_path, F_OK) != 0) {
+        fprintf(stderr, "No baseline at %s: %s. Record one on this host with --record-baseline.\n", baseline_path,
+                strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (rows > 10000000 || samples > 1000) {
+        fprintf(stderr, "--rows is limited to 10000000 and --samples to 1000\n");
+        return EXIT_FAILURE;
+    }
+
+    BenchFixture fixture;
+    if (bench_fixture_init(&fixture, (int)rows) != 0) {
+        return EXIT_FAILURE;
+    }
+    int cases = (int)(sizeof(bench_cases) / sizeof(bench_cases[0]));
+    BenchResult results[sizeof(bench_cases) / sizeof(bench_cases[0])];
+    int count = 0, status = EXIT_SUCCESS;
+    for (int i = 0; i < cases; i++) {
+        if (filter && !strstr(bench_cases[i].name, filter)) continue;
+        if (bench_run_case(&bench_cases[i], &fixture, (int)samples, &results[count]) != 0) {
+            status = EXIT_FAILURE;
+            break;
+        }
+        count++;
+    }
+    if (count > 0) {
+        print_bench_results(results, count);
+        printf("%llu rows x %d columns, %llu samples per benchmark\n", rows, BENCH_COLS, samples);
+        if (json_path && write_bench_json(json_path, results, count, rows, samples) != 0) {
+            status = EXIT_FAILURE;
+        }
+        if (record_path) {
+            if (write_bench_json(record_path, results, count, rows, samples) != 0) {
+                status = EXIT_FAILURE;
+            } else {
+                printf("Recorded this run as the baseline in %s\n", record_path);
+            }
+        } else if (baseline_path) {
+            cJSON *baseline_json = NULL;
+            BenchResult *baseline = NULL;
+            double threshold = BENCH_DEFAULT_MAX_REGRESSION;
+            const char *baseline_host = NULL;
+            char host[512];
+            bench_host(host, sizeof(host));
+            int baseline_count = load_bench_baseline(baseline_path, &baseline_json, &baseline, &threshold, &baseline_host);
+            if (max_regression >= 0) {
+                threshold = max_regression;
+            }
+            if (baseline_count >= 0 && (!baseline_host || strcmp(baseline_host, host) != 0)) {
+                fprintf(stderr, "%s was recorded on %s, not on this host (%s). Record a baseline here with --record-baseline.\n",
+                        baseline_path, baseline_host ? baseline_host : "an unknown host", host);
+                status = EXIT_FAILURE;
+            } else if (baseline_count < 0 ||
+                       compare_bench_results(baseline, baseline_count, results, count, threshold) > 0) {
+                status = EXIT_FAILURE;
+            }
+            free(baseline);
+            cJSON_Delete(baseline_json);
+        }
+    } else if (status == EXIT_SUCCESS) {
+        fprintf(stderr, "No benchmark matches '%s'\n", filter);
+        status = EXIT_FAILURE;
+    }
+    bench_fixture_free(&fixture);
+    return status;
+}
+
+void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [--timeout seconds] [--server-stats] [--perf-counters] [--trace out.json] [--repeat N [--warmup M]] [--output file|shm:name[:MB]|preview|stats ... [--partition-output column] [--max-file-size MB]] [--chunked-dml [--chunk-size N] [--sleep-ms N] [--target-ms N] [--key column]] [throttle options] <preset_name> <query>\n", program);
+    fprintf(stderr, "       %s copy [--workers N] [--rows-per-load N] [--trace out.json] [throttle options] <src_preset> <dst_preset> <query> <table>\n", program);
+    fprintf(stderr, "       %s import [--format csv|tsv|ndjson] [--workers N] [--batch-size MB] [--retries N] [--no-header] [--trace out.json] <preset> <file> <table>\n", program);
+    fprintf(stderr, "       %s archive [--chunk-size N] [--sleep-ms N] [--key column] [--checkpoint file] [--trace out.json] [throttle options] <preset> <table> <predicate> <out.rgwc>\n", program);
+    fprintf(stderr, "       %s extract [--where predicate] [--key column] [--page-size N] [--retries N] [--checkpoint file] [--trace out.json] [throttle options] <preset> <table> <out.csv|.tsv|.ndjson|.rgwc>\n", program);
+    fprintf(stderr, "       %s --history [--period hour|day|week] [filter]\n", program);
+    fprintf(stderr, "       %s loadgen [--concurrency N] [--qps rate] [--duration seconds] [--trace out.json] <preset> <mix_file>\n", program);
+    fprintf(stderr, "       %s bench [--filter name] [--rows N] [--samples N] [--json out.json] [--baseline file [--max-regression pct] | --record-baseline file]\n", program);
+    fprintf(stderr, "Throttle options: --max-rows-per-sec N --max-bytes-per-sec N --max-threads-running N --max-replica-lag S --monitor-preset name\n");
+}
+
+// Options accepted in front of <preset_name> <query>
+typedef struct {
+    int chunked_dml;
+    unsigned long long chunk_size;
+    unsigned long long sleep_ms;
+    unsigned long long target_ms;
+    const char *key_column;
+    ThrottleOptions throttle;
+    unsigned long long timeout_ms;
+    int server_stats;
+    unsigned long long repeat; // 0 runs the query once and prints it
+    unsigned long long warmup;
+    int perf_counters;
+    const char *outputs[TEE_MAX_OUTPUTS]; // Export to these targets instead of printing
+    int outputs_count;
+    PartitionOptions partition;
+} CliOptions;
+
+// Returns the index of the first positional argument, or -1 on a bad option
+int parse_cli_options(int argc, char *argv[], CliOptions *options) {
+    memset(options, 0, sizeof(*options));
+    options->chunk_size = DML_DEFAULT_CHUNK_SIZE;
+    options->sleep_ms = DML_DEFAULT_SLEEP_MS;
+    options->target_ms = DML_DEFAULT_TARGET_MS;
+
+    int i = 1;
+    for (; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        int throttle_arg = parse_throttle_option(argc, argv, &i, &options->throttle);
+        if (throttle_arg < 0) {
+            return -1;
+        } else if (throttle_arg) {
+            continue;
+        }
+        int trace_arg = parse_trace_option(argc, argv, &i);
+        if (trace_arg < 0) {
+            return -1;
+        } else if (trace_arg) {
+            continue;
+        }
+        if (strcmp(argv[i], "--chunked-dml") == 0) {
+            options->chunked_dml = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--server-stats") == 0) {
+            options->server_stats = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--perf-counters") == 0) {
+            options->perf_counters = 1;
+            continue;
+        }
+        if (!value) {
+            fprintf(stderr, "%s expects a value\n", argv[i]);
+            return -1;
+        }
+        if (strcmp(argv[i], "--chunk-size") == 0) {
+            if (parse_count_option(argv[i], value, &options->chunk_size) != 0) return -1;
+        } else if (strcmp(argv[i], "--sleep-ms") == 0) {
+            char *end = NULL;
+            options->sleep_ms = strtoull(value, &end, 10);
+            if (*end != '\0') {
+                fprintf(stderr, "--sleep-ms expects a number\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--target-ms") == 0) {
+            if (parse_count_option(argv[i], value, &options->target_ms) != 0) return -1;
+        } else if (strcmp(argv[i], "--key") == 0) {
+            options->key_column = value;
+        } else if (strcmp(argv[i], "--output") == 0) {
+            if (options->outputs_count == TEE_MAX_OUTPUTS) {
+                fprintf(stderr, "At most %d --output targets are supported\n", TEE_MAX_OUTPUTS);
+                return -1;
+            }
+            options->outputs[options->outputs_count++] = value;
+        } else if (strcmp(argv[i], "--partition-output") == 0) {
+            options->partition.column = value;
+        } else if (strcmp(argv[i], "--max-file-size") == 0) {
+            unsigned long long megabytes;
+            if (parse_count_option(argv[i], value, &megabytes) != 0) return -1;
+            if (megabytes > PARTITION_MAX_FILE_MB) {
+                fprintf(stderr, "--max-file-size is limited to %d MB\n", PARTITION_MAX_FILE_MB);
+                return -1;
+            }
+            options->partition.max_file_bytes = megabytes << 20;
+        } else if (strcmp(argv[i], "--repeat") == 0) {
+            if (parse_count_option(argv[i], value, &options->repeat) != 0) return -1;
+        } else if (strcmp(argv[i], "--warmup") == 0) {
+            char *end = NULL;
+            options->warmup = strtoull(value, &end, 10);
+            if (*end != '\0') {
+                fprintf(stderr, "--warmup expects a number\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--timeout") == 0) {
+            char *end = NULL;
+            double seconds = strtod(value, &end);
+            if (*end != '\0' || seconds <= 0) {
+                fprintf(stderr, "--timeout expects a number of seconds\n");
+                return -1;
+            }
+            options->timeout_ms = (unsigned long long)(seconds * 1000.0 + 0.5);
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            return -1;
+        }
+        i++;
+    }
+    return i;
+}
+
+int main(int argc, char *argv[]) {
+    if (rgwml_init() != 0) {
+        return EXIT_FAILURE;
+    }
+    if (argc >= 2 && strcmp(argv[1], "copy") == 0) {
+        int status = run_copy(argc - 2, argv + 2, argv[0]);
+        trace_close();
+        rgwml_end();
+        return status;
+    }
+    if (argc >= 2 && strcmp(argv[1], "import") == 0) {
+        int status = run_import(argc - 2, argv + 2, argv[0]);
+        trace_close();
+        rgwml_end();
+        return status;
+    }
+    if (argc >= 2 && strcmp(argv[1], "archive") == 0) {
+        int status = run_archive(argc - 2, argv + 2, argv[0]);
+        trace_close();
+        rgwml_end();
+        return status;
+    }
+    if (argc >= 2 && strcmp(argv[1], "extract") == 0) {
+        int status = run_extract(argc - 2, argv + 2, argv[0]);
+        trace_close();
+        rgwml_end();
+        return status;
+    }
+    if (argc >= 2 && strcmp(argv[1], "--history") == 0) {
+        int status = run_history(argc - 2, argv + 2, argv[0]);
+        trace_close();
+        rgwml_end();
+        return status;
+    }
+    if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+        int status = run_bench(argc - 2, argv + 2, argv[0]);
+        trace_close();
+        rgwml_end();
+        return status;
+    }
+    if (argc >= 2 && strcmp(argv[1], "loadgen") == 0) {
+        int status = run_loadgen(argc - 2, argv + 2, argv[0]);
+        trace_close();
+        rgwml_end();
+        return status;
+    }
+
+    CliOptions options;
+    int first = parse_cli_options(argc, argv, &options);
+    if (first < 0 || argc - first != 2) {
+        print_usage(argv[0]);
+        trace_close();
+        return EXIT_FAILURE;
+    }
+
+    const char *preset_name = argv[first];
+    const char *query = argv[first + 1];
+    if (options.repeat && options.chunked_dml) {
+        fprintf(stderr, "--repeat cannot be combined with --chunked-dml\n");
+        trace_close();
+        return EXIT_FAILURE;
+    }
+    if (options.repeat && (options.timeout_ms || options.server_stats || options.perf_counters ||
+                           throttle_enabled(&options.throttle))) {
+        fprintf(stderr, "--repeat cannot be combined with --timeout, --server-stats, --perf-counters or throttle options\n");
+        trace_close();
+        return EXIT_FAILURE;
+    }
+    if (options.chunked_dml && (options.timeout_ms || options.server_stats || options.perf_counters)) {
+        fprintf(stderr, "--chunked-dml cannot be combined with --timeout, --server-stats or --perf-counters\n");
+        trace_close();
+        return EXIT_FAILURE;
+    }
+    if (options.outputs_count && (options.repeat || options.chunked_dml)) {
+        fprintf(stderr, "--output cannot be combined with --repeat or --chunked-dml\n");
+        trace_close();
+        return EXIT_FAILURE;
+    }
+    if (!options.outputs_count && (options.partition.column || options.partition.max_file_bytes)) {
+        fprintf(stderr, "--partition-output and --max-file-size need --output\n");
+        trace_close();
+        return EXIT_FAILURE;
+    }
+
+    double started = trace_begin();
+    cJSON *config_json = load_config(CONFIG_PATH);
+    trace_span("load config", started, NULL, 0);
+    if (!config_json) {
+        trace_close();
+        return EXIT_FAILURE;
+    }
+
+    DbPreset db;
+    started = trace_begin();
+    if (route_db_preset(config_json, preset_name, !options.chunked_dml && is_read_only_query(query), &db) != 0) {
+        cJSON_Delete(config_json);
+        trace_close();
+        return EXIT_FAILURE;
+    }
+    trace_span("resolve preset", started, NULL, 0);
+
+    Throttle throttle;
+    Throttle *active_throttle = NULL;
+    if (throttle_setup(&throttle, &options.throttle, config_json, &db, &active_throttle) != 0) {
+        cJSON_Delete(config_json);
+        trace_close();
+        return EXIT_FAILURE;
+    }
+
+    int status = EXIT_SUCCESS;
+    QueryProfile profile;
+    unsigned long long rows = 0;
+    if (options.chunked_dml) {
+        if (run_chunked_dml(&db, query, options.chunk_size, options.sleep_ms, options.target_ms, options.key_column,
+                            active_throttle, &profile, &rows) != 0) {
+            status = EXIT_FAILURE;
+        }
+        record_history(preset_name, query, status != EXIT_SUCCESS, rows, &profile);
+    } else if (options.repeat) {
+        install_sigint_handler();
+        if (run_repeat(&db, query, options.repeat, options.warmup) != 0) {
+            status = EXIT_FAILURE;
+        }
+    } else if (options.outputs_count) {
+        install_sigint_handler();
+        QueryOptions query_options = {active_throttle, options.timeout_ms, options.server_stats};
+        if (options.perf_counters) {
+            perf_open();
+        }
+        if (export_query(&db, query, options.outputs, options.outputs_count, &options.partition, &query_options,
+                         &profile, &rows) != 0) {
+            status = EXIT_FAILURE;
+        } else {
+            perf_report();
+        }
+        perf_close();
+        record_history(preset_name, query, status != EXIT_SUCCESS, rows, &profile);
+    } else {
+        install_sigint_handler();
+        QueryOptions query_options = {active_throttle, options.timeout_ms, options.server_stats};
+        if (options.perf_counters) {
+            // Carry on without counters if the kernel refuses them
+            perf_open();
+        }
+        QueryResult *result = execute_mysql_query(&db, query, &query_options);
+        record_query_history(preset_name, query, result);
+        if (result) {
+            print_query_result(result);
+            if (options.server_stats) {
+                print_query_profile(result);
+            }
+            perf_report();
+            if (result->partial_reason) {
+                status = EXIT_FAILURE;
+            }
+            free_query_result(result);
+        } else {
+            fprintf(stderr, "Query execution failed.\n");
+        }
+        perf_close();
+    }
+
+    throttle_close(active_throttle);
+    cJSON_Delete(config_json);
+    trace_close();
+    rgwml_end();
+
+    return status;
+}
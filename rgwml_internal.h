@@ -0,0 +1,302 @@
+#ifndef RGWML_INTERNAL_H
+#define RGWML_INTERNAL_H
+
+// Types and functions librgwml shares with rgwml_cli. Not part of the stable
+// API in rgwml.h; both are built from the same tree.
+
+#include <stdio.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <mysql/mysql.h>
+#include <cjson/cJSON.h>
+#include "rgwml.h"
+
+// USDT probes for bpftrace/perf/systemtap, e.g.
+//     bpftrace -e 'usdt:./rgwml_cli:rgwml:fetch__batch { @rows = hist(arg1); }' -p PID
+// Each probe is a single nop plus an ELF note until a tracer attaches. Without
+// <sys/sdt.h> (systemtap-sdt-dev) they compile to nothing.
+//     query__start(query)            query__done(rows, failed)
+//     fetch__batch(rows, bytes)      output__flush(target, rows)
+//     alloc__grow(what, bytes)
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define RGWML_HAVE_SDT 1
+#endif
+#endif
+#ifdef RGWML_HAVE_SDT
+#define RGWML_PROBE1(name, a) DTRACE_PROBE1(rgwml, name, a)
+#define RGWML_PROBE2(name, a, b) DTRACE_PROBE2(rgwml, name, a, b)
+#else
+#define RGWML_PROBE1(name, a) do { } while (0)
+#define RGWML_PROBE2(name, a, b) do { } while (0)
+#endif
+
+// Client-side wall clock per phase of a single query
+typedef struct {
+    double connect_seconds;
+    double execute_seconds; // mysql_query() until the result set header arrived
+    double fetch_seconds;
+    unsigned long long bytes; // Sum of the field lengths received
+} QueryProfile;
+
+#define STAT_LIST_MAX 32
+
+// Named counters, e.g. a SHOW SESSION STATUS snapshot
+typedef struct {
+    int count;
+    char names[STAT_LIST_MAX][64];
+    long long values[STAT_LIST_MAX];
+} StatList;
+
+// Server-side cost of one statement, filled in by --server-stats
+typedef struct {
+    StatList status; // SHOW SESSION STATUS deltas
+    StatList statement; // performance_schema statement event, when available
+} ServerStats;
+
+// Rows are kept in row groups of RESULT_CHUNK_ROWS rows (fewer for very
+// wide results, so a group stays within RESULT_CHUNK_CELLS cells) rather than
+// one array. A large result never needs a single huge (or overflowing)
+// allocation, growing it never copies what was fetched, and a filled group
+// can be handed to a worker while the next one is still being fetched.
+#define RESULT_CHUNK_ROWS 65536
+#define RESULT_CHUNK_CELLS (1 << 20)
+#define RESULT_NULL_LENGTH ((unsigned long)-1) // Cell length of SQL NULL
+
+// Structure to store query results; RgwmlResult in the public API
+typedef struct RgwmlResult {
+    char ***chunks; // chunks[i] holds rows_per_chunk rows of cols_count strings
+    unsigned long **chunk_lengths; // Parallel to chunks: each cell's byte length, RESULT_NULL_LENGTH for NULL
+    size_t chunks_count;
+    size_t chunks_cap;
+    size_t rows_per_chunk;
+    char **headers; // Array of column headers
+    char **mysql_types; // Array of MySQL column types
+    char **c_types; // Array of C column types
+    unsigned long long rows_count;
+    int cols_count;
+    unsigned long long affected_rows; // For statements without a result set
+    const char *partial_reason; // Set when the fetch was cut short, e.g. "timeout"
+    QueryProfile profile;
+    ServerStats *server_stats; // NULL unless requested
+    unsigned char *decimal_precision; // Per column: DECIMAL(p,s) precision, 0 for other types
+    unsigned char *decimal_scale;
+    unsigned char *binary; // Per column: binary charset, so the bytes need not be text
+    unsigned long *max_lengths; // Longest cell per column, NULL until computed
+    unsigned long long cell_bytes; // Sum of strlen + 1 over all cells, with max_lengths
+} QueryResult;
+
+// Connection settings for a single entry of db_presets
+typedef struct {
+    const char *name;
+    const char *host;
+    const char *user;
+    const char *password;
+    const char *database;
+} DbPreset;
+
+#define CONNECT_LOCAL_INFILE 0x1 // Allow LOAD DATA LOCAL INFILE on the connection
+#define THROTTLE_CHECK_ROWS 256 // Fetch loops report progress in steps of this many rows
+
+typedef struct {
+    double max_rows_per_sec;
+    double max_bytes_per_sec;
+    unsigned long long max_threads_running;
+    unsigned long long max_replica_lag;
+    const char *monitor_preset; // Server to poll for load; the queried one by default
+} ThrottleOptions;
+
+typedef struct {
+    ThrottleOptions options;
+    DbPreset monitor_db;
+    MYSQL *monitor;
+    int monitor_failed;
+    int not_a_replica;
+    double window_start;
+    unsigned long long window_rows;
+    unsigned long long window_bytes;
+    double next_poll;
+    double rate_wait;  // Seconds slept to honour the rate limits
+    double load_wait;  // Seconds paused for server load
+} Throttle;
+
+typedef struct {
+    const DbPreset *db;
+    unsigned long thread_id;
+    unsigned long long timeout_ms; // 0 waits for SIGINT only
+    int watching; // 0 when there is neither a timeout nor a SIGINT handler to wait for
+    sem_t wake;
+    pthread_t thread;
+    volatile int finished;
+    volatile int cancelled;
+    int owns_interrupt; // This guard is the one Ctrl-C wakes
+    const char *reason;
+} QueryGuard;
+
+// Process-wide --trace output
+typedef struct {
+    FILE *file;
+    pthread_mutex_t lock;
+    double origin; // now_seconds() at trace_open, ts 0 in the file
+    int events;
+} Tracer;
+
+// Process-wide --perf-counters state. It counts the thread that called
+// perf_open(), so only that thread may bracket phases with it.
+#define PERF_COUNTER_COUNT 4
+#define PERF_MAX_PHASES 16
+
+typedef struct {
+    const char *name;
+    double values[PERF_COUNTER_COUNT]; // -1 when the counter is not available
+    unsigned long long rows; // Rows the phase worked through, for per-row figures
+} PerfPhase;
+
+typedef struct {
+    int enabled;
+    int group_fd;
+    int fds[PERF_COUNTER_COUNT]; // -1 for counters the PMU does not offer
+    int opened; // Counters in the group, in the order of fds
+    unsigned long long start[PERF_COUNTER_COUNT + 2]; // enabled, running, values...
+    PerfPhase phases[PERF_MAX_PHASES];
+    int phase_count;
+} PerfCounters;
+
+#define MORSEL_MAX_WORKERS 4
+
+typedef void (*MorselFn)(void *context, char **cells, size_t rows, int cols_count);
+
+typedef struct {
+    char **cells;
+    size_t rows;
+} Morsel;
+
+typedef struct {
+    MorselFn process;
+    void *context;
+    int cols_count;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    Morsel *queue; // Published groups no worker has taken yet
+    size_t head;
+    size_t count;
+    size_t cap;
+    int closed;
+    int workers_wanted;
+    int workers_count;
+    pthread_t threads[MORSEL_MAX_WORKERS];
+} MorselPool;
+
+// Per-column statistics, gathered one morsel at a time and merged
+typedef struct {
+    pthread_mutex_t lock;
+    unsigned long long cell_bytes;
+    unsigned long *max_lengths;
+} ResultStats;
+
+typedef struct {
+    const char *mysql_type;
+    const char *c_type;
+} TypeMapping;
+
+typedef struct {
+    Throttle *throttle; // NULL for unthrottled
+    unsigned long long timeout_ms; // 0 for no timeout
+    int server_stats; // Snapshot session status around the query
+} QueryOptions;
+
+extern Tracer tracer;
+extern PerfCounters perf;
+extern volatile sig_atomic_t interrupted;
+
+// Results and configuration
+QueryResult* query_result_new(const MYSQL_FIELD *fields, int cols_count);
+char** query_result_row(const QueryResult *result, unsigned long long row);
+char** query_result_append_row(QueryResult *result);
+unsigned long* query_result_lengths(const QueryResult *result, unsigned long long row);
+void free_query_result(QueryResult *result);
+char* read_file(const char* filename);
+cJSON* get_db_preset(cJSON *json, const char* preset_name);
+const char* preset_string(cJSON *preset, const char *key);
+int is_preset_group(cJSON *preset);
+int load_db_preset(cJSON *config, const char *preset_name, DbPreset *out);
+cJSON* load_config(const char *config_path);
+MYSQL* connect_db(const DbPreset *db, int flags);
+double now_seconds(void);
+char* format_string(const char *format, ...);
+char* quote_identifier(const char *name);
+char* quote_table_name(const char *name);
+void sleep_ms(unsigned long ms);
+int is_retryable_error(unsigned int error);
+
+// SQL scanning helpers
+const char* skip_space(const char *p);
+int match_keyword(const char *p, const char *keyword);
+const char* skip_identifier(const char *p);
+const char* find_top_level_keyword(const char *p, const char *keyword);
+
+// Throttling
+int throttle_enabled(const ThrottleOptions *options);
+int throttle_init(Throttle *throttle, const ThrottleOptions *options, cJSON *config, const DbPreset *db);
+long long monitor_value(MYSQL *conn, const char *sql, const char *column);
+int throttle_server_busy(Throttle *throttle, char *reason, size_t reason_size);
+void throttle_wait(Throttle *throttle, unsigned long long rows, unsigned long long bytes);
+void throttle_prepare_stream(const Throttle *throttle, MYSQL *conn);
+int throttle_setup(Throttle *throttle, const ThrottleOptions *options, cJSON *config, const DbPreset *db, Throttle **active);
+void throttle_close(Throttle *throttle);
+
+// Query cancellation
+void handle_sigint(int sig);
+void install_sigint_handler(void);
+// MySQL's MAX_EXECUTION_TIME reports ER_QUERY_TIMEOUT (3024); MariaDB's
+// max_statement_time reports this one
+#define ER_STATEMENT_TIMEOUT 1969
+
+int query_timed_out(unsigned int error);
+int query_guard_start(QueryGuard *guard, const DbPreset *db, MYSQL *conn, unsigned long long timeout_ms);
+void query_guard_stop(QueryGuard *guard);
+char* apply_execution_time_limit(MYSQL *conn, const char *query, unsigned long long timeout_ms);
+
+// Tracing
+long trace_thread_id(void);
+int trace_open(const char *path);
+void trace_close(void);
+double trace_begin(void);
+void trace_event(const char *phase, const char *name, double started, double ended, const char *arg_name,
+                 long long arg_value, const char *text_name, const char *text);
+void trace_span(const char *name, double started, const char *arg_name, long long arg_value);
+void trace_thread_name(const char *name);
+
+// Hardware performance counters
+int perf_open(void);
+void perf_close(void);
+int perf_read(unsigned long long *out);
+void perf_begin(void);
+void perf_end(const char *name, unsigned long long rows);
+
+// Morsel-driven result processing
+int morsel_default_workers(void);
+void morsel_pool_init(MorselPool *pool, int workers, int cols_count, MorselFn process, void *context);
+void morsel_pool_publish(MorselPool *pool, char **cells, size_t rows);
+void morsel_pool_close(MorselPool *pool);
+void morsel_pool_finish(MorselPool *pool);
+void result_stats_morsel(void *context, char **cells, size_t rows, int cols_count);
+int result_stats_start(MorselPool *pool, ResultStats *stats, int cols_count);
+void result_stats_finish(MorselPool *pool, ResultStats *stats, QueryResult *result);
+
+// Server-side cost capture
+int stat_list_add(StatList *list, const char *name, long long value);
+int stat_list_find(const StatList *list, const char *name);
+int capture_session_status(MYSQL *conn, StatList *out);
+void capture_statement_event(MYSQL *conn, StatList *out);
+ServerStats* finish_server_stats(MYSQL *conn, const StatList *before, const StatList *calibration);
+
+// Query execution
+TypeMapping mysql_type_to_c_type(enum enum_field_types type);
+int copy_row_cells(char **cells, unsigned long *cell_lengths, MYSQL_ROW row, const unsigned long *lengths,
+                   int cols_count);
+QueryResult* execute_mysql_query(const DbPreset *db, const char *query, const QueryOptions *options);
+
+#endif